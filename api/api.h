@@ -67,11 +67,28 @@ void		 endpoints_free(endpoints_t *ing);
 endpoints_t	*endpoints_make(json_object *obj);
 int		 endpoints_equal(endpoints_t *, endpoints_t *);
 
+/*
+ * Nodes.  We only store the node's zone, which is used for topology-aware
+ * routing.
+ */
+#define	NODE_LABEL_ZONE		"topology.kubernetes.io/zone"
+#define	NODE_LABEL_ZONE_BETA	"failure-domain.beta.kubernetes.io/zone"
+
+typedef struct {
+	char	*nd_name;
+	char	*nd_zone;
+} node_t;
+
+void		 node_free(node_t *);
+node_t		*node_make(json_object *);
+int		 node_equal(const node_t *, const node_t *);
+
 /*
  * Services
  */
 
 #define	SV_TYPE_EXTERNALNAME	"ExternalName"
+#define	SV_SESSION_AFFINITY_CLIENTIP	"ClientIP"
 
 typedef enum {
 	SV_P_TCP,
@@ -100,6 +117,7 @@ void		 service_free(service_t *);
 service_t	*service_make(json_object *);
 service_port_t	*service_find_port(const service_t *, const char *name,
 				   service_proto_t);
+int		 service_has_cluster_ip(const service_t *);
 
 /*
  * Ingresses
@@ -151,6 +169,21 @@ service_port_t	*service_find_port(const service_t *, const char *name,
 #define	IN_COMPRESS_TYPES		A_INGRESS "compress-types"
 #define	IN_SERVER_PUSH			A_INGRESS "server-push"
 #define	IN_HTTP2_ENABLE			A_INGRESS "http2-enable"
+#define	IN_LOAD_BALANCE			A_INGRESS "load-balance"
+#define	IN_LOAD_BALANCE_RANDOM		"random"
+#define	IN_LOAD_BALANCE_LEAST_REQUEST	"least-request"
+#define	IN_LOAD_BALANCE_EWMA		"ewma"
+#define	IN_LOAD_BALANCE_HASH		"hash"
+#define	IN_HASH_BY			A_INGRESS "hash-by"
+#define	IN_HASH_BY_CLIENT_IP		"client-ip"
+#define	IN_HASH_BY_COOKIE		"cookie:"
+#define	IN_HASH_BY_HEADER		"header:"
+#define	IN_TOPOLOGY_AWARE_ROUTING	A_INGRESS "topology-aware-routing"
+#define	IN_SLOW_START_WINDOW		A_INGRESS "slow-start-window"
+#define	IN_SLOW_START_CURVE		A_INGRESS "slow-start-curve"
+#define	IN_SLOW_START_CURVE_LINEAR	"linear"
+#define	IN_SLOW_START_CURVE_EXPONENTIAL	"exponential"
+#define	IN_SERVICE_UPSTREAM		A_INGRESS "service-upstream"
 
 /* Ingress annotations - Torchbox */
 #define	IN_DEBUG_LOG			A_TORCHBOX "debug-log"
@@ -197,7 +230,14 @@ typedef struct {
 } secret_t;
 
 secret_t	*secret_make(json_object *obj);
-SSL_CTX		*secret_make_ssl_ctx(secret_t *);
+int		 secret_check_tls_data(const char *ns,
+				       const char *name,
+				       const char *certb64,
+				       const char *keyb64);
+SSL_CTX		*secret_make_ssl_ctx_data(const char *ns,
+					  const char *name,
+					  const char *certb64,
+					  const char *keyb64);
 void		 secret_free(secret_t *sec);
 
 /*
@@ -289,19 +329,104 @@ void			 cluster_config_free(cluster_config_t *);
 typedef struct cluster {
 	pthread_rwlock_t	 cs_lock;
 	hash_t			 cs_namespaces;
+	hash_t			 cs_nodes;
 	cluster_callback_t	 cs_callback;
 	void			*cs_callbackdata;
 	cluster_config_t	*cs_config;
+	hash_t			 cs_changed;	/* Objects changed since the
+						   last take_changes	     */
+	int			 cs_changed_all;
 } cluster_t;
 
 cluster_t	*cluster_make(void);
 namespace_t	*cluster_get_namespace(cluster_t *, const char *nsname);
+namespace_t	*cluster_find_namespace(cluster_t *, const char *nsname);
 void		 cluster_set_configmap(cluster_t *, configmap_t *);
 cluster_cert_t	*cluster_get_cert_for_hostname(cluster_t *, const char *);
+void		 cluster_put_node(cluster_t *, node_t *);
+node_t		*cluster_get_node(cluster_t *, const char *name);
+void		 cluster_del_node(cluster_t *, const char *name);
 int		 cluster_domain_for_ns(cluster_t *, const char *dom,
 				       const char *ns);
 void		 cluster_free(cluster_t *cluster);
 
+/*
+ * Track which objects have changed, so the remap_db can be rebuilt only where
+ * it needs to be.  Each object is named by a key made by cluster_object_key();
+ * kind is the Kubernetes kind ("Ingress", "Service", ...).  Changes which
+ * can't be tracked per object, like a resync or a ConfigMap or Node change,
+ * mark everything changed.
+ *
+ * cluster_take_changes() returns the set of changed keys and starts a new
+ * one, or returns NULL if everything must be rebuilt.  The caller frees the
+ * set with hash_free().  The caller must hold the cluster write lock for all
+ * of these.
+ */
+#define	CLUSTER_KIND_INGRESS	"Ingress"
+#define	CLUSTER_KIND_SERVICE	"Service"
+#define	CLUSTER_KIND_ENDPOINTS	"Endpoints"
+#define	CLUSTER_KIND_SECRET	"Secret"
+
+int		 cluster_object_key(char *buf, size_t bufsz, const char *kind,
+				    const char *ns, const char *name);
+void		 cluster_mark_changed(cluster_t *, const char *kind,
+				      const char *ns, const char *name);
+void		 cluster_mark_all_changed(cluster_t *);
+hash_t		 cluster_take_changes(cluster_t *);
+
+/*
+ * A reverse index of the objects which routing depends on: the Services,
+ * Endpoints and Secrets used by the Ingresses we handle, and the Secrets in
+ * the tls-certificates configuration.  The watcher uses this to tell which
+ * events need a rebuild.  Each key made by cluster_object_key() maps to the
+ * number of references to it.
+ *
+ * classes is the set of Ingress classes we handle, and upstream is the
+ * default for the service-upstream annotation; the caller owns classes.
+ * refs_rebuild() recomputes the index from the whole cluster, and must be
+ * called after a resync or a ConfigMap change.  An Ingress must be removed
+ * with refs_del_ingress() before it changes, and added again afterwards.
+ */
+typedef struct {
+	hash_t	 rf_refs;
+	hash_t	 rf_classes;
+	int	 rf_upstream;
+} refs_t;
+
+refs_t		*refs_new(hash_t classes, int upstream);
+void		 refs_free(refs_t *);
+void		 refs_rebuild(refs_t *, cluster_t *);
+int		 refs_ingress_wanted(const refs_t *, const ingress_t *);
+void		 refs_add_ingress(refs_t *, const ingress_t *);
+void		 refs_del_ingress(refs_t *, const ingress_t *);
+int		 refs_relevant(const refs_t *, namespace_t *, const char *kind,
+			       const char *name);
+
+/*
+ * An incremental parser for a JSON object with one large array member, such
+ * as a list response from the API server.  Input is passed to
+ * jsonstream_feed() in pieces of any size as it arrives; each element of the
+ * array called 'array' is passed to fn as soon as it's complete, and freed
+ * when fn returns, so memory use depends on the largest element rather than
+ * on the whole response.  fn must take a reference to keep the element.
+ *
+ * jsonstream_feed() returns -1 if the input is not valid JSON, after which
+ * further input is ignored.  Once the whole object has been read,
+ * jsonstream_object() returns its other members (such as metadata), and
+ * jsonstream_found() returns 1 if it had the array.  jsonstream_object()
+ * returns NULL if the object is incomplete.  The returned object belongs to
+ * the stream.
+ */
+typedef struct jsonstream jsonstream_t;
+typedef void (*jsonstream_item_fn) (json_object *item, void *data);
+
+jsonstream_t	*jsonstream_new(const char *array, jsonstream_item_fn fn,
+				void *data);
+void		 jsonstream_free(jsonstream_t *);
+int		 jsonstream_feed(jsonstream_t *, const char *data, size_t len);
+json_object	*jsonstream_object(const jsonstream_t *);
+int		 jsonstream_found(const jsonstream_t *);
+
 #ifdef __cplusplus
 }
 #endif
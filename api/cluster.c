@@ -8,6 +8,7 @@
  * warranty.
  */
 
+#include	<stdio.h>
 #include	<string.h>
 #include	<stdlib.h>
 #include	<pthread.h>
@@ -38,7 +39,14 @@ cluster_t	*ret;
 		return NULL;
 	}
 
+	if ((ret->cs_nodes = hash_new(127, (hash_free_fn) node_free)) == NULL) {
+		hash_free(ret->cs_namespaces);
+		free(ret);
+		return NULL;
+	}
+
 	ret->cs_config = cluster_config_new();
+	ret->cs_changed_all = 1;
 
 	pthread_rwlock_init(&ret->cs_lock, NULL);
 
@@ -59,6 +67,107 @@ namespace_t	*ret;
 	return ret;
 }
 
+/*
+ * Like cluster_get_namespace, but returns NULL instead of creating the
+ * namespace, so it doesn't modify the cluster.
+ */
+namespace_t *
+cluster_find_namespace(cluster_t *cs, const char *name)
+{
+	return hash_get(cs->cs_namespaces, name);
+}
+
+/*
+ * hash_set frees any existing node with the same name.
+ */
+void
+cluster_put_node(cluster_t *cs, node_t *node)
+{
+	hash_set(cs->cs_nodes, node->nd_name, node);
+}
+
+node_t *
+cluster_get_node(cluster_t *cs, const char *name)
+{
+	return hash_get(cs->cs_nodes, name);
+}
+
+void
+cluster_del_node(cluster_t *cs, const char *name)
+{
+node_t	*node;
+
+	if ((node = hash_get(cs->cs_nodes, name)) == NULL)
+		return;
+
+	hash_del(cs->cs_nodes, name);
+	node_free(node);
+}
+
+/*
+ * Make the key for an object in the changed set: "Kind/namespace/name".
+ * Returns -1 if it doesn't fit in buf.
+ */
+int
+cluster_object_key(char *buf, size_t bufsz, const char *kind, const char *ns,
+		   const char *name)
+{
+int	n;
+
+	n = snprintf(buf, bufsz, "%s/%s/%s", kind, ns, name);
+	if (n < 0 || (size_t) n >= bufsz)
+		return -1;
+	return 0;
+}
+
+void
+cluster_mark_changed(cluster_t *cs, const char *kind, const char *ns,
+		     const char *name)
+{
+char	key[512];
+
+	if (cs->cs_changed_all)
+		return;
+
+	if (cluster_object_key(key, sizeof(key), kind, ns, name) == -1) {
+		cluster_mark_all_changed(cs);
+		return;
+	}
+
+	if (cs->cs_changed == NULL &&
+	    (cs->cs_changed = hash_new(127, NULL)) == NULL) {
+		cluster_mark_all_changed(cs);
+		return;
+	}
+
+	if (hash_set(cs->cs_changed, key, HASH_PRESENT) == -1)
+		cluster_mark_all_changed(cs);
+}
+
+void
+cluster_mark_all_changed(cluster_t *cs)
+{
+	cs->cs_changed_all = 1;
+	hash_free(cs->cs_changed);
+	cs->cs_changed = NULL;
+}
+
+hash_t
+cluster_take_changes(cluster_t *cs)
+{
+hash_t	ret;
+
+	if (cs->cs_changed_all) {
+		cs->cs_changed_all = 0;
+		return NULL;
+	}
+
+	if ((ret = cs->cs_changed) == NULL)
+		ret = hash_new(1, NULL);
+	cs->cs_changed = NULL;
+	return ret;
+}
+
 cluster_config_t *
 cluster_config_new(void)
 {
@@ -115,9 +224,10 @@ cluster_domain_t	*dom, *domtmp;
 void
 cluster_config_add_certs(cluster_config_t *cc, const char *certs)
 {
-char	*s, *p;
+char	*buf, *s, *p;
 
-	s = strdup(certs);
+	/* strsep() moves s, so keep the buffer to free it */
+	s = buf = strdup(certs);
 	while ((p = strsep(&s, " \t,")) != NULL) {
 	char	*certns, *certname, *dom;
 
@@ -147,7 +257,7 @@ char	*s, *p;
 		}
 	}
 
-	free(s);
+	free(buf);
 }
 
 /*
@@ -343,6 +453,8 @@ cluster_free(cluster_t *cs)
 {
 	TSDebug("kubernetes", "cluster_free: %p", cs);
 	hash_free(cs->cs_namespaces);
+	hash_free(cs->cs_nodes);
+	hash_free(cs->cs_changed);
 	cluster_config_free(cs->cs_config);
 	pthread_rwlock_destroy(&cs->cs_lock);
 	free(cs);
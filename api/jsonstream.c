@@ -0,0 +1,246 @@
+/* vim:set sw=8 ts=8 noet: */
+/*
+ * Copyright (c) 2016-2017 Torchbox Ltd.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely. This software is provided 'as-is', without any express or implied
+ * warranty.
+ */
+
+/*
+ * jsonstream: incremental parsing of a JSON object containing a large array,
+ * such as a Kubernetes list response.  See api.h.
+ *
+ * We only parse the outer object ourselves.  Member names, member values and
+ * array elements are each handed to a json-c tokener, which keeps its own
+ * state across calls, so a value can be split between any number of reads.
+ */
+
+#include	<ctype.h>
+#include	<limits.h>
+#include	<stdlib.h>
+#include	<string.h>
+
+#include	<json.h>
+
+#include	"autoconf.h"
+#include	"api.h"
+
+#define	JS_START	0	/* Before the opening '{' */
+#define	JS_KEY		1	/* Before a member name, or the closing '}' */
+#define	JS_NAME		2	/* In a member name */
+#define	JS_COLON	3	/* Before the ':' after a member name */
+#define	JS_VALUE	4	/* Before a member value */
+#define	JS_MEMBER	5	/* In a member value */
+#define	JS_ARRAY	6	/* In the array, before an element or ']' */
+#define	JS_ELEMENT	7	/* In an array element */
+#define	JS_DONE		8	/* After the closing '}' */
+#define	JS_ERROR	9
+
+struct jsonstream {
+	json_tokener		*js_tok;
+	int			 js_state;
+	char			*js_array;	/* The array to stream */
+	int			 js_seen;	/* Whether we found it */
+	json_object		*js_name;	/* Current member name */
+	json_object		*js_object;	/* Every other member */
+	jsonstream_item_fn	 js_fn;
+	void			*js_data;
+};
+
+jsonstream_t *
+jsonstream_new(const char *array, jsonstream_item_fn fn, void *data)
+{
+jsonstream_t	*js;
+
+	if ((js = calloc(1, sizeof(*js))) == NULL)
+		return NULL;
+
+	if ((js->js_tok = json_tokener_new()) == NULL ||
+	    (js->js_object = json_object_new_object()) == NULL ||
+	    (js->js_array = strdup(array)) == NULL) {
+		jsonstream_free(js);
+		return NULL;
+	}
+
+	js->js_state = JS_START;
+	js->js_fn = fn;
+	js->js_data = data;
+	return js;
+}
+
+void
+jsonstream_free(jsonstream_t *js)
+{
+	if (js == NULL)
+		return;
+
+	if (js->js_tok)
+		json_tokener_free(js->js_tok);
+	if (js->js_name)
+		json_object_put(js->js_name);
+	if (js->js_object)
+		json_object_put(js->js_object);
+	free(js->js_array);
+	free(js);
+}
+
+/*
+ * Give the tokener as much of the input as it will take.  Return 1 and set
+ * *obj if a value was completed, 0 if the tokener needs more input, or -1 on
+ * error.  *used is set to the number of bytes consumed.  The value may be
+ * NULL, since that's how json-c represents a JSON null.
+ */
+static int
+jsonstream_parse(jsonstream_t *js, const char *p, size_t len,
+		 json_object **obj, size_t *used)
+{
+enum json_tokener_error	err;
+
+	if (len > INT_MAX)
+		len = INT_MAX;
+
+	*obj = json_tokener_parse_ex(js->js_tok, p, (int) len);
+	err = json_tokener_get_error(js->js_tok);
+
+	if (err == json_tokener_continue) {
+		*used = len;
+		return 0;
+	}
+
+	if (err != json_tokener_success)
+		return -1;
+
+#ifdef HAVE_JSON_TOKENER_GET_PARSE_END
+	*used = json_tokener_get_parse_end(js->js_tok);
+#else
+	/* json-c before 0.15 has no accessor for this */
+	*used = js->js_tok->char_offset;
+#endif
+	return 1;
+}
+
+int
+jsonstream_feed(jsonstream_t *js, const char *data, size_t len)
+{
+const char	*p = data, *end = data + len;
+json_object	*obj;
+size_t		 used;
+int		 ret;
+
+	while (p < end && js->js_state != JS_ERROR) {
+		/* Whitespace is allowed between any two tokens */
+		if (js->js_state != JS_NAME && js->js_state != JS_MEMBER &&
+		    js->js_state != JS_ELEMENT && isspace((unsigned char) *p)) {
+			p++;
+			continue;
+		}
+
+		switch (js->js_state) {
+		case JS_START:
+			if (*p++ != '{')
+				js->js_state = JS_ERROR;
+			else
+				js->js_state = JS_KEY;
+			break;
+
+		case JS_KEY:
+			if (*p == ',')
+				p++;
+			else if (*p == '}') {
+				p++;
+				js->js_state = JS_DONE;
+			} else
+				js->js_state = JS_NAME;
+			break;
+
+		case JS_COLON:
+			if (*p++ != ':')
+				js->js_state = JS_ERROR;
+			else
+				js->js_state = JS_VALUE;
+			break;
+
+		case JS_VALUE:
+			if (*p == '[' && strcmp(json_object_get_string(
+					js->js_name), js->js_array) == 0) {
+				p++;
+				json_object_put(js->js_name);
+				js->js_name = NULL;
+				js->js_seen = 1;
+				js->js_state = JS_ARRAY;
+			} else
+				js->js_state = JS_MEMBER;
+			break;
+
+		case JS_ARRAY:
+			if (*p == ',')
+				p++;
+			else if (*p == ']') {
+				p++;
+				js->js_state = JS_KEY;
+			} else
+				js->js_state = JS_ELEMENT;
+			break;
+
+		case JS_NAME:
+		case JS_MEMBER:
+		case JS_ELEMENT:
+			ret = jsonstream_parse(js, p, end - p, &obj, &used);
+			if (ret == -1) {
+				js->js_state = JS_ERROR;
+				break;
+			}
+
+			p += used;
+			if (ret == 0)
+				break;
+
+			if (js->js_state == JS_NAME) {
+				if (!json_object_is_type(obj,
+							 json_type_string)) {
+					json_object_put(obj);
+					js->js_state = JS_ERROR;
+					break;
+				}
+				js->js_name = obj;
+				js->js_state = JS_COLON;
+			} else if (js->js_state == JS_MEMBER) {
+				json_object_object_add(js->js_object,
+					json_object_get_string(js->js_name),
+					obj);
+				json_object_put(js->js_name);
+				js->js_name = NULL;
+				js->js_state = JS_KEY;
+			} else {
+				if (obj) {
+					js->js_fn(obj, js->js_data);
+					json_object_put(obj);
+				}
+				js->js_state = JS_ARRAY;
+			}
+			break;
+
+		case JS_DONE:
+			js->js_state = JS_ERROR;
+			break;
+		}
+	}
+
+	return js->js_state == JS_ERROR ? -1 : 0;
+}
+
+json_object *
+jsonstream_object(const jsonstream_t *js)
+{
+	if (js->js_state != JS_DONE)
+		return NULL;
+	return js->js_object;
+}
+
+int
+jsonstream_found(const jsonstream_t *js)
+{
+	return js->js_state == JS_DONE && js->js_seen;
+}
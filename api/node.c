@@ -0,0 +1,79 @@
+/* vim:set sw=8 ts=8 noet: */
+/*
+ * Copyright (c) 2016-2017 Torchbox Ltd.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely. This software is provided 'as-is', without any express or implied
+ * warranty.
+ */
+
+#include	<string.h>
+#include	<stdlib.h>
+
+#include	<ts/ts.h>
+
+#include	"api.h"
+
+void
+node_free(node_t *node)
+{
+	free(node->nd_name);
+	free(node->nd_zone);
+	free(node);
+}
+
+node_t *
+node_make(json_object *obj)
+{
+node_t		*node = NULL;
+json_object	*metadata, *tmp, *labels;
+
+	if ((node = calloc(1, sizeof(*node))) == NULL)
+		return NULL;
+
+	if (!json_object_object_get_ex(obj, "metadata", &metadata)
+	    || !json_object_is_type(metadata, json_type_object)) {
+		TSDebug("kubernetes_api", "node_make: no metadata! (obj: [%s]",
+			json_object_get_string(obj));
+		goto error;
+	}
+
+	if (!json_object_object_get_ex(metadata, "name", &tmp)
+	    || !json_object_is_type(tmp, json_type_string)) {
+		TSDebug("kubernetes_api", "node_make: no name!");
+		goto error;
+	}
+	node->nd_name = strdup(json_object_get_string(tmp));
+
+	if (!json_object_object_get_ex(metadata, "labels", &labels)
+	    || !json_object_is_type(labels, json_type_object))
+		return node;
+
+	if ((json_object_object_get_ex(labels, NODE_LABEL_ZONE, &tmp) ||
+	     json_object_object_get_ex(labels, NODE_LABEL_ZONE_BETA, &tmp))
+	    && json_object_is_type(tmp, json_type_string))
+		node->nd_zone = strdup(json_object_get_string(tmp));
+
+	return node;
+
+error:
+	node_free(node);
+	return NULL;
+}
+
+/*
+ * Return 1 if two nodes are the same, as far as we care.  Nodes are updated
+ * every few seconds with their status, which doesn't affect us.
+ */
+int
+node_equal(const node_t *a, const node_t *b)
+{
+	if (strcmp(a->nd_name, b->nd_name))
+		return 0;
+
+	if (a->nd_zone == NULL || b->nd_zone == NULL)
+		return a->nd_zone == b->nd_zone;
+
+	return strcmp(a->nd_zone, b->nd_zone) == 0;
+}
@@ -0,0 +1,199 @@
+/* vim:set sw=8 ts=8 noet: */
+/*
+ * Copyright (c) 2016-2017 Torchbox Ltd.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely. This software is provided 'as-is', without any express or implied
+ * warranty.
+ */
+
+/*
+ * refs: which cluster objects routing depends on.  See api.h.
+ */
+
+#include	<stdint.h>
+#include	<string.h>
+#include	<stdlib.h>
+
+#include	<ts/ts.h>
+
+#include	"api.h"
+
+/*
+ * Parse a boolean annotation the same way the remap_db build does, so we
+ * agree with it about which Endpoints a path uses.
+ */
+static int
+truefalse(const char *str)
+{
+	if (strcmp(str, "true") == 0)
+		return 1;
+	return 0;
+}
+
+refs_t *
+refs_new(hash_t classes, int upstream)
+{
+refs_t	*rf;
+
+	if ((rf = calloc(1, sizeof(*rf))) == NULL)
+		return NULL;
+
+	if ((rf->rf_refs = hash_new(127, NULL)) == NULL) {
+		free(rf);
+		return NULL;
+	}
+
+	rf->rf_classes = classes;
+	rf->rf_upstream = upstream;
+	return rf;
+}
+
+void
+refs_free(refs_t *rf)
+{
+	if (rf == NULL)
+		return;
+
+	hash_free(rf->rf_refs);
+	free(rf);
+}
+
+/*
+ * Add n (which may be negative) to the references to an object.  If we can't
+ * make the key, the object won't be found either, so there's nothing to do.
+ */
+static void
+refs_count(refs_t *rf, const char *kind, const char *ns, const char *name,
+	   int n)
+{
+char		key[512];
+intptr_t	count;
+
+	if (name == NULL ||
+	    cluster_object_key(key, sizeof(key), kind, ns, name) == -1)
+		return;
+
+	count = (intptr_t) hash_get(rf->rf_refs, key) + n;
+	if (count > 0)
+		hash_set(rf->rf_refs, key, (void *) count);
+	else
+		hash_del(rf->rf_refs, key);
+}
+
+int
+refs_ingress_wanted(const refs_t *rf, const ingress_t *ing)
+{
+const char	*cls;
+
+	if ((cls = hash_get(ing->in_annotations, IN_CLASS)) == NULL)
+		return 1;
+	return rf->rf_classes && hash_get(rf->rf_classes, cls) == HASH_PRESENT;
+}
+
+static void
+refs_ingress(refs_t *rf, const ingress_t *ing, int n)
+{
+const char	*ns = ing->in_namespace, *value;
+int		 upstream = rf->rf_upstream;
+size_t		 i, j;
+
+	if (!refs_ingress_wanted(rf, ing))
+		return;
+
+	if ((value = hash_get(ing->in_annotations,
+			      IN_SERVICE_UPSTREAM)) != NULL)
+		upstream = truefalse(value);
+
+	for (i = 0; i < ing->in_nrules; i++) {
+	ingress_rule_t	*rule = &ing->in_rules[i];
+
+		for (j = 0; j < rule->ir_npaths; j++) {
+		const char	*svc = rule->ir_paths[j].ip_service_name;
+
+			refs_count(rf, CLUSTER_KIND_SERVICE, ns, svc, n);
+			if (!upstream)
+				refs_count(rf, CLUSTER_KIND_ENDPOINTS, ns, svc,
+					   n);
+		}
+	}
+
+	for (i = 0; i < ing->in_ntls; i++)
+		refs_count(rf, CLUSTER_KIND_SECRET, ns,
+			   ing->in_tls[i].it_secret_name, n);
+
+	refs_count(rf, CLUSTER_KIND_SECRET, ns,
+		   hash_get(ing->in_annotations, IN_AUTH_SECRET), n);
+}
+
+void
+refs_add_ingress(refs_t *rf, const ingress_t *ing)
+{
+	refs_ingress(rf, ing, 1);
+}
+
+void
+refs_del_ingress(refs_t *rf, const ingress_t *ing)
+{
+	refs_ingress(rf, ing, -1);
+}
+
+/*
+ * The caller must hold the cluster lock.
+ */
+void
+refs_rebuild(refs_t *rf, cluster_t *cs)
+{
+hash_t		 refs;
+namespace_t	*ns;
+ingress_t	*ing;
+cluster_cert_t	*crt;
+
+	if ((refs = hash_new(127, NULL)) == NULL)
+		return;
+	hash_free(rf->rf_refs);
+	rf->rf_refs = refs;
+
+	hash_foreach(cs->cs_namespaces, NULL, NULL, &ns)
+		hash_foreach(ns->ns_ingresses, NULL, NULL, &ing)
+			refs_add_ingress(rf, ing);
+
+	if (cs->cs_config)
+		TAILQ_FOREACH(crt, &cs->cs_config->cc_certs, cr_entry)
+			refs_count(rf, CLUSTER_KIND_SECRET, crt->cr_namespace,
+				   crt->cr_name, 1);
+}
+
+/*
+ * Return 1 if a change to this object could change routing.  Objects of kinds
+ * we don't index are always relevant.
+ */
+int
+refs_relevant(const refs_t *rf, namespace_t *ns, const char *kind,
+	      const char *name)
+{
+char		 key[512];
+service_t	*svc;
+
+	if (strcmp(kind, CLUSTER_KIND_SERVICE) != 0 &&
+	    strcmp(kind, CLUSTER_KIND_ENDPOINTS) != 0 &&
+	    strcmp(kind, CLUSTER_KIND_SECRET) != 0)
+		return 1;
+
+	if (cluster_object_key(key, sizeof(key), kind, ns->ns_name,
+			       name) == -1 ||
+	    hash_get(rf->rf_refs, key) != NULL)
+		return 1;
+
+	/*
+	 * A headless Service has no ClusterIP, so its Endpoints are used even
+	 * by Ingresses which asked for service-upstream.
+	 */
+	if (strcmp(kind, CLUSTER_KIND_ENDPOINTS) == 0 &&
+	    (svc = namespace_get_service(ns, name)) != NULL &&
+	    !service_has_cluster_ip(svc))
+		return refs_relevant(rf, ns, CLUSTER_KIND_SERVICE, name);
+
+	return 0;
+}
@@ -95,40 +95,94 @@ error:
 }
 
 
-SSL_CTX *
-secret_make_ssl_ctx(secret_t *secret)
+/*
+ * Check that the base64-encoded PEM certificate chain and key of the Secret
+ * ns/name can be parsed, and that the key belongs to the first certificate.
+ * This is much cheaper than building an SSL_CTX, and catches the same
+ * mistakes.  Returns 0 if they're valid, -1 if not.
+ */
+int
+secret_check_tls_data(const char *ns, const char *name,
+		      const char *certb64, const char *keyb64)
 {
-SSL_CTX		*ctx = NULL;
-const char	*certb64, *keyb64;
 unsigned char	*certstr = NULL, *keystr = NULL;
 size_t		 certlen, keylen;
 BIO		*bio = NULL;
 X509		*cert = NULL;
 EVP_PKEY	*key = NULL;
+int		 ret = -1;
 
-	if ((certb64 = hash_get(secret->se_data, "tls.crt")) == NULL) {
-		TSDebug("kubernetes_api", "secret_make_ssl_ctx %s/%s: no cert",
-			secret->se_namespace, secret->se_name);
-		return NULL;
+	certlen = strlen(certb64);
+	keylen = strlen(keyb64);
+	if ((certstr = malloc(base64_decode_len(certlen))) == NULL ||
+	    (keystr = malloc(base64_decode_len(keylen))) == NULL)
+		goto done;
+	certlen = base64_decode(certb64, certlen, certstr);
+	keylen = base64_decode(keyb64, keylen, keystr);
+
+	if ((bio = BIO_new_mem_buf(certstr, certlen)) == NULL)
+		goto done;
+	if ((cert = PEM_read_bio_X509(bio, NULL, NULL, NULL)) == NULL) {
+		TSDebug("kubernetes_api", "secret_check_tls_data %s/%s: "
+			"can't parse certificate", ns, name);
+		goto done;
 	}
+	BIO_free(bio);
+
+	if ((bio = BIO_new_mem_buf(keystr, keylen)) == NULL)
+		goto done;
+	if ((key = PEM_read_bio_PrivateKey(bio, NULL, NULL, NULL)) == NULL) {
+		TSDebug("kubernetes_api", "secret_check_tls_data %s/%s: "
+			"can't parse key", ns, name);
+		goto done;
+	}
+
+	if (X509_check_private_key(cert, key) != 1) {
+		TSDebug("kubernetes_api", "secret_check_tls_data %s/%s: "
+			"key doesn't match certificate", ns, name);
+		goto done;
+	}
+
+	ret = 0;
+
+done:
+	free(certstr);
+	free(keystr);
+	if (cert)
+		X509_free(cert);
+	if (key)
+		EVP_PKEY_free(key);
+	if (bio)
+		BIO_free(bio);
+	return ret;
+}
+
+/*
+ * Build an SSL_CTX from the base64-encoded PEM certificate chain and key of
+ * the Secret ns/name, which are only used for logging.
+ */
+SSL_CTX *
+secret_make_ssl_ctx_data(const char *ns, const char *name,
+			 const char *certb64, const char *keyb64)
+{
+SSL_CTX		*ctx = NULL;
+unsigned char	*certstr = NULL, *keystr = NULL;
+size_t		 certlen, keylen;
+BIO		*bio = NULL;
+X509		*cert = NULL;
+EVP_PKEY	*key = NULL;
 
 	certlen = strlen(certb64);
 	certstr = malloc(base64_decode_len(certlen));
 	certlen = base64_decode(certb64, certlen, certstr);
 
-	if ((keyb64 = hash_get(secret->se_data, "tls.key")) == NULL) {
-		TSDebug("kubernetes_api", "secret_make_ssl_ctx %s/%s: no key",
-			secret->se_namespace, secret->se_name);
-		goto error;
-	}
-
 	keylen = strlen(keyb64);
 	keystr = malloc(base64_decode_len(keylen));
 	keylen = base64_decode(keyb64, keylen, keystr);
 
 	if ((ctx = (SSL_CTX *)TSSslServerContextCreate()) == NULL) {
 		TSDebug("kubernetes_api", "secret_make_ssl_ctx %s/%s: SSL_CTX_new failed",
-			secret->se_namespace, secret->se_name);
+			ns, name);
 		goto error;
 	}
 
@@ -138,7 +192,7 @@ EVP_PKEY	*key = NULL;
 	char	*err = _k8s_get_ssl_error();
 		TSDebug("kubernetes_api", "secret_make_ssl_ctx %s/%s: "
 			"PEM_read_bio_X509_AUX failed: %s",
-			secret->se_namespace, secret->se_name, err);
+			ns, name, err);
 		free(err);
 		goto error;
 	}
@@ -146,7 +200,7 @@ EVP_PKEY	*key = NULL;
 	if (SSL_CTX_use_certificate(ctx, cert) != 1) {
 		TSDebug("kubernetes_api", "secret_make_ssl_ctx %s/%s: "
 			"SSL_CTX_use_certificate failed",
-			secret->se_namespace, secret->se_name);
+			ns, name);
 		goto error;
 	}
 	X509_free(cert); cert = NULL;
@@ -155,7 +209,7 @@ EVP_PKEY	*key = NULL;
 		if (SSL_CTX_add_extra_chain_cert(ctx, cert) != 1) {
 			TSDebug("kubernetes_api", "secret_make_ssl_ctx %s/%s: "
 				"SSL_CTX_add_extra_chain_cert failed",
-				secret->se_namespace, secret->se_name);
+				ns, name);
 			X509_free(cert); cert = NULL;
 			goto error;
 		}
@@ -169,14 +223,14 @@ EVP_PKEY	*key = NULL;
 	if ((key = PEM_read_bio_PrivateKey(bio, NULL, NULL, NULL)) == NULL) {
 		TSDebug("kubernetes_api", "secret_make_ssl_ctx %s/%s: "
 			"PEM_read_bio_PrivateKey failed",
-			secret->se_namespace, secret->se_name);
+			ns, name);
 		goto error;
 	}
 
 	if (SSL_CTX_use_PrivateKey(ctx, key) != 1) {
 		TSDebug("kubernetes_api", "secret_make_ssl_ctx %s/%s: "
 			"SSL_CTX_use_PrivateKey failed",
-			secret->se_namespace, secret->se_name);
+			ns, name);
 		goto error;
 	}
 
@@ -159,3 +159,15 @@ int		 n = atoi(name);
 
 	return NULL;
 }
+
+/*
+ * Return 1 if the Service has a ClusterIP which requests can be sent to.
+ * Headless Services have the ClusterIP "None", and ExternalName Services have
+ * none at all.
+ */
+int
+service_has_cluster_ip(const service_t *service)
+{
+	return service->sv_cluster_ip && *service->sv_cluster_ip &&
+	       strcmp(service->sv_cluster_ip, "None") != 0;
+}
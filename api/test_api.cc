@@ -328,6 +328,141 @@ TEST(API, Endpoints2) {
 	EXPECT_EQ(0, ts_api_errors);
 }
 
+TEST(API, Node) {
+	ts_api_errors = 0;
+
+	json_object *obj = test_load_json("tests/node.json");
+	ASSERT_TRUE(obj != NULL);
+
+	node_t *node = node_make(obj);
+	json_object_put(obj);
+	ASSERT_TRUE(node != NULL);
+	scoped_c_ptr<node_t *> node_(node, node_free);
+
+	EXPECT_STREQ("worker-bd78", node->nd_name);
+	EXPECT_STREQ("europe-west1-b", node->nd_zone);
+
+	/* Only the zone matters for equality */
+	node_t other = { const_cast<char *>("worker-bd78"),
+			 const_cast<char *>("europe-west1-b") };
+	EXPECT_EQ(1, node_equal(node, &other));
+	other.nd_zone = const_cast<char *>("europe-west1-c");
+	EXPECT_EQ(0, node_equal(node, &other));
+	other.nd_zone = NULL;
+	EXPECT_EQ(0, node_equal(node, &other));
+
+	EXPECT_EQ(0, ts_api_errors);
+}
+
+TEST(API, ClusterChanges) {
+	cluster_t *cs = cluster_make();
+	hash_t changed;
+
+	/* A new cluster has everything changed */
+	cluster_mark_changed(cs, CLUSTER_KIND_SERVICE, "default", "echo");
+	EXPECT_EQ(nullptr, cluster_take_changes(cs));
+
+	/* Nothing has changed since the last take */
+	changed = cluster_take_changes(cs);
+	ASSERT_NE(nullptr, changed);
+	EXPECT_EQ(nullptr, hash_get(changed, "Service/default/echo"));
+	hash_free(changed);
+
+	cluster_mark_changed(cs, CLUSTER_KIND_SERVICE, "default", "echo");
+	cluster_mark_changed(cs, CLUSTER_KIND_SECRET, "kube-system", "tls");
+	changed = cluster_take_changes(cs);
+	ASSERT_NE(nullptr, changed);
+	EXPECT_EQ(HASH_PRESENT, hash_get(changed, "Service/default/echo"));
+	EXPECT_EQ(HASH_PRESENT, hash_get(changed, "Secret/kube-system/tls"));
+	EXPECT_EQ(nullptr, hash_get(changed, "Endpoints/default/echo"));
+	hash_free(changed);
+
+	cluster_mark_changed(cs, CLUSTER_KIND_SERVICE, "default", "echo");
+	cluster_mark_all_changed(cs);
+	EXPECT_EQ(nullptr, cluster_take_changes(cs));
+
+	cluster_free(cs);
+}
+
+TEST(API, Refs) {
+	cluster_t *cs = cluster_make();
+	namespace_t *ns = cluster_get_namespace(cs, "default");
+	json_object *obj;
+
+	hash_t classes = hash_new(1, NULL);
+	hash_set(classes, IN_CLASS_TRAFFICSERVER, HASH_PRESENT);
+	refs_t *rf = refs_new(classes, 0);
+	ASSERT_NE(nullptr, rf);
+
+	obj = test_load_json("tests/service.json");
+	namespace_put_service(ns, service_make(obj));
+	json_object_put(obj);
+
+	/* Nothing is relevant until an Ingress uses it */
+	EXPECT_EQ(0, refs_relevant(rf, ns, CLUSTER_KIND_SERVICE,
+				   "echoheaders"));
+	EXPECT_EQ(0, refs_relevant(rf, ns, CLUSTER_KIND_ENDPOINTS,
+				   "echoheaders"));
+	EXPECT_EQ(1, refs_relevant(rf, ns, CLUSTER_KIND_INGRESS, "any"));
+
+	obj = test_load_json("tests/ingress.json");
+	ingress_t *ing = ingress_make(obj);
+	json_object_put(obj);
+	ASSERT_NE(nullptr, ing);
+	namespace_put_ingress(ns, ing);
+	refs_rebuild(rf, cs);
+
+	EXPECT_EQ(1, refs_relevant(rf, ns, CLUSTER_KIND_SERVICE,
+				   "echoheaders"));
+	EXPECT_EQ(1, refs_relevant(rf, ns, CLUSTER_KIND_ENDPOINTS,
+				   "echoheaders"));
+	EXPECT_EQ(1, refs_relevant(rf, ns, CLUSTER_KIND_SECRET, "authtest"));
+	EXPECT_EQ(0, refs_relevant(rf, ns, CLUSTER_KIND_SECRET, "other"));
+	EXPECT_EQ(0, refs_relevant(rf, ns, CLUSTER_KIND_SERVICE, "other"));
+
+	/* With service-upstream, the Endpoints aren't used... */
+	refs_del_ingress(rf, ing);
+	hash_set(ing->in_annotations, IN_SERVICE_UPSTREAM, strdup("true"));
+	refs_add_ingress(rf, ing);
+	EXPECT_EQ(1, refs_relevant(rf, ns, CLUSTER_KIND_SERVICE,
+				   "echoheaders"));
+	EXPECT_EQ(0, refs_relevant(rf, ns, CLUSTER_KIND_ENDPOINTS,
+				   "echoheaders"));
+
+	/* ... unless the Service is headless */
+	service_t *svc = namespace_get_service(ns, "echoheaders");
+	free(svc->sv_cluster_ip);
+	svc->sv_cluster_ip = strdup("None");
+	EXPECT_EQ(1, refs_relevant(rf, ns, CLUSTER_KIND_ENDPOINTS,
+				   "echoheaders"));
+
+	/* Ingresses of other classes don't count */
+	refs_del_ingress(rf, ing);
+	hash_set(ing->in_annotations, IN_CLASS, strdup("other"));
+	EXPECT_EQ(0, refs_ingress_wanted(rf, ing));
+	refs_add_ingress(rf, ing);
+	EXPECT_EQ(0, refs_relevant(rf, ns, CLUSTER_KIND_SERVICE,
+				   "echoheaders"));
+	EXPECT_EQ(0, refs_relevant(rf, ns, CLUSTER_KIND_SECRET, "authtest"));
+
+	/* Secrets in tls-certificates are used by any namespace */
+	obj = test_load_json("tests/configmap.json");
+	configmap_t *cm = configmap_make(obj);
+	json_object_put(obj);
+	ASSERT_NE(nullptr, cm);
+	hash_set(cm->cm_data, "tls-certificates",
+		 strdup("example.com:kube-system/wildcard"));
+	cluster_set_configmap(cs, cm);
+	configmap_free(cm);
+	refs_rebuild(rf, cs);
+	EXPECT_EQ(1, refs_relevant(rf, cluster_get_namespace(cs, "kube-system"),
+				   CLUSTER_KIND_SECRET, "wildcard"));
+
+	refs_free(rf);
+	hash_free(classes);
+	cluster_free(cs);
+}
+
 TEST(API, DomainMatch) {
 	EXPECT_EQ(1, domain_match("mydomain.com", "mydomain.com"));
 	EXPECT_EQ(0, domain_match("mydomain.com", "notmydomain.com"));
@@ -349,3 +484,84 @@ TEST(API, DomainMatch) {
 	EXPECT_EQ(0, domain_match("*mydomain.com", "mydomain.com.com"));
 	EXPECT_EQ(0, domain_match("*mydomain.com", "mydomain.co.uk"));
 }
+
+static string
+read_file(const char *fname)
+{
+	ifstream f(fname);
+	return string(istreambuf_iterator<char>(f),
+		      istreambuf_iterator<char>());
+}
+
+static void
+jsonstream_kind(json_object *item, void *data)
+{
+	json_object *kind;
+	string *kinds = static_cast<string *>(data);
+
+	if (json_object_object_get_ex(item, "kind", &kind))
+		*kinds += json_object_get_string(kind);
+	*kinds += ",";
+}
+
+TEST(API, JsonStream) {
+	string list = "{\"kind\": \"List\", \"items\": [ "
+		+ read_file("tests/service.json") + ",\n"
+		+ read_file("tests/node.json") + ", null ], "
+		+ "\"metadata\": {\"resourceVersion\": \"42\"}, \"n\": 1}\n";
+
+	/* Any split of the input gives the same result */
+	for (size_t chunk : { list.size(), size_t(7), size_t(1) }) {
+		string kinds;
+		jsonstream_t *js = jsonstream_new("items", jsonstream_kind,
+						  &kinds);
+		ASSERT_NE(nullptr, js);
+
+		for (size_t i = 0; i < list.size(); i += chunk) {
+			size_t len = std::min(chunk, list.size() - i);
+			ASSERT_EQ(0, jsonstream_feed(js, list.data() + i, len));
+			if (i + len <= list.rfind('}'))
+				EXPECT_EQ(nullptr, jsonstream_object(js));
+		}
+
+		EXPECT_EQ("Service,Node,", kinds);
+		EXPECT_TRUE(jsonstream_found(js));
+
+		json_object *obj = jsonstream_object(js), *o;
+		ASSERT_NE(nullptr, obj);
+		EXPECT_FALSE(json_object_object_get_ex(obj, "items", &o));
+		ASSERT_TRUE(json_object_object_get_ex(obj, "metadata", &o));
+		json_object *rv;
+		ASSERT_TRUE(json_object_object_get_ex(o, "resourceVersion",
+						      &rv));
+		EXPECT_STREQ("42", json_object_get_string(rv));
+		ASSERT_TRUE(json_object_object_get_ex(obj, "n", &o));
+		EXPECT_EQ(1, json_object_get_int(o));
+
+		jsonstream_free(js);
+	}
+
+	/* Invalid or incomplete */
+	for (string bad : { "<html>", "{\"items\": [{}",
+			    "{\"items\": []} x", "{\"items\": [{]}" }) {
+		string kinds;
+		jsonstream_t *js = jsonstream_new("items", jsonstream_kind,
+						  &kinds);
+		jsonstream_feed(js, bad.data(), bad.size());
+		EXPECT_EQ(nullptr, jsonstream_object(js)) << bad;
+		EXPECT_FALSE(jsonstream_found(js)) << bad;
+		jsonstream_free(js);
+	}
+
+	/* Complete, but without the array */
+	string status = "{\"kind\": \"Status\", \"message\": \"forbidden\"}";
+	string kinds;
+	jsonstream_t *js = jsonstream_new("items", jsonstream_kind, &kinds);
+	ASSERT_EQ(0, jsonstream_feed(js, status.data(), status.size()));
+	EXPECT_FALSE(jsonstream_found(js));
+	json_object *obj = jsonstream_object(js), *o;
+	ASSERT_NE(nullptr, obj);
+	ASSERT_TRUE(json_object_object_get_ex(obj, "message", &o));
+	EXPECT_STREQ("forbidden", json_object_get_string(o));
+	jsonstream_free(js);
+}
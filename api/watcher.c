@@ -38,23 +38,44 @@
  */
 #define	RESYNC_INTERVAL	300
 
+/*
+ * kind is the kind of list the API server returns for the resource.  We need
+ * it before the response's own kind arrives, since items are processed as
+ * they're read.
+ */
 struct resource {
 	const char	*url;
+	const char	*kind;
 	char		*version;
+	int		 topology;	/* Only for topology-aware routing */
 } resources[] = {
-	{ "/api/v1/services", 			NULL },
-	{ "/api/v1/endpoints",			NULL },
-	{ "/api/v1/secrets",			NULL },
-	{ "/api/v1/configmaps",			NULL },
-	{ "/apis/extensions/v1beta1/ingresses",	NULL },
+	{ "/api/v1/services", 			"ServiceList", NULL, 0 },
+	{ "/api/v1/endpoints",			"EndpointsList", NULL, 0 },
+	{ "/api/v1/secrets",			"SecretList", NULL, 0 },
+	{ "/api/v1/configmaps",			"ConfigMapList", NULL, 0 },
+	{ "/apis/extensions/v1beta1/ingresses",	"IngressList", NULL, 0 },
+	{ "/api/v1/nodes",			"NodeList", NULL, 1 },
 };
 #define NRESOURCES (sizeof(resources) / sizeof(*resources))
 
 struct watcher {
 	k8s_config_t	*wt_config;
 	cluster_t	*wt_cluster;
+	refs_t		*wt_refs;	/* Objects routing depends on */
 };
 
+/*
+ * Nodes are only needed to find the zone of each endpoint, so don't watch
+ * them (and don't require permission to) unless we know our own node name.
+ */
+static int
+resource_enabled(const watcher_t *wt, const struct resource *r)
+{
+	if (r->topology && !wt->wt_config->co_node_name)
+		return 0;
+	return 1;
+}
+
 char *
 _k8s_get_ssl_error(void)
 {
@@ -150,6 +171,13 @@ watcher_t	*wt = NULL;
 	wt->wt_config = conf;
 	wt->wt_cluster = cluster;
 
+	if ((wt->wt_refs = refs_new(conf->co_classes,
+				    conf->co_service_upstream)) == NULL) {
+		TSError("[watcher] refs_new: %s", strerror(errno));
+		free(wt);
+		return NULL;
+	}
+
 	return wt;
 }
 
@@ -160,11 +188,29 @@ struct fetcher_ctx {
 	struct curl_slist	*hdrs;
 	char			 errbuf[CURL_ERROR_SIZE];
 	char			*url;
-	char			*buf;
+	char			*buf;		/* Partial line, for watches */
 	size_t			 buflen;
+	jsonstream_t		*stream;	/* List response, for fetches */
+	cluster_t		*cluster;	/* Where to put listed items */
 	int			 changed;
 };
 
+void	fetcher_process_item(struct fetcher_ctx *fe, cluster_t *cluster,
+			     const char *kind, json_object *item);
+
+static void
+fe_list_item(json_object *item, void *udata)
+{
+struct fetcher_ctx	*fe = udata;
+
+	fetcher_process_item(fe, fe->cluster, fe->resource->kind, item);
+}
+
+/*
+ * Items are parsed and added to the cluster as they arrive, rather than
+ * buffering the whole response, which can be very large.  If the response
+ * isn't valid JSON, abort the transfer; there's no point reading the rest.
+ */
 static size_t
 fe_read(char *data, size_t sz, size_t n, void *udata)
 {
@@ -176,12 +222,50 @@ size_t			 nread = sz * n;
 	if (nread == 0)
 		return 0;
 
-	fe->buf = realloc(fe->buf, fe->buflen + nread + 1);
-	bcopy(data, fe->buf + fe->buflen, nread);
-	fe->buflen += nread;
+	if (jsonstream_feed(fe->stream, data, nread) == -1) {
+		TSError("fe_read: could not parse API server response for %s",
+			fe->url);
+		return 0;
+	}
+
 	return nread;
 }
 
+/*
+ * Handle a watch event for a Node.  Nodes report their status every few
+ * seconds, so only mark the cluster changed if the node's zone changed.
+ */
+static void
+fe_watch_node(struct fetcher_ctx *fe, json_object *o, int deleted)
+{
+cluster_t	*cs = fe->watcher->wt_cluster;
+node_t		*node, *old;
+
+	if ((node = node_make(o)) == NULL) {
+		TSError("fetcher_process_item: could not parse Node");
+		return;
+	}
+
+	pthread_rwlock_wrlock(&cs->cs_lock);
+	old = cluster_get_node(cs, node->nd_name);
+
+	if (deleted) {
+		if (old) {
+			cluster_del_node(cs, node->nd_name);
+			cluster_mark_all_changed(cs);
+			fe->changed = 1;
+		}
+		node_free(node);
+	} else if (old == NULL || !node_equal(node, old)) {
+		cluster_put_node(cs, node);
+		cluster_mark_all_changed(cs);
+		fe->changed = 1;
+	} else
+		node_free(node);
+
+	pthread_rwlock_unlock(&cs->cs_lock);
+}
+
 static void
 fe_watch_line(struct fetcher_ctx *fe, const char *line)
 {
@@ -189,6 +273,7 @@ json_object	*obj, *o, *metadata, *kind, *namespace, *name;
 const char	*stype, *skind, *sname, *snamespace;
 int		 deleted = 0;
 namespace_t	*ns;
+refs_t		*refs = fe->watcher->wt_refs;
 
 	TSDebug("watcher", "fe_watch_line: read line: %s", line);
 
@@ -235,6 +320,13 @@ namespace_t	*ns;
 	
 	skind = json_object_get_string(kind);
 
+	/* Nodes aren't namespaced */
+	if (strcmp(skind, "Node") == 0) {
+		fe_watch_node(fe, o, deleted);
+		json_object_put(obj);
+		return;
+	}
+
 	if (!json_object_object_get_ex(o, "metadata", &metadata) ||
 	    !json_object_is_type(metadata, json_type_object)) {
 		TSError("fetcher_process_item: resource has no metadata?");
@@ -266,16 +358,38 @@ namespace_t	*ns;
 	/* What sort of object is this? */
 
 	if (strcmp(skind, "Ingress") == 0) {
+	ingress_t	*ing;
+	int		 wanted = 0;
+
+		/*
+		 * An Ingress of a class we don't handle can't affect routing,
+		 * unless it was one of ours before this change.  Its references
+		 * are removed before the change and added back afterwards.
+		 */
+		if ((ing = namespace_get_ingress(ns, sname)) != NULL) {
+			wanted = refs_ingress_wanted(refs, ing);
+			refs_del_ingress(refs, ing);
+		}
+
 		if (deleted)
 			namespace_del_ingress(ns, sname);
 		else {
-		ingress_t	*ing;
 			if ((ing = ingress_make(o)) != NULL)
 				namespace_put_ingress(ns, ing);
 			else
 				TSError("fetcher_process_item: could not parse Ingress");
 		}
-		fe->changed = 1;
+
+		if ((ing = namespace_get_ingress(ns, sname)) != NULL) {
+			wanted |= refs_ingress_wanted(refs, ing);
+			refs_add_ingress(refs, ing);
+		}
+
+		if (wanted) {
+			cluster_mark_changed(fe->watcher->wt_cluster, skind,
+					     snamespace, sname);
+			fe->changed = 1;
+		}
 	} else if (strcmp(skind, "Service") == 0) {
 		if (deleted)
 			namespace_del_service(ns, sname);
@@ -286,7 +400,11 @@ namespace_t	*ns;
 			else
 				TSError("fetcher_process_item: could not parse Service");
 		}
-		fe->changed = 1;
+		if (refs_relevant(refs, ns, skind, sname)) {
+			cluster_mark_changed(fe->watcher->wt_cluster, skind,
+					     snamespace, sname);
+			fe->changed = 1;
+		}
 	} else if (strcmp(skind, "Secret") == 0) {
 		if (deleted)
 			namespace_del_secret(ns, sname);
@@ -297,7 +415,11 @@ namespace_t	*ns;
 			else
 				TSError("fetcher_process_item: could not parse Secret");
 		}
-		fe->changed = 1;
+		if (refs_relevant(refs, ns, skind, sname)) {
+			cluster_mark_changed(fe->watcher->wt_cluster, skind,
+					     snamespace, sname);
+			fe->changed = 1;
+		}
 	} else if (strcmp(skind, "ConfigMap") == 0) {
 		/*
 		 * We don't track all configmaps, because that would waste a
@@ -326,6 +448,8 @@ namespace_t	*ns;
 					TSError("fetch_process_item: could not "
 						"parse configmap");
 			}
+			refs_rebuild(refs, fe->watcher->wt_cluster);
+			cluster_mark_all_changed(fe->watcher->wt_cluster);
 			fe->changed = 1;
 		} else {
 			TSDebug("watcher", "watcher: ignoring CM %s/%s",
@@ -333,9 +457,23 @@ namespace_t	*ns;
 		}
 
 	} else if (strcmp(skind, "Endpoints") == 0) {
+	int	used;
+
+		/*
+		 * If no Ingress sends requests to the Service's Endpoints,
+		 * for example because they all use its ClusterIP, they don't
+		 * affect routing.  Keep them up to date in case that changes,
+		 * but don't rebuild.
+		 */
+		used = refs_relevant(refs, ns, skind, sname);
+
 		if (deleted) {
 			namespace_del_endpoints(ns, sname);
-			fe->changed = 1;
+			if (used) {
+				cluster_mark_changed(fe->watcher->wt_cluster,
+						     skind, snamespace, sname);
+				fe->changed = 1;
+			}
 		} else {
 		endpoints_t	*eps;
 
@@ -353,7 +491,13 @@ namespace_t	*ns;
 				if ((old = namespace_get_endpoints(ns, sname)) == NULL ||
 				    !endpoints_equal(eps, old)) {
 					namespace_put_endpoints(ns, eps);
-					fe->changed = 1;
+					if (used) {
+						cluster_mark_changed(
+							fe->watcher->wt_cluster,
+							skind, snamespace,
+							sname);
+						fe->changed = 1;
+					}
 				} else
 					endpoints_free(eps);
 			}
@@ -411,6 +555,11 @@ size_t	urllen;
 	if (fe->curl == NULL)
 		return -1;
 
+	if ((fe->stream = jsonstream_new("items", fe_list_item, fe)) == NULL) {
+		TSError("fetcher_make: jsonstream_new: %s", strerror(errno));
+		return -1;
+	}
+
 	urllen = strlen(wt->wt_config->co_server) + strlen(resource->url) + 1;
 	fe->url = malloc(urllen);
 	snprintf(fe->url, urllen, "%s%s", wt->wt_config->co_server,
@@ -452,6 +601,16 @@ namespace_t	*ns;
 
 	TSDebug("watcher", "fetcher_process_item: running");
 
+	/* Nodes aren't namespaced */
+	if (strcmp(kind, "NodeList") == 0) {
+	node_t	*node;
+		if ((node = node_make(item)) == NULL)
+			TSError("fetcher_process_item: could not parse Node");
+		else
+			cluster_put_node(cluster, node);
+		return;
+	}
+
 	if (!json_object_object_get_ex(item, "metadata", &metadata) ||
 	    !json_object_is_type(metadata, json_type_object)) {
 		TSError("fetcher_process_item: resource has no metadata?");
@@ -525,66 +684,59 @@ namespace_t	*ns;
 	}
 }
 
+/*
+ * Called when a list fetch has finished; the items have already been
+ * processed by fe_list_item().
+ */
 void
-fetcher_process(struct fetcher_ctx *fe, cluster_t *cluster)
+fetcher_process(struct fetcher_ctx *fe)
 {
-json_object		*obj = NULL, *items = NULL, *metadata, *rversion, *kind;
-const char		*skind;
+json_object		*obj, *metadata, *rversion, *kind, *message;
 
-	TSDebug("watcher", "fetcher_process: running; %d in buf",
-		(int) fe->buflen);
+	TSDebug("watcher", "fetcher_process: running");
 
-	if (!fe->buf)
+	if ((obj = jsonstream_object(fe->stream)) == NULL) {
+		TSError("fetcher_process: could not parse API server response "
+			"for %s", fe->url);
 		return;
+	}
 
 	/*
-	 * json-c requires a nul-terminated buffer.  We allocate an additional
-	 * byte in fe_read() so we can terminate it here.
+	 * A complete object without items is usually a Status, e.g. because
+	 * we don't have permission to list this resource.
 	 */
-	fe->buf[fe->buflen] = '\0';
-	if ((obj = json_tokener_parse(fe->buf)) == NULL) {
-		TSError("fetcher_process: could not parse JSON: [%.*s]",
-			(int) (fe->buflen > 128 ? 128 : fe->buflen), fe->buf);
-		goto cleanup;
+	if (!jsonstream_found(fe->stream)) {
+		if (json_object_object_get_ex(obj, "message", &message) &&
+		    json_object_is_type(message, json_type_string))
+			TSError("fetcher_process: API server returned error "
+				"for %s: %s", fe->url,
+				json_object_get_string(message));
+		else
+			TSError("fetcher_process: API server response for %s "
+				"has no items", fe->url);
+		return;
 	}
 
-	if (!json_object_object_get_ex(obj, "items", &items) ||
-	    !json_object_is_type(items, json_type_array)) {
-		TSError("fetcher_process: no items in API server response");
-		goto cleanup;
+	if (json_object_object_get_ex(obj, "kind", &kind) &&
+	    (!json_object_is_type(kind, json_type_string) ||
+	     strcmp(json_object_get_string(kind), fe->resource->kind) != 0)) {
+		TSError("fetcher_process: response has wrong kind?");
+		return;
 	}
 
 	if (!json_object_object_get_ex(obj, "metadata", &metadata) ||
 	    !json_object_is_type(metadata, json_type_object)) {
 		TSError("fetcher_process: response has no metadata?");
-		goto cleanup;
+		return;
 	}
 
 	if (!json_object_object_get_ex(metadata, "resourceVersion", &rversion) ||
 	    !json_object_is_type(rversion, json_type_string)) {
 		TSError("fetcher_process: response has no resourseVersion?");
-		goto cleanup;
+		return;
 	}
 	free(fe->resource->version);
 	fe->resource->version = strdup(json_object_get_string(rversion));
-
-	if (!json_object_object_get_ex(obj, "kind", &kind) ||
-	    !json_object_is_type(kind, json_type_string)) {
-		TSError("fetcher_process: response has no kind?");
-		goto cleanup;
-	}
-
-	skind = json_object_get_string(kind);
-
-	for (int i = 0, end = json_object_array_length(items); i != end; ++i) {
-	json_object	*item = json_object_array_get_idx(items, i);
-
-		fetcher_process_item(fe, cluster, skind, item);
-	}
-
-cleanup:
-	if (obj)
-		json_object_put(obj);
 }
 
 void
@@ -593,6 +745,7 @@ fetcher_free(struct fetcher_ctx *fe)
 	if (fe->curl)
 		curl_easy_cleanup(fe->curl);
 	curl_slist_free_all(fe->hdrs);
+	jsonstream_free(fe->stream);
 	free(fe->buf);
 	free(fe->url);
 }
@@ -616,12 +769,19 @@ hash_t			 tmphash;
 		goto cleanup;
 	}
 
+	/* Items are added to the new cluster while they're being fetched */
+	newcluster = cluster_make();
+
 	for (size_t i = 0; i < NRESOURCES; ++i) {
+		if (!resource_enabled(wt, &resources[i]))
+			continue;
+
 		if (fetcher_make(wt, &fetchers[i], &resources[i]) != 0) {
 			fail++;
 			goto cleanup;
 		}
 
+		fetchers[i].cluster = newcluster;
 		curl_multi_add_handle(multi, fetchers[i].curl);
 	}
 
@@ -661,7 +821,6 @@ hash_t			 tmphash;
 	}
 	TSDebug("watcher", "fetch_get_all: done fetch");
 
-	newcluster = cluster_make();
 	cluster = wt->wt_cluster;
 
 	while ((msg = curl_multi_info_read(multi, &n)) != NULL) {
@@ -683,26 +842,34 @@ hash_t			 tmphash;
 		if (msg->data.result != CURLE_OK) {
 			TSDebug("watcher", "fetcher_get_all: failed: %s",
 				fe->errbuf);
-			cluster_free(newcluster);
 			fail++;
 			goto cleanup;
 		}
 
-		fetcher_process(fe, newcluster);
+		fetcher_process(fe);
 	}
 
 	pthread_rwlock_wrlock(&cluster->cs_lock);
 	tmphash = cluster->cs_namespaces;
 	cluster->cs_namespaces = newcluster->cs_namespaces;
 	newcluster->cs_namespaces = tmphash;
+	tmphash = cluster->cs_nodes;
+	cluster->cs_nodes = newcluster->cs_nodes;
+	newcluster->cs_nodes = tmphash;
+	cluster_mark_all_changed(cluster);
+	refs_rebuild(wt->wt_refs, cluster);
 	pthread_rwlock_unlock(&cluster->cs_lock);
 
 	cluster_free(newcluster);
+	newcluster = NULL;
 
 	if (cluster->cs_callback)
 		cluster->cs_callback(cluster, cluster->cs_callbackdata);
 
 cleanup:
+	if (newcluster)
+		cluster_free(newcluster);
+
 	for (size_t i = 0; i < NRESOURCES; ++i) {
 		if (fetchers[i].curl && multi) {
 			if (multi)
@@ -721,7 +888,7 @@ int
 fetcher_watch(watcher_t *wt)
 {
 struct fetcher_ctx	 fetchers[NRESOURCES];
-int			 fail = 0, running;
+int			 fail = 0, running, nwatches = 0;
 CURLM			*multi = NULL;
 time_t			 deadline;
 
@@ -737,12 +904,16 @@ time_t			 deadline;
 	}
 
 	for (size_t i = 0; i < NRESOURCES; ++i) {
+		if (!resource_enabled(wt, &resources[i]))
+			continue;
+
 		if (fetcher_watch_make(wt, &fetchers[i], &resources[i]) != 0) {
 			fail++;
 			goto cleanup;
 		}
 
 		curl_multi_add_handle(multi, fetchers[i].curl);
+		nwatches++;
 	}
 
 	TSDebug("watcher", "fetcher_watch: starting watch");
@@ -762,7 +933,7 @@ time_t			 deadline;
 		}
 
 		/* If any watch finishes, we want to return for a resync */
-		if (running != NRESOURCES) {
+		if (running != nwatches) {
 			TSError("watcher: a watch finished early");
 			fail++;
 			break;
@@ -853,5 +1024,6 @@ watcher_set_callback(watcher_t *wt, cluster_callback_t cb, void *cbdata)
 void
 watcher_free(watcher_t *wt)
 {
+	refs_free(wt->wt_refs);
 	free(wt);
 }
@@ -890,6 +890,44 @@ raxNode *raxRemoveChild(raxNode *parent, raxNode *child) {
     return newnode ? newnode : parent;
 }
 
+/* Find the longest key in the radix tree which is a prefix of the string 's'
+ * of length 'len', and return the data associated with it, or the special
+ * raxNotFound value if no key is a prefix of 's'. If 'plen' is not NULL, the
+ * length of the matching key is stored there. */
+void *raxFindLongestPrefix(rax *rax, unsigned char *s, size_t len, size_t *plen) {
+    raxNode *h = rax->head;
+    void *data = raxNotFound;
+    size_t i = 0; /* Position in the string. */
+
+    debugf("### Longest prefix lookup: %.*s\n", (int)len, s);
+    while(1) {
+        size_t j = 0;
+
+        /* Every key we pass on the way down is a prefix of 's'. */
+        if (h->iskey) {
+            data = raxGetData(h);
+            if (plen) *plen = i;
+        }
+        if (h->size == 0 || i == len) break;
+
+        unsigned char *v = h->data;
+        if (h->iscompr) {
+            if (len - i < h->size || memcmp(v,s+i,h->size) != 0) break;
+            i += h->size;
+        } else {
+            for (j = 0; j < h->size; j++) {
+                if (v[j] == s[i]) break;
+            }
+            if (j == h->size) break;
+            i++;
+        }
+
+        raxNode **children = raxNodeFirstChildPtr(h);
+        memcpy(&h,children+j,sizeof(h));
+    }
+    return data;
+}
+
 /* Remove the specified item. Returns 1 if the item was found and
  * deleted, 0 otherwise. */
 int raxRemove(rax *rax, unsigned char *s, size_t len, void **old) {
@@ -12,14 +12,21 @@
 #define REMAP_H
 
 #include	<sys/types.h>
+#include	<sys/socket.h>
 #include	<netinet/in.h>
 
+#include	<stdint.h>
+#include	<time.h>
+#include	<pthread.h>
+
 #include	<regex.h>
 
 #include	<openssl/ssl.h>
 
 #include	"config.h"
 #include	"hash.h"
+#include	"arena.h"
+#include	"patset.h"
 #include	"api.h"
 
 #ifdef __cplusplus
@@ -60,27 +67,369 @@ struct remap_auth_addr {
 #define	REMAP_SATISFY_ALL	0
 #define	REMAP_SATISFY_ANY	1
 
+/*
+ * Load balancing policies.
+ */
+#define	REMAP_LB_RANDOM		0	/* Uniform random choice	     */
+#define	REMAP_LB_LEAST_REQUEST	1	/* P2C, fewest in-flight requests    */
+#define	REMAP_LB_EWMA		2	/* P2C, in-flight * response time    */
+#define	REMAP_LB_HASH		3	/* Consistent hash (Maglev)	     */
+
+/*
+ * What the consistent hash is keyed on.
+ */
+#define	REMAP_HASH_CLIENT_IP	0	/* Client network address	     */
+#define	REMAP_HASH_COOKIE	1	/* Value of cookie rp_hash_key	     */
+#define	REMAP_HASH_HEADER	2	/* Value of header field rp_hash_key */
+
+/*
+ * Live statistics for a backend, updated by every thread handling a request
+ * for it.  Each target's stats have a cache line to themselves so busy
+ * targets don't contend with their neighbours.
+ */
+#define	REMAP_TARGET_STATS_ALIGN	64
+
+typedef struct remap_target_stats {
+	unsigned	rs_inflight;	/* Requests currently in progress    */
+	unsigned	rs_refs;	/* Targets sharing these stats	     */
+	uint64_t	rs_ewma_us;	/* Response time average, in usec    */
+} remap_target_stats_t;
+
+void	remap_target_stats_ref(remap_target_stats_t *);
+void	remap_target_stats_free(remap_target_stats_t *);
+
+/*
+ * Where a backend is, relative to us.
+ */
+#define	REMAP_LOCAL_NODE	0	/* On the same node		     */
+#define	REMAP_LOCAL_ZONE	1	/* On another node in the same zone  */
+#define	REMAP_LOCAL_REMOTE	2	/* Anywhere else, or unknown	     */
+
+/*
+ * A backend to send requests to.  If rt_host is an IPv4 or IPv6 address,
+ * rt_addr holds it (with the port) ready to pass to TS, and rt_addrlen is
+ * non-zero; otherwise rt_host is a DNS name which must be resolved for each
+ * request.
+ */
 typedef struct remap_target {
-	char	*rt_host;
-	int	 rt_port;
+	char			*rt_host;
+	int			 rt_port;
+	struct sockaddr_storage	 rt_addr;
+	socklen_t		 rt_addrlen;
+	remap_target_stats_t	*rt_stats;
+	char			*rt_node;	/* Node the pod runs on	     */
+	char			*rt_zone;	/* Zone of rt_node	     */
+	unsigned		 rt_locality;	/* REMAP_LOCAL_*	     */
+	time_t			 rt_first_seen;	/* When we first saw it	     */
 } remap_target_t;
 
+/*
+ * Remember when each backend address was first seen, so that a new pod gets
+ * its slow start even though the remap_db is rebuilt on every change.
+ * remap_first_seen() returns the time host:port was first seen, recording it
+ * as now if it's new.  remap_first_seen_expire() forgets addresses which
+ * haven't been seen for a while; until it's first called, new addresses are
+ * recorded as seen at time 0, since at startup we can't know how long pods
+ * have been running.  remap_first_seen_reset() forgets everything and goes
+ * back to that state.
+ */
+time_t	remap_first_seen(const char *host, int port, time_t now);
+void	remap_first_seen_expire(time_t now);
+void	remap_first_seen_reset(void);
+
+/*
+ * remap_backends: a set of targets, and the load balancing tables built from
+ * them.  A set is built in its own arena, and never changes once it's been
+ * published, so requests can use it without locking.  A set which has been
+ * replaced is retired, and only freed once every remap_db which was live at
+ * the time has been freed (see remap_epoch_t); a request holds its remap_db
+ * until it's done with its target, so it can use the set without a reference.
+ *
+ * rb_lb_table is the Maglev consistent hash table, if the set was built with
+ * REMAP_BACKENDS_HASH.  rb_local[0] lists the targets on our own node and
+ * rb_local[1] those in our own zone (including our node): the rb_nlocal[t]
+ * nearby targets first, then the others, so we can spill over to the others
+ * without searching for them.  rb_newest is the latest rt_first_seen, which
+ * tells a path when its last target's slow start ends.
+ */
+#define	REMAP_BACKENDS_HASH	0x1	/* Build a consistent hash table */
+
+typedef struct remap_backends {
+	arena_t		 rb_arena;
+	remap_target_t	*rb_addrs;
+	size_t		 rb_naddrs;
+	size_t		 rb_addrs_size;		/* Room in rb_addrs	     */
+	uint16_t	*rb_lb_table;		/* Maglev lookup table	     */
+	size_t		 rb_lb_table_size;
+	uint16_t	*rb_local[2];		/* Same node, same zone	     */
+	size_t		 rb_nlocal[2];
+	time_t		 rb_newest;		/* Latest rt_first_seen	     */
+	struct remap_backends
+			*rb_retired_next;	/* Retired list		     */
+	uint64_t	 rb_retired_epoch;	/* Free once dbs are newer   */
+} remap_backends_t;
+
+remap_backends_t	*remap_backends_new(void);
+void			 remap_backends_free(remap_backends_t *);
+remap_target_t		*remap_backends_add_address(remap_backends_t *,
+						    const char *host,
+						    int port);
+void			 remap_target_set_node(remap_backends_t *,
+					       remap_target_t *,
+					       const char *node,
+					       const char *zone,
+					       unsigned locality);
+
+/*
+ * Build the load balancing tables.  This must be called after all the
+ * targets have been added, and before the set is published.  flags is
+ * REMAP_BACKENDS_*.
+ */
+void			 remap_backends_build_lb(remap_backends_t *,
+						 unsigned flags);
+
+/*
+ * Return the average response time of rb's targets other than except (which
+ * may be NULL), counting only those which have one, or 0 if none do.
+ */
+uint64_t		 remap_backends_mean_us(const remap_backends_t *,
+						const remap_target_t *except);
+
+/*
+ * Record the start and end of a request sent to one of rb's targets.
+ * latency_us is the backend's response time, or 0 if it isn't known (e.g. the
+ * response came from the cache), in which case only the in-flight count is
+ * updated.  REMAP_TARGET_FAILED means the target never answered; that counts
+ * as a response several times slower than rb's other targets, so a target
+ * which only fails doesn't look like the fastest one.
+ */
+#define	REMAP_TARGET_FAILED	((uint64_t) -1)
+
+void	remap_target_start(const remap_target_t *);
+void	remap_target_finish(const remap_backends_t *, const remap_target_t *,
+			     uint64_t latency_us);
+
+/*
+ * remap_backend_slot: where the current backends of one Service port are
+ * published.  Every path which sends requests to the same Service port (with
+ * the same flags) shares a slot, and the slot outlives any one remap_db.
+ * When the Service's Endpoints change, remap_backends_update() builds a new
+ * set and swaps it into the slot, so the paths see the new targets without
+ * the remap_db being rebuilt.
+ *
+ * bs_backends is read and swapped atomically, so a request only has to load
+ * it: there's no lock, and no reference count on the set, for every request
+ * to write to.  A path which isn't built from a Service (an ExternalName, or
+ * a path made by hand) has a private slot, with no bs_key, which isn't shared.
+ */
+typedef struct remap_backend_slot {
+	arena_t			 bs_arena;
+	remap_backends_t	*bs_backends;	/* Current set, or NULL	     */
+	unsigned		 bs_refs;
+	unsigned		 bs_build;	/* Last build which filled it */
+	unsigned		 bs_flags;	/* REMAP_BACKENDS_*	     */
+	const cluster_t		*bs_cluster;
+	char			*bs_key;	/* Registry key, or NULL     */
+	char			*bs_namespace;
+	char			*bs_service;
+	char			*bs_port;	/* Port name from the Ingress */
+} remap_backend_slot_t;
+
+remap_backend_slot_t	*remap_backend_slot_new(void);
+
+/*
+ * Return a reference to the slot for a Service port, creating it (with no
+ * backends) if it doesn't exist.
+ */
+remap_backend_slot_t	*remap_backend_slot_get(const cluster_t *,
+						const char *ns,
+						const char *service,
+						const char *port,
+						unsigned flags);
+void			 remap_backend_slot_free(remap_backend_slot_t *);
+
+/*
+ * Return the slot's current backends, or NULL if it has none.  The set stays
+ * valid while the caller holds the remap_db it found the slot in.
+ */
+const remap_backends_t	*remap_backend_slot_current(
+					const remap_backend_slot_t *);
+
+/*
+ * Make rb the slot's current backends, which the slot now owns, and retire
+ * the old set.  The response time averages and in-flight counts of targets
+ * which are in both the old and new sets are carried over.
+ */
+void			 remap_backend_slot_publish(remap_backend_slot_t *,
+						    remap_backends_t *);
+
+/*
+ * Return references to the registered slots of cluster whose Service or
+ * Endpoints is in changed.  The caller must free each slot and the array.
+ */
+remap_backend_slot_t	**remap_backend_slots_changed(const cluster_t *,
+						      hash_t changed,
+						      size_t *nslots);
+
+/*
+ * Rebuild the backends of every Service port whose Service or Endpoints is in
+ * changed (a set of cluster_object_key()s).  Since nothing else depends on
+ * Endpoints, they're removed from changed; if that leaves changed empty, the
+ * remap_db doesn't need to be rebuilt, though it should still be replaced
+ * (see remap_db_copy()) if this returns non-zero, the number of slots which
+ * were given new backends.
+ */
+size_t			 remap_backends_update(k8s_config_t *, cluster_t *,
+					       hash_t changed);
+
+/*
+ * Epochs say when a retired backend set can be freed.  Every remap_db enters
+ * a new epoch when it's made, and exits it when it's freed.  A set retired
+ * while any remap_db is live is kept until all of those have been freed,
+ * since requests using them might still be using the set; a set retired when
+ * none are live is freed at once.  Requests don't have to do anything.
+ */
+typedef struct remap_epoch {
+	uint64_t		 re_epoch;
+	struct remap_epoch	*re_prev;
+	struct remap_epoch	*re_next;
+} remap_epoch_t;
+
+void	remap_epoch_enter(remap_epoch_t *);
+void	remap_epoch_exit(remap_epoch_t *);
+
+/*
+ * A header field to add to the response.  Headers are kept in singly-linked
+ * lists.  The lists stored on a remap_path are built once, when the path is
+ * annotated, and never change afterwards; a request which needs a dynamic
+ * header (like an echoed Origin) allocates it from the request arena and
+ * points hd_next at the path's prebuilt list, instead of copying the list.
+ */
+typedef struct remap_header {
+	struct remap_header	*hd_next;
+	const char		*hd_name;
+	const char		*hd_value;
+} remap_header_t;
+
+remap_header_t	*remap_header_new(arena_t *, const char *name,
+				  const char *value, remap_header_t *next);
+
+/*
+ * The annotations of an Ingress which configure its paths.  These are parsed
+ * once per Ingress when the remap_db is built, and the result is shared by
+ * every path the Ingress configures, instead of each path parsing the
+ * annotations again.
+ *
+ * rn_items lists the recognised annotations in the order the Ingress's
+ * annotations hash returns them.  an_data is the parsed form of annotations
+ * which are expensive to parse (pattern sets, hashes and address lists); paths
+ * point to it rather than making their own copy, so a path holds a reference
+ * to each remap_annotations_t which configured it.  Everything, including the
+ * remap_annotations_t itself, is allocated from rn_arena except an_data.
+ *
+ * an_data is interned by content, and shared by every Ingress with the same
+ * annotation; an_interned is our reference to it.  It must not be modified.
+ */
+#define	REMAP_ANN_CACHE_ENABLE			0
+#define	REMAP_ANN_CACHE_GENERATION		1
+#define	REMAP_ANN_CACHE_IGNORE_PARAMS		2
+#define	REMAP_ANN_CACHE_WHITELIST_PARAMS	3
+#define	REMAP_ANN_CACHE_IGNORE_COOKIES		4
+#define	REMAP_ANN_CACHE_WHITELIST_COOKIES	5
+#define	REMAP_ANN_COMPRESS_TYPES		6
+#define	REMAP_ANN_COMPRESS_ENABLE		7
+#define	REMAP_ANN_FOLLOW_REDIRECTS		8
+#define	REMAP_ANN_SERVER_PUSH			9
+#define	REMAP_ANN_SECURE_BACKENDS		10
+#define	REMAP_ANN_DEBUG_LOG			11
+#define	REMAP_ANN_SSL_REDIRECT			12
+#define	REMAP_ANN_FORCE_SSL_REDIRECT		13
+#define	REMAP_ANN_PRESERVE_HOST			14
+#define	REMAP_ANN_APP_ROOT			15
+#define	REMAP_ANN_REWRITE_TARGET		16
+#define	REMAP_ANN_READ_RESPONSE_TIMEOUT		17
+#define	REMAP_ANN_ENABLE_CORS			18
+#define	REMAP_ANN_CORS_ORIGINS			19
+#define	REMAP_ANN_CORS_MAX_AGE			20
+#define	REMAP_ANN_CORS_HEADERS			21
+#define	REMAP_ANN_CORS_METHODS			22
+#define	REMAP_ANN_CORS_CREDENTIALS		23
+#define	REMAP_ANN_AUTH_TYPE			24
+#define	REMAP_ANN_AUTH_REALM			25
+#define	REMAP_ANN_AUTH_SECRET			26
+#define	REMAP_ANN_AUTH_SATISFY			27
+#define	REMAP_ANN_WHITELIST_SOURCE_RANGE	28
+#define	REMAP_ANN_LOAD_BALANCE			29
+#define	REMAP_ANN_HASH_BY			30
+#define	REMAP_ANN_TOPOLOGY_AWARE_ROUTING	31
+#define	REMAP_ANN_SLOW_START_WINDOW		32
+#define	REMAP_ANN_SLOW_START_CURVE		33
+#define	REMAP_ANN_SERVICE_UPSTREAM		34
+
+typedef struct remap_interned remap_interned_t;
+
+typedef struct remap_annotation {
+	int			 an_id;		/* REMAP_ANN_*		*/
+	char			*an_value;
+	void			*an_data;	/* Parsed value, or NULL */
+	remap_interned_t	*an_interned;
+} remap_annotation_t;
+
+typedef struct remap_annotations {
+	arena_t			 rn_arena;
+	unsigned		 rn_refs;
+	remap_annotation_t	*rn_items;
+	size_t			 rn_nitems;
+} remap_annotations_t;
+
+/*
+ * Return the REMAP_ANN_* id of the annotation named key, or -1 if it's not
+ * one which configures a path.
+ */
+int			 remap_annotation_id(const char *key, size_t keylen);
+
+/*
+ * Parse an Ingress's annotations.  ns is used to find the Secret named by
+ * auth-secret, and may be NULL.  The result has one reference.
+ */
+remap_annotations_t	*remap_annotations_parse(namespace_t *ns,
+						 hash_t annotations);
+void			 remap_annotations_ref(remap_annotations_t *);
+void			 remap_annotations_free(remap_annotations_t *);
+
 /*
  * remap_path: stores one path entry in an Ingress.
+ *
+ * The path itself is the first thing allocated from rp_arena, and everything
+ * built for it afterwards (its targets and their statistics, strings, load
+ * balancing tables and response headers) comes from the same arena.  A path's
+ * data is therefore close together in memory, and remap_path_free() releases
+ * it all at once.  Nothing allocated from rp_arena is freed individually;
+ * replacing a value leaves the old one in the arena until the path is freed.
+ *
+ * Most of the configuration from annotations, including the pattern sets and
+ * hashes, points into the remap_annotations_t which configured the path, and
+ * is shared with the Ingress's other paths; the path holds a reference to
+ * each of them in rp_annotations.  The default rp_compress_types and
+ * rp_cors_origins are shared by every path.  The regex is allocated
+ * separately.
  */
 typedef struct {
-	regex_t		  rp_regex;
-	remap_target_t	 *rp_addrs;
-	size_t		  rp_naddrs;
+	arena_t		  rp_arena;
+	remap_annotations_t **rp_annotations;	/* Held references */
+	size_t		  rp_nannotations;
+	char		 *rp_prefix;		/* Literal path prefix, or NULL */
+	regex_t		  rp_regex;		/* Path regex, if not literal  */
+	remap_backend_slot_t *rp_backends;	/* Where our targets are    */
 	hash_t		  rp_users;
 
 	/* Caching */
 	unsigned  rp_cache:1;			/* Enable caching	     */
 	int	  rp_cache_gen;			/* Set cache generation	     */
-	hash_t	  rp_ignore_params;		/* Params to ignore in cache */
-	hash_t	  rp_whitelist_params;		/* Cache param whitelist     */
-	hash_t	  rp_ignore_cookies;		/* Cookie names to remove    */
-	hash_t	  rp_whitelist_cookies;		/* Cookie name whitelist     */
+	patset_t *rp_ignore_params;		/* Params to ignore in cache */
+	patset_t *rp_whitelist_params;		/* Cache param whitelist     */
+	patset_t *rp_ignore_cookies;		/* Cookie names to remove    */
+	patset_t *rp_whitelist_cookies;		/* Cookie name whitelist     */
 
 	/* TLS */
 	unsigned  rp_follow_redirects:1;	/* Follow 301/302 redirect   */
@@ -96,6 +445,13 @@ typedef struct {
 	unsigned  rp_compress:1;		/* Compress response	     */
 	unsigned  rp_server_push:1;		/* Enable HTTP/1 server push */
 	unsigned  rp_debug_log:1;		/* Log request/response      */
+	unsigned  rp_lb:2;			/* Load balancing policy     */
+	unsigned  rp_hash_by:2;			/* Consistent hash key type  */
+	char	 *rp_hash_key;			/* Hash cookie/header name   */
+	unsigned  rp_topology:1;		/* Prefer nearby targets     */
+	int	  rp_slow_start;		/* Slow start window, secs   */
+	unsigned  rp_slow_start_exp:1;		/* Exponential ramp	     */
+	unsigned  rp_service_upstream:1;	/* Route to the ClusterIP    */
 	hash_t	  rp_compress_types;		/* Content types to compress */
 
 	/* Authn/authz */
@@ -110,36 +466,133 @@ typedef struct {
 	char	 *rp_cors_methods;		/* CORS methods		     */
 	char	 *rp_cors_headers;		/* CORS headersil	     */
 	int	  rp_cors_max_age;		/* CORS max age		     */
+	unsigned  rp_cors_any_origin:1;		/* Origin list contains "*"  */
+
+	/* Prebuilt response headers */
+	remap_header_t	*rp_hdr_app_root;	/* app-root redirect	     */
+	remap_header_t	*rp_hdr_wwwauth;	/* Authentication failure    */
+	remap_header_t	*rp_hdr_cors;		/* CORS request		     */
+	remap_header_t	*rp_hdr_cors_preflight;	/* CORS preflight request    */
 
 	struct remap_auth_addr *rp_auth_addr_list;
 } remap_path_t;
 
 remap_path_t	*remap_path_new(const char *path);
 void		 remap_path_free(remap_path_t *);
-void		 remap_path_annotate(namespace_t *, cluster_t *,
-				     remap_path_t *, hash_t);
+void		 remap_path_annotate(remap_path_t *, remap_annotations_t *);
+void		 remap_path_build_headers(remap_path_t *);
+
+/*
+ * Remove the cookies which rp_ignore_cookies and rp_whitelist_cookies say
+ * should be ignored for caching from the Cookie header value s, in place.
+ * Returns the new length of the value; 0 means no cookies are left.
+ */
+size_t		 remap_path_filter_cookies(const remap_path_t *,
+					   char *s, size_t len);
+
+/*
+ * Add a target to a path which isn't built from a Service, giving it a private
+ * slot if it doesn't have one yet.  remap_path_build_lb() then builds the
+ * load balancing tables the path's configuration needs; it does nothing to a
+ * shared slot, whose backends are built when they're published.
+ */
 void		 remap_path_add_address(remap_path_t *, const char *host,
 					int port);
+void		 remap_path_build_lb(remap_path_t *);
+
+/*
+ * Pick one of rb's targets for a request to this path.  req is used for the
+ * consistent hash key, and may be NULL, in which case a random target is
+ * picked.  rb must have at least one target.
+ */
+struct remap_request;
 const remap_target_t
-		*remap_path_pick_target(const remap_path_t *);
+		*remap_path_pick_target(const remap_path_t *,
+					const remap_backends_t *rb,
+					struct remap_request *req);
+
+/*
+ * A TLS context made from a Secret.  These are cached by the Secret's name and
+ * a digest of its certificate and key, so every host using the same Secret
+ * shares one, and it's kept across rebuilds until the Secret changes.  The
+ * SSL_CTX itself is built by remap_tls_get_ctx() the first time a client
+ * asks for it, since building it is expensive and many certificates are
+ * rarely used.  The certificate and key are checked when the context is
+ * made, though, so we know whether it's usable before anyone asks.
+ */
+typedef struct remap_tls {
+	unsigned	 tc_refs;
+	char		*tc_namespace;
+	char		*tc_name;
+	char		*tc_cert;	/* Base64 PEM certificate chain	*/
+	char		*tc_key;	/* Base64 PEM private key	*/
+	unsigned char	 tc_digest[32];	/* SHA-256 of cert and key	*/
+	SSL_CTX		*tc_ctx;	/* Built on first use		*/
+	int		 tc_failed;	/* Invalid, or couldn't build	*/
+} remap_tls_t;
+
+/*
+ * Return a reference to the TLS context for a Secret, or NULL if the Secret
+ * doesn't contain a certificate and key.
+ */
+remap_tls_t	*remap_tls_get(secret_t *);
+void		 remap_tls_ref(remap_tls_t *);
+void		 remap_tls_free(remap_tls_t *);
+
+/*
+ * Return the SSL_CTX for a TLS context, building it if it hasn't been built
+ * yet.  Returns NULL if the certificate or key is invalid.  This can be
+ * called from any thread.
+ */
+SSL_CTX		*remap_tls_get_ctx(remap_tls_t *);
+
+/*
+ * Return 1 if the certificate and key are valid, so clients can be sent to
+ * HTTPS, or 0 if not.
+ */
+int		 remap_tls_valid(const remap_tls_t *);
+
+/*
+ * Drop cached TLS contexts which aren't used by any host.
+ */
+void		 remap_tls_expire(void);
 
 /*
  * Store configuration for a particular hostname.  This contains the TLS
  * context, zero or more paths, and maybe a default backend.
+ *
+ * A host which wasn't affected by a change is shared between the old and new
+ * remap_dbs, so hosts are reference counted; remap_host_free() drops a
+ * reference.  rh_deps is the set of objects (named by cluster_object_key())
+ * the host was built from.
+ *
+ * To find the path for a request quickly, paths which are literal strings
+ * are also stored in rh_prefixes, a radix tree keyed on the path, and the
+ * remaining (regex) paths are listed in rh_regex_paths.
  */
+struct rax;
+
 typedef struct {
 	remap_path_t	**rh_paths;
 	size_t		 rh_npaths;
-	SSL_CTX		*rh_ctx;
+	struct rax	*rh_prefixes;
+	remap_path_t	**rh_regex_paths;
+	size_t		 rh_nregex_paths;
+	remap_tls_t	*rh_tls;
 	unsigned	 rh_hsts_subdomains:1;
 	unsigned	 rh_http2:1;
 	unsigned	 rh_tls_passthrough:1;
 	int		 rh_hsts_max_age;
 	int		 rh_tls_version;
+	unsigned	 rh_refs;
+	hash_t		 rh_deps;
 } remap_host_t;
 
 remap_host_t	*remap_host_new(void);
+void		 remap_host_ref(remap_host_t *host);
 void		 remap_host_free(remap_host_t *host);
+void		 remap_host_depend(remap_host_t *, const char *kind,
+				   const char *ns, const char *name);
 remap_path_t	*remap_host_find_path(const remap_host_t *,
 				      const char *pathname,
 				      size_t *pfxsz);
@@ -156,11 +609,31 @@ typedef struct {
 	k8s_config_t	*rd_config;
 	char		*rd_healthcheck;
 	hash_t		 rd_hosts;
+	unsigned	 rd_build;	/* Which build made this db */
+	remap_epoch_t	 rd_epoch;
 } remap_db_t;
 
 /* create and destroy remap_dbs */
 remap_db_t	*remap_db_new(k8s_config_t *cfg);
 remap_db_t	*remap_db_from_cluster(k8s_config_t *cfg, cluster_t *);
+
+/*
+ * Build a new remap_db from old, rebuilding only the hosts which depend on an
+ * object in changed (a set of cluster_object_key()s, from
+ * cluster_take_changes()).  The other hosts are shared with old.  If old or
+ * changed is NULL, everything is rebuilt, including the backends of every
+ * Service port the db uses.  Hosts don't depend on Endpoints; the caller
+ * should pass changes to remap_backends_update() first.
+ */
+remap_db_t	*remap_db_update(k8s_config_t *cfg, cluster_t *,
+				 const remap_db_t *old, hash_t changed);
+
+/*
+ * Make a new remap_db which shares every host with old.  When only backends
+ * changed, replacing the db with a copy lets the requests holding old finish,
+ * and the backends they were using be freed.
+ */
+remap_db_t	*remap_db_copy(const remap_db_t *old);
 void		 remap_db_free(remap_db_t *);
 
 /* fetch hosts from a remap_db */
@@ -168,35 +641,69 @@ remap_host_t	*remap_db_get_host(const remap_db_t *, const char *hostname);
 remap_host_t	*remap_db_get_or_create_host(remap_db_t *, const char *hostname);
 
 /*
- * Represent a single header field.
+ * Represent a single header field.  Fields belong to a request, and are
+ * allocated from its arena.
  */
 typedef struct remap_hdrfield {
-	size_t	  rh_nvalues;
-	char	**rh_values;
+	struct remap_hdrfield	 *rh_next;
+	const char		 *rh_name;	/* Lowercase */
+	size_t			  rh_nvalues;
+	char			**rh_values;
 } remap_hdrfield_t;
 
-void	remap_hdrfield_free(remap_hdrfield_t *);
+/*
+ * Fetch a single request header field on demand.  name is lowercase.  Returns
+ * a field allocated from ar, or NULL if the request doesn't have this field.
+ * The caller sets rh_next and rh_name.
+ */
+typedef remap_hdrfield_t *(*remap_hdrfield_fn)(void *data, arena_t *ar,
+					       const char *name);
 
 /*
  * Request data for remap_run();
+ *
+ * All the strings in the request, and everything remap_run() allocates for
+ * the result, are allocated from rr_arena; remap_request_free() releases all
+ * of it at once.  A zero-initialised rr_arena is valid, but the caller can
+ * use arena_init() to give it an initial buffer.
  */
 typedef struct remap_request {
+	arena_t		 rr_arena;	/* Storage for request and result */
 	char		*rr_proto;	/* Request proto (http, https...) */
 	char		*rr_method;	/* Request method (GET, POST, ...) */
 	char		*rr_host;	/* Request Host: header */
 	char		*rr_path;	/* Request URL path, with leading '/' */
 	char		*rr_query;	/* Request URL query string, not
 					   including leading '/' */
-	hash_t		 rr_hdrfields;	/* Lowercased request header fields */
+	remap_hdrfield_t *rr_hdrfields;	/* Request header fields */
 	const struct sockaddr
 			*rr_addr;	/* Client network address */
+
+	/*
+	 * If set, header fields not already in rr_hdrfields are fetched with
+	 * rr_hdrfield_get(rr_hdrfield_data, &rr_arena, name) the first time
+	 * they're needed, and then added to rr_hdrfields (a field the request
+	 * doesn't have is added with no values, so it isn't fetched again).
+	 * This avoids copying all the request's header fields when remap_run()
+	 * only needs one or two of them (or, usually, none at all).
+	 */
+	remap_hdrfield_fn rr_hdrfield_get;
+	void		*rr_hdrfield_data;
 } remap_request_t;
 
+const remap_hdrfield_t	*remap_request_get_header(remap_request_t *,
+						  const char *name);
+int			 remap_request_add_header(remap_request_t *,
+						  const char *name,
+						  const char *value);
+
 /*
  * Result of a remap_run().
  *
  * If the return code is RR_OK, then rz_target contains the backend host and
  * port to remap the request to, and rz_proto contains the backend protocol.
+ * rz_backends is the set rz_target belongs to, which stays valid for as long
+ * as the caller holds the remap_db.
  * If rz_path is non-null, it contains the rewritten URL path that should be
  * used for the request.
  *
@@ -205,16 +712,21 @@ typedef struct remap_request {
  *
  * Otherwise, return will be equal to RR_ERR_* indicating that an error 
  * occurred, and none of the struct fields are valid.
+ *
+ * The result's strings are allocated from the request's arena, and rz_headers
+ * can point into the matched remap_path, so neither the request nor the
+ * remap_db may be freed while the result is still in use.
  */
 typedef struct remap_result {
 	/* success */
 	const remap_target_t	*rz_target;
+	const remap_backends_t	*rz_backends;
 	const char		*rz_proto;
 	char			*rz_urlpath;
 	char			*rz_query;
 
 	/* headers to include in the response */
-	hash_t		 rz_headers;
+	const remap_header_t	*rz_headers;
 
 	/* synthetic response */
 	int		 rz_status;
@@ -237,19 +749,27 @@ typedef struct remap_result {
 					   backends */
 #define	RR_ERR_FORBIDDEN	(-6)	/* Request denied by IP address	     */
 #define	RR_ERR_UNAUTHORIZED	(-7)	/* Request denied by authenticatio   */
+#define	RR_ERR_INTERNAL		(-8)	/* Out of memory, or similar	     */
 
 
-int	remap_run(const remap_db_t *db, const remap_request_t *,
-		  remap_result_t *);
+int	remap_run(const remap_db_t *db, remap_request_t *, remap_result_t *);
 
 void	remap_request_free(remap_request_t *);
 void	remap_result_free(remap_result_t *);
 
 /*
- * Create a Traffic Server cache key for the given request.
+ * Create a Traffic Server cache key for the given request in buf, which is
+ * bufsz bytes long.  The key is not NUL-terminated.  Returns the length of the
+ * key; if this is larger than bufsz, nothing was written and the caller should
+ * try again with a larger buffer.  Returns 0 on error.
+ *
+ * If hashmin is not zero, then for URLs longer than about hashmin bytes the
+ * key is a fixed-length SHA-256 hash of the URL instead, CACHE_KEY_HASHED_LEN
+ * bytes long.
  */
-void	remap_make_cache_key(remap_request_t *, remap_result_t *,
-			     char **, size_t *);
+#define	CACHE_KEY_HASHED_LEN	(2 + 44)
+size_t	remap_make_cache_key(const remap_request_t *, const remap_result_t *,
+			     char *buf, size_t bufsz, size_t hashmin);
 #ifdef __cplusplus
 }
 #endif
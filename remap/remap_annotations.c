@@ -0,0 +1,554 @@
+/* vim:set sw=8 ts=8 noet: */
+/*
+ * Copyright (c) 2016-2017 Torchbox Ltd.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely. This software is provided 'as-is', without any express or implied
+ * warranty.
+ */
+/*
+ * remap_annotations: parse the Ingress annotations which configure a path.
+ */
+
+#include	<sys/types.h>
+#include	<sys/socket.h>
+
+#include	<netinet/in.h>
+#include	<arpa/inet.h>
+
+#include	<stdlib.h>
+#include	<string.h>
+#include	<stdint.h>
+#include	<pthread.h>
+
+#include	<ts/ts.h>
+
+#include	"remap.h"
+#include	"base64.h"
+
+/*
+ * The annotations we understand.
+ */
+static const struct {
+	const char	*name;
+	int		 id;
+} annotations[] = {
+	{ IN_CACHE_ENABLE,		REMAP_ANN_CACHE_ENABLE		   },
+	{ IN_CACHE_GENERATION,		REMAP_ANN_CACHE_GENERATION	   },
+	{ IN_CACHE_IGNORE_PARAMS,	REMAP_ANN_CACHE_IGNORE_PARAMS	   },
+	{ IN_CACHE_WHITELIST_PARAMS,	REMAP_ANN_CACHE_WHITELIST_PARAMS   },
+	{ IN_CACHE_IGNORE_COOKIES,	REMAP_ANN_CACHE_IGNORE_COOKIES	   },
+	{ IN_CACHE_WHITELIST_COOKIES,	REMAP_ANN_CACHE_WHITELIST_COOKIES  },
+	{ IN_COMPRESS_TYPES,		REMAP_ANN_COMPRESS_TYPES	   },
+	{ IN_COMPRESS_ENABLE,		REMAP_ANN_COMPRESS_ENABLE	   },
+	{ IN_FOLLOW_REDIRECTS,		REMAP_ANN_FOLLOW_REDIRECTS	   },
+	{ IN_SERVER_PUSH,		REMAP_ANN_SERVER_PUSH		   },
+	{ IN_SECURE_BACKENDS,		REMAP_ANN_SECURE_BACKENDS	   },
+	{ IN_DEBUG_LOG,			REMAP_ANN_DEBUG_LOG		   },
+	{ IN_SSL_REDIRECT,		REMAP_ANN_SSL_REDIRECT		   },
+	{ IN_FORCE_SSL_REDIRECT,	REMAP_ANN_FORCE_SSL_REDIRECT	   },
+	{ IN_PRESERVE_HOST,		REMAP_ANN_PRESERVE_HOST		   },
+	{ IN_APP_ROOT,			REMAP_ANN_APP_ROOT		   },
+	{ IN_REWRITE_TARGET,		REMAP_ANN_REWRITE_TARGET	   },
+	{ IN_READ_RESPONSE_TIMEOUT,	REMAP_ANN_READ_RESPONSE_TIMEOUT	   },
+	{ IN_ENABLE_CORS,		REMAP_ANN_ENABLE_CORS		   },
+	{ IN_CORS_ORIGINS,		REMAP_ANN_CORS_ORIGINS		   },
+	{ IN_CORS_MAX_AGE,		REMAP_ANN_CORS_MAX_AGE		   },
+	{ IN_CORS_HEADERS,		REMAP_ANN_CORS_HEADERS		   },
+	{ IN_CORS_METHODS,		REMAP_ANN_CORS_METHODS		   },
+	{ IN_CORS_CREDENTIALS,		REMAP_ANN_CORS_CREDENTIALS	   },
+	{ IN_AUTH_TYPE,			REMAP_ANN_AUTH_TYPE		   },
+	{ IN_AUTH_REALM,		REMAP_ANN_AUTH_REALM		   },
+	{ IN_AUTH_SECRET,		REMAP_ANN_AUTH_SECRET		   },
+	{ IN_AUTH_SATISFY,		REMAP_ANN_AUTH_SATISFY		   },
+	{ IN_WHITELIST_SOURCE_RANGE,	REMAP_ANN_WHITELIST_SOURCE_RANGE   },
+	{ IN_LOAD_BALANCE,		REMAP_ANN_LOAD_BALANCE		   },
+	{ IN_HASH_BY,			REMAP_ANN_HASH_BY		   },
+	{ IN_TOPOLOGY_AWARE_ROUTING,	REMAP_ANN_TOPOLOGY_AWARE_ROUTING   },
+	{ IN_SLOW_START_WINDOW,		REMAP_ANN_SLOW_START_WINDOW	   },
+	{ IN_SLOW_START_CURVE,		REMAP_ANN_SLOW_START_CURVE	   },
+	{ IN_SERVICE_UPSTREAM,		REMAP_ANN_SERVICE_UPSTREAM	   },
+};
+#define	NANNOTATIONS	(sizeof(annotations) / sizeof(*annotations))
+
+/*
+ * Annotation names are looked up with a perfect hash: a seed is chosen, once,
+ * such that every name hashes to a different slot, so a lookup is one hash and
+ * one comparison.  Each slot holds the index of its annotation plus one, or 0
+ * if it's empty.  If no seed works (which won't happen with this many names
+ * and slots), ann_seed_ok is 0 and we search the table instead.
+ */
+#define	ANN_SLOTS	256
+
+static uint8_t		ann_slots[ANN_SLOTS];
+static uint32_t		ann_seed;
+static int		ann_seed_ok;
+static pthread_once_t	ann_once = PTHREAD_ONCE_INIT;
+
+static uint32_t
+ann_hash(const char *key, size_t keylen, uint32_t seed)
+{
+uint32_t	h = 2166136261u ^ seed;
+
+	while (keylen--) {
+		h ^= (unsigned char) *key++;
+		h *= 16777619u;
+	}
+
+	h ^= h >> 15;
+	h *= 0x2c1b3c6d;
+	h ^= h >> 12;
+	return h;
+}
+
+static void
+ann_init(void)
+{
+uint32_t	seed, h;
+size_t		i;
+
+	for (seed = 0; seed < 65536; seed++) {
+		memset(ann_slots, 0, sizeof(ann_slots));
+
+		for (i = 0; i < NANNOTATIONS; i++) {
+			h = ann_hash(annotations[i].name,
+				     strlen(annotations[i].name), seed)
+				% ANN_SLOTS;
+			if (ann_slots[h])
+				break;
+			ann_slots[h] = i + 1;
+		}
+
+		if (i == NANNOTATIONS) {
+			ann_seed = seed;
+			ann_seed_ok = 1;
+			return;
+		}
+	}
+}
+
+int
+remap_annotation_id(const char *key, size_t keylen)
+{
+size_t	i;
+
+	pthread_once(&ann_once, ann_init);
+
+	if (!ann_seed_ok) {
+		for (i = 0; i < NANNOTATIONS; i++)
+			if (strlen(annotations[i].name) == keylen &&
+			    memcmp(annotations[i].name, key, keylen) == 0)
+				return annotations[i].id;
+		return -1;
+	}
+
+	if ((i = ann_slots[ann_hash(key, keylen, ann_seed) % ANN_SLOTS]) == 0)
+		return -1;
+
+	i--;
+	if (strlen(annotations[i].name) != keylen ||
+	    memcmp(annotations[i].name, key, keylen) != 0)
+		return -1;
+	return annotations[i].id;
+}
+
+/*
+ * Parse a list of whitespace-separated words into a set.
+ */
+static hash_t
+ann_word_set(const char *value, const char *sep)
+{
+hash_t	 ret;
+char	*v, *p, *r = NULL;
+
+	if ((v = strdup(value)) == NULL)
+		return NULL;
+
+	if ((ret = hash_new(1, NULL)) != NULL)
+		for (p = strtok_r(v, sep, &r); p; p = strtok_r(NULL, sep, &r))
+			hash_set(ret, p, HASH_PRESENT);
+
+	free(v);
+	return ret;
+}
+
+/*
+ * Convert a string containing comma-separated IP addresses into a
+ * remap_auth_addr list, allocated from ar.
+ */
+static struct remap_auth_addr *
+ann_addresses(arena_t *ar, const char *str)
+{
+struct remap_auth_addr	*list = NULL;
+char			*mstr, *save, *saddr;
+
+	if ((mstr = strdup(str)) == NULL)
+		return NULL;
+
+	for (saddr = strtok_r(mstr, ",", &save); saddr != NULL;
+	     saddr = strtok_r(NULL, ",", &save)) {
+	struct remap_auth_addr	 addr, *entry;
+	char			*p = NULL;
+
+		memset(&addr, 0, sizeof(addr));
+		if ((p = strchr(saddr, '/')) != NULL) {
+			*p++ = '\0';
+			addr.ra_prefix_length = atoi(p);
+		}
+
+		if (inet_pton(AF_INET6, saddr, addr.ra_addr_v6.s6_addr) == 1) {
+			addr.ra_family = AF_INET6;
+			if (p == NULL)
+				addr.ra_prefix_length = 128;
+		} else if (inet_pton(AF_INET, saddr, &addr.ra_addr_v4) == 1) {
+			addr.ra_family = AF_INET;
+			if (p == NULL)
+				addr.ra_prefix_length = 32;
+		} else
+			continue;
+
+		if ((entry = arena_alloc(ar, sizeof(*entry))) == NULL)
+			break;
+
+		*entry = addr;
+		entry->ra_next = list;
+		list = entry;
+	}
+
+	free(mstr);
+	return list;
+}
+
+/*
+ * Make the user database from the "auth" data of an auth-secret Secret.
+ */
+static hash_t
+ann_users(const char *authdata)
+{
+char	*buf, *entry, *s;
+size_t	 dlen;
+ssize_t	 n;
+hash_t	 users;
+
+	if ((users = hash_new(127, free)) == NULL)
+		return NULL;
+
+	if (*authdata == '\0')
+		return users;
+
+	dlen = strlen(authdata);
+	if ((s = buf = malloc(base64_decode_len(dlen) + 1)) == NULL)
+		return users;
+
+	n = base64_decode(authdata, dlen, (unsigned char *)buf);
+
+	if (n == -1) {
+		free(buf);
+		return users;
+	}
+
+	buf[n] = '\0';
+
+	while ((entry = strsep(&s, "\r\n")) != NULL) {
+	char	*password, *rest;
+		if ((password = strchr(entry, ':')) == NULL)
+			continue;
+		*password++ = '\0';
+
+		if ((rest = strchr(password, ':')) != NULL)
+			*rest = '\0';
+
+		while (strchr("\r\n", password[strlen(password) - 1]))
+			password[strlen(password) - 1] = '\0';
+
+		TSDebug("kubernetes", "added user %s/%s", entry, password);
+		hash_set(users, entry, strdup(password));
+	}
+
+	free(buf);
+	return users;
+}
+
+/*
+ * Parsed values are interned: every annotation with the same id and content,
+ * on any Ingress, shares one remap_interned_t, so a cluster where many
+ * Ingresses set the same cache-ignore-params or cors-origins (or use the same
+ * auth-secret) holds only one copy of it.  The content is the annotation's
+ * value, except for auth-secret, where it's the Secret's data, since Secrets
+ * with different names can hold the same users.
+ *
+ * ri_refs is protected by interned_lock, so that a value can't be found in
+ * the table while the last reference to it is being released.  ri_data itself
+ * is never modified once it's built.
+ */
+struct remap_interned {
+	arena_t		 ri_arena;
+	unsigned	 ri_refs;
+	int		 ri_id;
+	char		*ri_key;
+	void		*ri_data;
+};
+
+static hash_t		interned;
+static pthread_mutex_t	interned_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Free an interned value which is no longer in the table.
+ */
+static void
+interned_free(remap_interned_t *ri)
+{
+arena_t	arena;
+
+	switch (ri->ri_id) {
+	case REMAP_ANN_CACHE_IGNORE_PARAMS:
+	case REMAP_ANN_CACHE_WHITELIST_PARAMS:
+	case REMAP_ANN_CACHE_IGNORE_COOKIES:
+	case REMAP_ANN_CACHE_WHITELIST_COOKIES:
+		patset_free(ri->ri_data);
+		break;
+
+	case REMAP_ANN_COMPRESS_TYPES:
+	case REMAP_ANN_CORS_ORIGINS:
+	case REMAP_ANN_AUTH_SECRET:
+		hash_free(ri->ri_data);
+		break;
+	}
+
+	arena = ri->ri_arena;
+	arena_reset(&arena);
+}
+
+/*
+ * Build the parsed form of an annotation with the given content.
+ */
+static remap_interned_t *
+interned_build(int id, const char *key, const char *content)
+{
+remap_interned_t	*ri;
+arena_t			 arena;
+
+	arena_init(&arena, NULL, 0);
+	if ((ri = arena_calloc(&arena, 1, sizeof(*ri))) == NULL) {
+		arena_reset(&arena);
+		return NULL;
+	}
+	ri->ri_arena = arena;
+	ri->ri_refs = 1;
+	ri->ri_id = id;
+
+	if ((ri->ri_key = arena_strdup(&ri->ri_arena, key)) == NULL) {
+		interned_free(ri);
+		return NULL;
+	}
+
+	switch (id) {
+	case REMAP_ANN_CACHE_IGNORE_PARAMS:
+	case REMAP_ANN_CACHE_WHITELIST_PARAMS:
+	case REMAP_ANN_CACHE_IGNORE_COOKIES:
+	case REMAP_ANN_CACHE_WHITELIST_COOKIES:
+		ri->ri_data = patset_from_list(content);
+		break;
+
+	case REMAP_ANN_COMPRESS_TYPES:
+		ri->ri_data = ann_word_set(content, " \t");
+		break;
+
+	case REMAP_ANN_CORS_ORIGINS:
+		ri->ri_data = ann_word_set(content, " \t\r\n");
+		break;
+
+	case REMAP_ANN_AUTH_SECRET:
+		ri->ri_data = ann_users(content);
+		break;
+
+	case REMAP_ANN_WHITELIST_SOURCE_RANGE:
+		ri->ri_data = ann_addresses(&ri->ri_arena, content);
+		break;
+	}
+
+	return ri;
+}
+
+/*
+ * Return a reference to the interned parsed form of content, building it if
+ * no other annotation has it.
+ */
+static remap_interned_t *
+interned_get(int id, const char *content)
+{
+remap_interned_t	*ri, *built;
+char			*key;
+size_t			 len;
+
+	len = strlen(content) + 16;
+	if ((key = malloc(len)) == NULL)
+		return NULL;
+	snprintf(key, len, "%d:%s", id, content);
+
+	pthread_mutex_lock(&interned_lock);
+	if (interned == NULL)
+		interned = hash_new(127, NULL);
+	if ((ri = hash_get(interned, key)) != NULL)
+		ri->ri_refs++;
+	pthread_mutex_unlock(&interned_lock);
+
+	if (ri != NULL) {
+		free(key);
+		return ri;
+	}
+
+	/*
+	 * Build it without holding the lock, so parallel builds don't wait
+	 * for each other.  If another thread built the same thing meanwhile,
+	 * use that one instead.
+	 */
+	if ((built = interned_build(id, key, content)) == NULL) {
+		free(key);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&interned_lock);
+	if ((ri = hash_get(interned, key)) != NULL)
+		ri->ri_refs++;
+	else if (hash_set(interned, key, built) == 0)
+		ri = built;
+	pthread_mutex_unlock(&interned_lock);
+
+	if (ri != built)
+		interned_free(built);
+	free(key);
+	return ri;
+}
+
+static void
+interned_release(remap_interned_t *ri)
+{
+int	last = 0;
+
+	if (ri == NULL)
+		return;
+
+	pthread_mutex_lock(&interned_lock);
+	if (--ri->ri_refs == 0) {
+		hash_del(interned, ri->ri_key);
+		last = 1;
+	}
+	pthread_mutex_unlock(&interned_lock);
+
+	if (last)
+		interned_free(ri);
+}
+
+/*
+ * Parse one annotation's value into an_data, if it has a parsed form.
+ */
+static void
+ann_parse_data(namespace_t *ns, remap_annotation_t *an)
+{
+const char	*content = an->an_value;
+secret_t	*se;
+
+	switch (an->an_id) {
+	case REMAP_ANN_AUTH_SECRET:
+		if (ns == NULL ||
+		    (se = namespace_get_secret(ns, an->an_value)) == NULL)
+			return;
+		if ((content = hash_get(se->se_data, "auth")) == NULL)
+			content = "";
+		break;
+
+	case REMAP_ANN_CACHE_IGNORE_PARAMS:
+	case REMAP_ANN_CACHE_WHITELIST_PARAMS:
+	case REMAP_ANN_CACHE_IGNORE_COOKIES:
+	case REMAP_ANN_CACHE_WHITELIST_COOKIES:
+	case REMAP_ANN_COMPRESS_TYPES:
+	case REMAP_ANN_CORS_ORIGINS:
+	case REMAP_ANN_WHITELIST_SOURCE_RANGE:
+		break;
+
+	default:
+		return;
+	}
+
+	if ((an->an_interned = interned_get(an->an_id, content)) != NULL)
+		an->an_data = an->an_interned->ri_data;
+}
+
+remap_annotations_t *
+remap_annotations_parse(namespace_t *ns, hash_t annotations)
+{
+remap_annotations_t	*rn;
+remap_annotation_t	*an;
+arena_t			 arena;
+const char		*key, *value;
+size_t			 keylen, n = 0;
+int			 id;
+
+	arena_init(&arena, NULL, 0);
+	if ((rn = arena_calloc(&arena, 1, sizeof(*rn))) == NULL) {
+		arena_reset(&arena);
+		return NULL;
+	}
+	rn->rn_arena = arena;
+	rn->rn_refs = 1;
+
+	hash_foreach(annotations, &key, &keylen, &value)
+		if (remap_annotation_id(key, keylen) != -1)
+			n++;
+
+	if (n == 0)
+		return rn;
+
+	if ((rn->rn_items = arena_calloc(&rn->rn_arena, n,
+					 sizeof(*rn->rn_items))) == NULL) {
+		remap_annotations_free(rn);
+		return NULL;
+	}
+
+	hash_foreach(annotations, &key, &keylen, &value) {
+		if ((id = remap_annotation_id(key, keylen)) == -1 ||
+		    rn->rn_nitems == n)
+			continue;
+
+		TSDebug("kubernetes", "[%.*s] = [%s]", (int) keylen, key,
+			value);
+
+		an = &rn->rn_items[rn->rn_nitems];
+		an->an_id = id;
+		if ((an->an_value = arena_strdup(&rn->rn_arena, value)) == NULL)
+			continue;
+
+		ann_parse_data(ns, an);
+		rn->rn_nitems++;
+	}
+
+	return rn;
+}
+
+void
+remap_annotations_ref(remap_annotations_t *rn)
+{
+	__atomic_add_fetch(&rn->rn_refs, 1, __ATOMIC_RELAXED);
+}
+
+void
+remap_annotations_free(remap_annotations_t *rn)
+{
+arena_t	arena;
+size_t	i;
+
+	if (rn == NULL)
+		return;
+
+	if (__atomic_sub_fetch(&rn->rn_refs, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+
+	for (i = 0; i < rn->rn_nitems; i++)
+		interned_release(rn->rn_items[i].an_interned);
+
+	/* rn is in its own arena, so copy the arena out before freeing it */
+	arena = rn->rn_arena;
+	arena_reset(&arena);
+}
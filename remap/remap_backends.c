@@ -0,0 +1,353 @@
+/* vim:set sw=8 ts=8 noet: */
+/*
+ * Copyright (c) 2016-2017 Torchbox Ltd.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely. This software is provided 'as-is', without any express or implied
+ * warranty.
+ */
+/*
+ * remap_backends: the slots where the backends of each Service port are
+ * published, shared by every path (and every remap_db) which uses them, and
+ * the epochs which say when a replaced set of backends can be freed.
+ */
+
+#include	<stdlib.h>
+#include	<string.h>
+#include	<stdio.h>
+#include	<pthread.h>
+
+#include	<ts/ts.h>
+
+#include	"remap.h"
+
+/*
+ * The registry of shared slots, by bs_key.  A slot is removed when its last
+ * reference is released; bs_refs is protected by slots_lock so that a slot
+ * can't be found while it's being freed.
+ */
+static hash_t		slots;
+static pthread_mutex_t	slots_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static remap_backend_slot_t *
+slot_alloc(void)
+{
+remap_backend_slot_t	*ret;
+arena_t			 arena;
+
+	arena_init(&arena, NULL, 0);
+	if ((ret = arena_calloc(&arena, 1, sizeof(*ret))) == NULL) {
+		arena_reset(&arena);
+		return NULL;
+	}
+	ret->bs_arena = arena;
+	ret->bs_refs = 1;
+	return ret;
+}
+
+static void
+slot_destroy(remap_backend_slot_t *bs)
+{
+arena_t	arena;
+
+	/*
+	 * The last path using the slot is gone, so so is every remap_db which
+	 * could have found its current set.
+	 */
+	remap_backends_free(bs->bs_backends);
+
+	/* bs is in its own arena, so copy the arena out before freeing it */
+	arena = bs->bs_arena;
+	arena_reset(&arena);
+}
+
+remap_backend_slot_t *
+remap_backend_slot_new(void)
+{
+	return slot_alloc();
+}
+
+remap_backend_slot_t *
+remap_backend_slot_get(const cluster_t *cs, const char *ns,
+		       const char *service, const char *port, unsigned flags)
+{
+remap_backend_slot_t	*bs;
+char			 key[512];
+int			 n;
+
+	n = snprintf(key, sizeof(key), "%p/%s/%s/%s/%u", (const void *) cs,
+		     ns, service, port, flags);
+	if (n < 0 || (size_t) n >= sizeof(key))
+		return NULL;
+
+	pthread_mutex_lock(&slots_lock);
+
+	if (slots == NULL)
+		slots = hash_new(127, NULL);
+
+	if ((bs = hash_get(slots, key)) != NULL) {
+		bs->bs_refs++;
+		pthread_mutex_unlock(&slots_lock);
+		return bs;
+	}
+
+	if ((bs = slot_alloc()) == NULL) {
+		pthread_mutex_unlock(&slots_lock);
+		return NULL;
+	}
+
+	bs->bs_flags = flags;
+	bs->bs_cluster = cs;
+	bs->bs_key = arena_strdup(&bs->bs_arena, key);
+	bs->bs_namespace = arena_strdup(&bs->bs_arena, ns);
+	bs->bs_service = arena_strdup(&bs->bs_arena, service);
+	bs->bs_port = arena_strdup(&bs->bs_arena, port);
+
+	if (!bs->bs_key || !bs->bs_namespace || !bs->bs_service ||
+	    !bs->bs_port || hash_set(slots, key, bs) != 0) {
+		pthread_mutex_unlock(&slots_lock);
+		slot_destroy(bs);
+		return NULL;
+	}
+
+	pthread_mutex_unlock(&slots_lock);
+	return bs;
+}
+
+void
+remap_backend_slot_free(remap_backend_slot_t *bs)
+{
+int	last;
+
+	if (bs == NULL)
+		return;
+
+	pthread_mutex_lock(&slots_lock);
+	if ((last = (--bs->bs_refs == 0)) && bs->bs_key)
+		hash_del(slots, bs->bs_key);
+	pthread_mutex_unlock(&slots_lock);
+
+	if (last)
+		slot_destroy(bs);
+}
+
+const remap_backends_t *
+remap_backend_slot_current(const remap_backend_slot_t *bs)
+{
+	return __atomic_load_n(&bs->bs_backends, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Give the targets in new which are also in old the same statistics, so a
+ * target which didn't change isn't treated as new, and requests still in
+ * flight to it through old count towards its load.  A target which is new
+ * starts at the old set's average: if it started at 0 it would look faster
+ * than every other target, and get all the requests until its first response
+ * came back.
+ */
+static void
+slot_carry_stats(remap_backends_t *new, const remap_backends_t *old)
+{
+hash_t			 bytarget;
+const remap_target_t	*ot;
+remap_target_t		*nt;
+char			 key[512];
+size_t			 i;
+uint64_t		 mean;
+
+	if (old == NULL || old->rb_naddrs == 0 || new->rb_naddrs == 0)
+		return;
+
+	mean = remap_backends_mean_us(old, NULL);
+
+	if ((bytarget = hash_new(127, NULL)) == NULL)
+		return;
+
+	for (i = 0; i < old->rb_naddrs; i++) {
+		ot = &old->rb_addrs[i];
+		snprintf(key, sizeof(key), "%s:%d", ot->rt_host, ot->rt_port);
+		hash_set(bytarget, key, (void *) ot);
+	}
+
+	for (i = 0; i < new->rb_naddrs; i++) {
+		nt = &new->rb_addrs[i];
+		if (nt->rt_stats == NULL)
+			continue;
+
+		snprintf(key, sizeof(key), "%s:%d", nt->rt_host, nt->rt_port);
+		if ((ot = hash_get(bytarget, key)) == NULL ||
+		    ot->rt_stats == NULL) {
+			nt->rt_stats->rs_ewma_us = mean;
+			continue;
+		}
+
+		remap_target_stats_free(nt->rt_stats);
+		remap_target_stats_ref(ot->rt_stats);
+		nt->rt_stats = ot->rt_stats;
+	}
+
+	hash_free(bytarget);
+}
+
+/*
+ * The live epochs, oldest first, and the retired backend sets, newest first.
+ * Epochs are entered and exited by the builder, so the lock is never held by
+ * a request.
+ */
+static remap_epoch_t	*epoch_oldest, *epoch_newest;
+static uint64_t		 epoch_next = 1;
+static remap_backends_t	*retired;
+static pthread_mutex_t	 epoch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void
+remap_epoch_enter(remap_epoch_t *re)
+{
+	pthread_mutex_lock(&epoch_lock);
+	re->re_epoch = epoch_next++;
+	re->re_next = NULL;
+	if ((re->re_prev = epoch_newest) != NULL)
+		epoch_newest->re_next = re;
+	else
+		epoch_oldest = re;
+	epoch_newest = re;
+	pthread_mutex_unlock(&epoch_lock);
+}
+
+/*
+ * Remove the retired sets which no live epoch could be using from the list,
+ * and return them.  Since the list is newest first, they're at the end.
+ */
+static remap_backends_t *
+epoch_collect(void)
+{
+remap_backends_t	**rbp, *ret;
+
+	for (rbp = &retired; *rbp; rbp = &(*rbp)->rb_retired_next)
+		if (epoch_oldest == NULL ||
+		    (*rbp)->rb_retired_epoch <= epoch_oldest->re_epoch)
+			break;
+
+	ret = *rbp;
+	*rbp = NULL;
+	return ret;
+}
+
+static void
+epoch_free(remap_backends_t *rb)
+{
+remap_backends_t	*next;
+
+	for (; rb; rb = next) {
+		next = rb->rb_retired_next;
+		remap_backends_free(rb);
+	}
+}
+
+void
+remap_epoch_exit(remap_epoch_t *re)
+{
+remap_backends_t	*rb;
+
+	pthread_mutex_lock(&epoch_lock);
+	if (re->re_prev)
+		re->re_prev->re_next = re->re_next;
+	else
+		epoch_oldest = re->re_next;
+	if (re->re_next)
+		re->re_next->re_prev = re->re_prev;
+	else
+		epoch_newest = re->re_prev;
+	rb = epoch_collect();
+	pthread_mutex_unlock(&epoch_lock);
+
+	epoch_free(rb);
+}
+
+/*
+ * A retired set can be freed once every epoch older than epoch_next now has
+ * exited: a remap_db made after this can only see the set which replaced it.
+ */
+static void
+epoch_retire(remap_backends_t *rb)
+{
+	if (rb == NULL)
+		return;
+
+	pthread_mutex_lock(&epoch_lock);
+	rb->rb_retired_epoch = epoch_next;
+	rb->rb_retired_next = retired;
+	retired = rb;
+	rb = epoch_collect();
+	pthread_mutex_unlock(&epoch_lock);
+
+	epoch_free(rb);
+}
+
+void
+remap_backend_slot_publish(remap_backend_slot_t *bs, remap_backends_t *rb)
+{
+	/*
+	 * Only the builder publishes, so bs_backends can't change between
+	 * reading it here and swapping it below.
+	 */
+	if (rb)
+		slot_carry_stats(rb, bs->bs_backends);
+
+	epoch_retire(__atomic_exchange_n(&bs->bs_backends, rb,
+					 __ATOMIC_ACQ_REL));
+}
+
+/*
+ * Return 1 if the slot's Service or Endpoints is in changed.  If we can't
+ * make the key, assume it changed.
+ */
+static int
+slot_changed(const remap_backend_slot_t *bs, hash_t changed)
+{
+static const char	*kinds[] = {
+	CLUSTER_KIND_ENDPOINTS, CLUSTER_KIND_SERVICE,
+};
+char			 key[512];
+size_t			 i;
+
+	for (i = 0; i < sizeof(kinds) / sizeof(*kinds); i++)
+		if (cluster_object_key(key, sizeof(key), kinds[i],
+				       bs->bs_namespace,
+				       bs->bs_service) == -1 ||
+		    hash_get(changed, key) != NULL)
+			return 1;
+	return 0;
+}
+
+remap_backend_slot_t **
+remap_backend_slots_changed(const cluster_t *cs, hash_t changed,
+			    size_t *nslots)
+{
+remap_backend_slot_t	**ret = NULL, **nret, *bs;
+size_t			  n = 0, size = 0;
+
+	pthread_mutex_lock(&slots_lock);
+
+	if (slots)
+		hash_foreach(slots, NULL, NULL, &bs) {
+			if (bs->bs_cluster != cs || !slot_changed(bs, changed))
+				continue;
+
+			if (n == size) {
+				size = size ? size * 2 : 8;
+				if ((nret = realloc(ret, sizeof(*ret) * size))
+				    == NULL)
+					break;
+				ret = nret;
+			}
+
+			bs->bs_refs++;
+			ret[n++] = bs;
+		}
+
+	pthread_mutex_unlock(&slots_lock);
+
+	*nslots = n;
+	return ret;
+}
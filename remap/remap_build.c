@@ -8,92 +8,535 @@
  * warranty.
  */
 
+#include	<stdio.h>
+#include	<stdlib.h>
 #include	<string.h>
+#include	<stdint.h>
+#include	<unistd.h>
+#include	<pthread.h>
 
 #include	<ts/ts.h>
 
 #include	"hash.h"
 #include	"remap.h"
 
-static void build_namespace(remap_db_t *, cluster_t *, namespace_t *);
-static void build_ingress(remap_db_t *, cluster_t *, namespace_t *, ingress_t *);
+static void build_namespaces(remap_db_t *, cluster_t *, hash_t);
+static void build_namespace(remap_db_t *, cluster_t *, namespace_t *, hash_t);
+static void build_ingress(remap_db_t *, cluster_t *, namespace_t *, ingress_t *,
+			  hash_t);
 static void build_ingress_tls(remap_db_t *, cluster_t *, namespace_t *,
-			      ingress_t *, ingress_tls_t *);
+			      ingress_t *, ingress_tls_t *, hash_t);
 static void build_ingress_rule(remap_db_t *, cluster_t *, namespace_t *,
-			       ingress_t *, ingress_rule_t *);
+			       ingress_t *, ingress_rule_t *, hash_t,
+			       remap_annotations_t **);
+static remap_host_t *build_get_host(remap_db_t *, const char *host,
+				    hash_t only);
+static int build_ingress_wanted(remap_db_t *, ingress_t *);
+static void build_changed_hosts(namespace_t *, ingress_t *, hash_t changed,
+				hash_t hosts);
 static void build_add_endpoints(remap_db_t *db, cluster_t *, namespace_t *,
 				remap_path_t *rp, service_t *svc,
 				const char *port_name);
+static remap_backends_t *build_backends(k8s_config_t *, cluster_t *,
+					namespace_t *, service_t *,
+					const char *port_name, unsigned flags);
+static void build_set_node(k8s_config_t *, cluster_t *, remap_backends_t *,
+			   remap_target_t *, const char *nodename);
+
+/*
+ * The first-seen table.  This outlives every remap_db, and is only used while
+ * building one, so a mutex is fine.
+ */
+#define	FIRST_SEEN_EXPIRE	600	/* Forget addresses gone this long */
+
+typedef struct {
+	time_t	fs_first;
+	time_t	fs_last;
+} first_seen_t;
+
+static hash_t		first_seen;
+static int		first_seen_primed;
+static pthread_mutex_t	first_seen_lock = PTHREAD_MUTEX_INITIALIZER;
+
+time_t
+remap_first_seen(const char *host, int port, time_t now)
+{
+first_seen_t	*fs;
+char		 key[512];
+time_t		 ret = 0;
+int		 n;
+
+	n = snprintf(key, sizeof(key), "%s:%d", host, port);
+	if (n < 0 || (size_t) n >= sizeof(key))
+		return 0;
+
+	pthread_mutex_lock(&first_seen_lock);
+
+	if (first_seen == NULL)
+		first_seen = hash_new(127, NULL);
+
+	if ((fs = hash_get(first_seen, key)) == NULL &&
+	    (fs = calloc(1, sizeof(*fs))) != NULL) {
+		fs->fs_first = first_seen_primed ? now : 0;
+		hash_set(first_seen, key, fs);
+	}
+
+	if (fs) {
+		fs->fs_last = now;
+		ret = fs->fs_first;
+	}
+
+	pthread_mutex_unlock(&first_seen_lock);
+	return ret;
+}
+
+void
+remap_first_seen_expire(time_t now)
+{
+const char	*key;
+size_t		 keylen;
+first_seen_t	*fs;
+hash_t		 keep;
+
+	pthread_mutex_lock(&first_seen_lock);
+	first_seen_primed = 1;
+
+	if (first_seen == NULL) {
+		pthread_mutex_unlock(&first_seen_lock);
+		return;
+	}
+
+	/*
+	 * The hash can't be modified while iterating, so move the entries we
+	 * want to keep to a new one.  The hashes don't own their entries.
+	 */
+	keep = hash_new(127, NULL);
+	hash_foreach(first_seen, &key, &keylen, &fs) {
+		if (fs->fs_last + FIRST_SEEN_EXPIRE < now)
+			free(fs);
+		else
+			hash_setn(keep, key, keylen, fs);
+	}
+
+	hash_free(first_seen);
+	first_seen = keep;
+
+	pthread_mutex_unlock(&first_seen_lock);
+}
+
+void
+remap_first_seen_reset(void)
+{
+first_seen_t	*fs;
+
+	pthread_mutex_lock(&first_seen_lock);
+	first_seen_primed = 0;
+
+	if (first_seen) {
+		hash_foreach(first_seen, NULL, NULL, &fs)
+			free(fs);
+		hash_free(first_seen);
+		first_seen = NULL;
+	}
+
+	pthread_mutex_unlock(&first_seen_lock);
+}
+
+/*
+ * Each build has its own number, so a full build can tell which backend slots
+ * it has already filled.
+ */
+static unsigned	build_count;
 
 remap_db_t *
 remap_db_from_cluster(k8s_config_t *cfg, cluster_t *cluster)
+{
+	return remap_db_update(cfg, cluster, NULL, NULL);
+}
+
+remap_db_t *
+remap_db_update(k8s_config_t *cfg, cluster_t *cluster, const remap_db_t *old,
+		hash_t changed)
 {
 namespace_t		*namespace;
+ingress_t		*ing;
 remap_db_t		*db;
+remap_host_t		*rh;
+hash_t			 only = NULL;
+const char		*host, *key;
+int			 nbuilt = 0;
 
 	db = remap_db_new(cfg);
-	hash_foreach(cluster->cs_namespaces, NULL, NULL, &namespace)
-		build_namespace(db, cluster, namespace);
+	db->rd_build = __atomic_add_fetch(&build_count, 1, __ATOMIC_RELAXED);
+
+	if (old && changed && (only = hash_new(127, NULL)) != NULL) {
+		/*
+		 * Work out which hosts need to be rebuilt: those built from a
+		 * changed object, plus every host the current Ingresses say
+		 * depends on a changed object, since the old db won't know
+		 * about hosts which are new or didn't build last time.
+		 */
+		hash_foreach(old->rd_hosts, &host, NULL, &rh) {
+			if (rh->rh_deps == NULL)
+				continue;
+			hash_foreach(changed, &key, NULL, NULL)
+				if (hash_get(rh->rh_deps, key)) {
+					hash_set(only, host, HASH_PRESENT);
+					break;
+				}
+		}
+
+		hash_foreach(cluster->cs_namespaces, NULL, NULL, &namespace)
+			hash_foreach(namespace->ns_ingresses, NULL, NULL, &ing)
+				build_changed_hosts(namespace, ing, changed,
+						    only);
+
+		/* Everything else is shared with the old db. */
+		hash_foreach(old->rd_hosts, &host, NULL, &rh) {
+			if (hash_get(only, host))
+				continue;
+			remap_host_ref(rh);
+			hash_set(db->rd_hosts, host, rh);
+		}
+	}
+
+	build_namespaces(db, cluster, only);
+
+	/*
+	 * Addresses on shared hosts weren't seen by this build, so only expire
+	 * the first-seen table on a full build.  The watcher resyncs (and so
+	 * does a full build) more often than entries expire.
+	 */
+	if (only == NULL)
+		remap_first_seen_expire(time(NULL));
+
+	/* Forget TLS contexts for Secrets which are no longer used. */
+	remap_tls_expire();
+
+	/*
+	 * Now every path has all its addresses, build the consistent hash
+	 * tables.  Shared hosts already have theirs.
+	 */
+	hash_foreach(db->rd_hosts, &host, NULL, &rh) {
+		if (only && !hash_get(only, host))
+			continue;
+		for (size_t i = 0; i < rh->rh_npaths; i++)
+			remap_path_build_lb(rh->rh_paths[i]);
+		nbuilt++;
+	}
 
 	if (cluster->cs_config->cc_healthcheck)
 		db->rd_healthcheck = strdup(cluster->cs_config->cc_healthcheck);
 
+	TSDebug("kubernetes", "remap_db_update: built %d hosts%s", nbuilt,
+		only ? " (incremental)" : "");
+	hash_free(only);
 	return db;
 }
 
 /*
- * Build a single namespace.
+ * Add the hosts of an Ingress which might be affected by the changed objects
+ * to the set hosts: all of them if the Ingress itself changed, otherwise those
+ * whose TLS secret changed (a host isn't built from a TLS entry whose secret
+ * didn't exist, so the old db can't tell us about those).
+ */
+static void
+build_changed_hosts(namespace_t *ns, ingress_t *ing, hash_t changed,
+		    hash_t hosts)
+{
+char	key[512];
+int	all;
+
+	/* If we can't make the key, assume it changed. */
+	all = cluster_object_key(key, sizeof(key), CLUSTER_KIND_INGRESS,
+				 ns->ns_name, ing->in_name) == -1 ||
+	      hash_get(changed, key) != NULL;
+
+	if (all)
+		for (size_t i = 0; i < ing->in_nrules; i++)
+			if (ing->in_rules[i].ir_host)
+				hash_set(hosts, ing->in_rules[i].ir_host,
+					 HASH_PRESENT);
+
+	for (size_t i = 0; i < ing->in_ntls; i++) {
+	ingress_tls_t	*itls = &ing->in_tls[i];
+
+		if (!all &&
+		    cluster_object_key(key, sizeof(key), CLUSTER_KIND_SECRET,
+				       ns->ns_name, itls->it_secret_name) == 0 &&
+		    hash_get(changed, key) == NULL)
+			continue;
+
+		for (size_t j = 0; j < itls->it_nhosts; j++)
+			hash_set(hosts, itls->it_hosts[j], HASH_PRESENT);
+	}
+}
+
+/*
+ * Namespaces are built in parallel, each into its own remap_db, by a pool of
+ * threads which take the next unbuilt namespace until there are none left.
+ * Nothing they share is modified except the first-seen table and the TLS
+ * cache, which have their own locks.
+ */
+#define	BUILD_MAX_THREADS	8	/* Default limit on build threads */
+
+typedef struct {
+	cluster_t	 *bj_cluster;
+	k8s_config_t	 *bj_config;
+	hash_t		  bj_only;
+	namespace_t	**bj_namespaces;
+	remap_db_t	**bj_dbs;
+	size_t		  bj_nnamespaces;
+	size_t		  bj_next;	/* Next namespace to build */
+	unsigned	  bj_build;	/* rd_build of the new db */
+} build_job_t;
+
+static void *
+build_thread(void *data)
+{
+build_job_t	*job = data;
+size_t		 i;
+
+	while ((i = __atomic_fetch_add(&job->bj_next, 1, __ATOMIC_RELAXED))
+	       < job->bj_nnamespaces) {
+		if ((job->bj_dbs[i] = remap_db_new(job->bj_config)) == NULL)
+			continue;
+		job->bj_dbs[i]->rd_build = job->bj_build;
+		build_namespace(job->bj_dbs[i], job->bj_cluster,
+				job->bj_namespaces[i], job->bj_only);
+	}
+
+	return NULL;
+}
+
+/*
+ * Work out how many threads to build with.
+ */
+static size_t
+build_nthreads(const k8s_config_t *cfg, size_t nnamespaces)
+{
+size_t	n = cfg ? cfg->co_build_threads : 0;
+long	ncpus;
+
+	if (n == 0) {
+		ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+		n = ncpus > 0 ? (size_t) ncpus : 1;
+		if (n > BUILD_MAX_THREADS)
+			n = BUILD_MAX_THREADS;
+	}
+
+	return n < nnamespaces ? n : nnamespaces;
+}
+
+/*
+ * Build every namespace into db.  If only is not NULL, only the hosts it
+ * contains are built.
+ *
+ * Most hosts are only built by one namespace, and are simply moved to db.  A
+ * host built by more than one namespace is built again afterwards, by every
+ * namespace which built it, in the same order as a serial build would, so
+ * which path or annotation wins doesn't depend on the threads.
  */
 static void
-build_namespace(remap_db_t *db, cluster_t *cs, namespace_t *ns)
+build_namespaces(remap_db_t *db, cluster_t *cs, hash_t only)
+{
+build_job_t	 job;
+namespace_t	*ns;
+pthread_t	*threads = NULL;
+size_t		 nthreads, nstarted = 0, i;
+char		*again = NULL;
+hash_t		 owner = NULL, shared = NULL;
+const char	*host;
+remap_host_t	*rh;
+uintptr_t	 o;
+
+	memset(&job, 0, sizeof(job));
+	job.bj_cluster = cs;
+	job.bj_config = db->rd_config;
+	job.bj_only = only;
+	job.bj_build = db->rd_build;
+
+	hash_foreach(cs->cs_namespaces, NULL, NULL, &ns)
+		job.bj_nnamespaces++;
+
+	nthreads = build_nthreads(db->rd_config, job.bj_nnamespaces);
+	if (nthreads <= 1)
+		goto serial;
+
+	job.bj_namespaces = calloc(job.bj_nnamespaces, sizeof(namespace_t *));
+	job.bj_dbs = calloc(job.bj_nnamespaces, sizeof(remap_db_t *));
+	again = calloc(job.bj_nnamespaces, 1);
+	threads = calloc(nthreads - 1, sizeof(pthread_t));
+	owner = hash_new(4093, NULL);
+	shared = hash_new(127, NULL);
+	if (!job.bj_namespaces || !job.bj_dbs || !again || !threads ||
+	    !owner || !shared)
+		goto serial;
+
+	i = 0;
+	hash_foreach(cs->cs_namespaces, NULL, NULL, &ns)
+		job.bj_namespaces[i++] = ns;
+
+	/* This thread is a builder too. */
+	for (; nstarted < nthreads - 1; nstarted++)
+		if (pthread_create(&threads[nstarted], NULL, build_thread,
+				   &job) != 0)
+			break;
+	build_thread(&job);
+	for (i = 0; i < nstarted; i++)
+		pthread_join(threads[i], NULL);
+
+	TSDebug("kubernetes", "build_namespaces: built %d namespaces with %d"
+		" threads", (int) job.bj_nnamespaces, (int) nstarted + 1);
+
+	/* If we ran out of memory, try again without threads. */
+	for (i = 0; i < job.bj_nnamespaces; i++)
+		if (job.bj_dbs[i] == NULL)
+			break;
+	if (i < job.bj_nnamespaces) {
+		for (i = 0; i < job.bj_nnamespaces; i++)
+			remap_db_free(job.bj_dbs[i]);
+		goto serial;
+	}
+
+	/* Find the hosts built by more than one namespace. */
+	for (i = 0; i < job.bj_nnamespaces; i++) {
+		hash_foreach(job.bj_dbs[i]->rd_hosts, &host, NULL, &rh) {
+			if ((o = (uintptr_t) hash_get(owner, host)) == 0) {
+				hash_set(owner, host, (void *) (i + 1));
+				continue;
+			}
+
+			hash_set(shared, host, HASH_PRESENT);
+			again[o - 1] = again[i] = 1;
+		}
+	}
+
+	/*
+	 * Move the other hosts to db.  The hosts are refcounted, so just take
+	 * a reference and let remap_db_free() drop the namespace db's.
+	 */
+	for (i = 0; i < job.bj_nnamespaces; i++) {
+		hash_foreach(job.bj_dbs[i]->rd_hosts, &host, NULL, &rh) {
+			if (hash_get(shared, host))
+				continue;
+			remap_host_ref(rh);
+			hash_set(db->rd_hosts, host, rh);
+		}
+
+		remap_db_free(job.bj_dbs[i]);
+	}
+
+	/* Build the shared hosts again, in namespace order. */
+	for (i = 0; i < job.bj_nnamespaces; i++)
+		if (again[i])
+			build_namespace(db, cs, job.bj_namespaces[i], shared);
+
+	goto done;
+
+serial:
+	hash_foreach(cs->cs_namespaces, NULL, NULL, &ns)
+		build_namespace(db, cs, ns, only);
+
+done:
+	free(job.bj_namespaces);
+	free(job.bj_dbs);
+	free(again);
+	free(threads);
+	hash_free(owner);
+	hash_free(shared);
+}
+
+/*
+ * Fetch (creating if needed) the host to build, or return NULL if this build
+ * isn't rebuilding it.
+ */
+static remap_host_t *
+build_get_host(remap_db_t *db, const char *host, hash_t only)
+{
+	if (only && !hash_get(only, host))
+		return NULL;
+	return remap_db_get_or_create_host(db, host);
+}
+
+/*
+ * Build a single namespace.  If only is not NULL, only the hosts it contains
+ * are built.
+ */
+static void
+build_namespace(remap_db_t *db, cluster_t *cs, namespace_t *ns, hash_t only)
 {
 ingress_t		*ingress;
 
 	TSDebug("kubernetes", "namespace %s:", ns->ns_name);
 
 	hash_foreach(ns->ns_ingresses, NULL, NULL, &ingress)
-		build_ingress(db, cs, ns, ingress);
+		build_ingress(db, cs, ns, ingress, only);
 }
 
 /*
- * Build a single ingress.
+ * Check whether we should handle this Ingress's class.
  */
-static void
-build_ingress(remap_db_t *db, cluster_t *cs, namespace_t *ns, ingress_t *ing)
+static int
+build_ingress_wanted(remap_db_t *db, ingress_t *ing)
 {
 char	*cls;
 
-	TSDebug("kubernetes", "  ingress %s:", ing->in_name);
-	
-	/*
-	 * Check whether we should handle this class.
-	 */
 	if ((cls = hash_get(ing->in_annotations, IN_CLASS)) != NULL) {
 		TSDebug("kubernetes", "    ingress class is [%s]", cls);
 
 		if (hash_get(db->rd_config->co_classes, cls) != HASH_PRESENT)
-			return;
+			return 0;
 	}
 
-	/* Rebuild remap state */
+	return 1;
+}
+
+/*
+ * Build a single ingress.
+ */
+static void
+build_ingress(remap_db_t *db, cluster_t *cs, namespace_t *ns, ingress_t *ing,
+	      hash_t only)
+{
+remap_annotations_t	*annotations = NULL;
+
+	TSDebug("kubernetes", "  ingress %s:", ing->in_name);
+
+	if (!build_ingress_wanted(db, ing))
+		return;
+
+	/*
+	 * Rebuild remap state.  The annotations are parsed by the first rule
+	 * which needs them, and shared by all its paths.
+	 */
 	for (size_t i = 0; i < ing->in_nrules; i++)
-		build_ingress_rule(db, cs, ns, ing, &ing->in_rules[i]);
+		build_ingress_rule(db, cs, ns, ing, &ing->in_rules[i], only,
+				   &annotations);
+	remap_annotations_free(annotations);
 
 	/* Rebuild TLS state */
 	for (size_t i = 0; i < ing->in_ntls; i++)
-		build_ingress_tls(db, cs, ns, ing, &ing->in_tls[i]);
+		build_ingress_tls(db, cs, ns, ing, &ing->in_tls[i], only);
 }
 
 static void
 build_ingress_rule(remap_db_t *db, cluster_t *cs, namespace_t *ns,
-		   ingress_t *ing, ingress_rule_t *rule)
+		   ingress_t *ing, ingress_rule_t *rule, hash_t only,
+		   remap_annotations_t **annotations)
 {
 remap_host_t	*rh;
+cluster_cert_t	*crt;
+const char	*auth;
 size_t		 i;
 
 	if (!rule->ir_host)
 		return;
 
+	/* Don't complain about hosts we aren't building. */
+	if (only && !hash_get(only, rule->ir_host))
+		return;
+
 	if (!cluster_domain_for_ns(cs, rule->ir_host, ns->ns_name)) {
 		TSError("kubernetes: ignoring Ingress %s host %s since "
 			"namespace %s does not have access to this domain",
@@ -101,19 +544,37 @@ size_t		 i;
 		return;
 	}
 
-	rh = remap_db_get_or_create_host(db, rule->ir_host);
+	if ((rh = build_get_host(db, rule->ir_host, only)) == NULL)
+		return;
+
+	remap_host_depend(rh, CLUSTER_KIND_INGRESS, ns->ns_name, ing->in_name);
 
 	/*
 	 * Attach default TLS contexts here.  The context will be replaced by
 	 * build_ingress_tls if the TLS provides its own TLS configuration.
 	 */
+	if ((crt = cluster_get_cert_for_hostname(cs, rule->ir_host)) != NULL)
+		remap_host_depend(rh, CLUSTER_KIND_SECRET, crt->cr_namespace,
+				  crt->cr_name);
 	remap_host_attach_default_tls(rh, cs, rule->ir_host);
 
+	if ((auth = hash_get(ing->in_annotations, IN_AUTH_SECRET)) != NULL)
+		remap_host_depend(rh, CLUSTER_KIND_SECRET, ns->ns_name, auth);
+
 	for (i = 0; i < rule->ir_npaths; i++) {
 	ingress_path_t	*path = &rule->ir_paths[i];
 	remap_path_t	*rp;
 	service_t	*svc;
 
+		/*
+		 * Depend on the Service even if it doesn't exist yet, so we
+		 * notice when it's created.  Endpoints changes don't affect
+		 * the host; remap_backends_update() publishes the new
+		 * backends in the path's slot.
+		 */
+		remap_host_depend(rh, CLUSTER_KIND_SERVICE, ns->ns_name,
+				  path->ip_service_name);
+
 		svc = namespace_get_service(ns, path->ip_service_name);
 		if (svc == NULL)
 			continue;
@@ -136,7 +597,27 @@ size_t		 i;
 		if (rp == NULL)
 			continue;
 
-		remap_path_annotate(ns, cs, rp, ing->in_annotations);
+		if (*annotations == NULL &&
+		    (*annotations = remap_annotations_parse(ns,
+					ing->in_annotations)) == NULL)
+			continue;
+
+		rp->rp_service_upstream = db->rd_config &&
+					  db->rd_config->co_service_upstream;
+		remap_path_annotate(rp, *annotations);
+
+		/*
+		 * A Service with ClientIP session affinity should keep sending
+		 * each client to the same pod, unless the Ingress asked for a
+		 * different load balancing policy.
+		 */
+		if (rp->rp_lb == REMAP_LB_RANDOM && svc->sv_session_affinity &&
+		    strcmp(svc->sv_session_affinity,
+			   SV_SESSION_AFFINITY_CLIENTIP) == 0) {
+			rp->rp_lb = REMAP_LB_HASH;
+			rp->rp_hash_by = REMAP_HASH_CLIENT_IP;
+		}
+
 		build_add_endpoints(db, cs, ns, rp, svc, path->ip_service_port);
 	}
 }
@@ -146,7 +627,7 @@ size_t		 i;
  */
 static void
 build_ingress_tls(remap_db_t *db, cluster_t *cs, namespace_t *ns,
-		  ingress_t *ing, ingress_tls_t *itls)
+		  ingress_t *ing, ingress_tls_t *itls, hash_t only)
 {
 secret_t		*secret;
 
@@ -171,30 +652,34 @@ secret_t		*secret;
 			return;
 		}
 
-		rh = remap_db_get_or_create_host(db, hostname);
+		if ((rh = build_get_host(db, hostname, only)) == NULL)
+			continue;
 
-		if (rh->rh_ctx) {
-			/*
-			 * Might already have a context attached if the host
-			 * matched the default certificates.
-			 */
-			SSL_CTX_free(rh->rh_ctx);
-			rh->rh_ctx = NULL;
-		}
+		remap_host_depend(rh, CLUSTER_KIND_INGRESS, ns->ns_name,
+				  ing->in_name);
+		remap_host_depend(rh, CLUSTER_KIND_SECRET, ns->ns_name,
+				  itls->it_secret_name);
 
-		if ((rh->rh_ctx = secret_make_ssl_ctx(secret)) == NULL) {
+		/*
+		 * Might already have a context attached if the host matched
+		 * the default certificates.
+		 */
+		remap_tls_free(rh->rh_tls);
+
+		if ((rh->rh_tls = remap_tls_get(secret)) == NULL) {
 			TSDebug("kubernetes", "      %s: can't make ctx",
 				hostname);
 			continue;
 		}
 
-		TSDebug("kubernetes", "      %s: added with CTX[%p]",
-			hostname, rh->rh_ctx);
+		TSDebug("kubernetes", "      %s: added with TLS[%p]",
+			hostname, rh->rh_tls);
 	}
 }
 
 /*
- * Attach a Service's endpoints to a remap_path.
+ * Attach a Service's backends to a remap_path.  The path shares the slot of
+ * the Service port with every other path which uses it.
  */
 static void
 build_add_endpoints(
@@ -205,9 +690,10 @@ build_add_endpoints(
 	service_t *svc,
 	const char *port_name)
 {
-service_port_t	*port;
-endpoints_t	*eps;
-size_t		 i, j;
+remap_backend_slot_t	*bs;
+remap_backends_t	*rb;
+service_port_t		*port;
+unsigned		 flags;
 
 	/*
 	 * If this is an ExternalName service, add the name directly; no need to
@@ -221,15 +707,78 @@ size_t		 i, j;
 		return;
 	}
 
-	/* Find the service port from the name given in the Ingress */
+	/* A path only sends requests to one Service port. */
+	if (rp->rp_backends) {
+		TSDebug("kubernetes", "        path already has backends;"
+			" ignoring service %s", svc->sv_name);
+		return;
+	}
+
+	/* Don't make a slot for a port which doesn't exist */
 	if ((port = service_find_port(svc, port_name, SV_P_TCP)) == NULL)
 		return;
 
-	/* Find the endpoint for the service */
-	eps = namespace_get_endpoints(ns, svc->sv_name);
-	if (eps == NULL)
+	/*
+	 * With service-upstream, send requests to the Service's ClusterIP and
+	 * let kube-proxy pick the pod; the path doesn't need the Endpoints at
+	 * all.  A headless Service has no ClusterIP, so it still uses them.
+	 */
+	if (rp->rp_service_upstream && service_has_cluster_ip(svc)) {
+		TSDebug("kubernetes", "        add service %s:%d",
+			svc->sv_cluster_ip, port->sp_port);
+		remap_path_add_address(rp, svc->sv_cluster_ip, port->sp_port);
+		return;
+	}
+
+	flags = rp->rp_lb == REMAP_LB_HASH ? REMAP_BACKENDS_HASH : 0;
+	bs = remap_backend_slot_get(cs, ns->ns_name, svc->sv_name, port_name,
+				    flags);
+	if ((rp->rp_backends = bs) == NULL)
 		return;
 
+	/*
+	 * Fill each slot a build uses once.  This also refreshes a slot an
+	 * old db still holds, whose Endpoints the watcher may have stopped
+	 * reporting while no path used them.  A slot is only used by one
+	 * namespace, so only one thread can be here for each slot.
+	 */
+	if (bs->bs_build == db->rd_build)
+		return;
+	bs->bs_build = db->rd_build;
+
+	if ((rb = build_backends(db->rd_config, cs, ns, svc, port_name,
+				 flags)) != NULL)
+		remap_backend_slot_publish(bs, rb);
+}
+
+/*
+ * Build the backends of a Service port from its Endpoints.
+ */
+static remap_backends_t *
+build_backends(k8s_config_t *cfg, cluster_t *cs, namespace_t *ns,
+	       service_t *svc, const char *port_name, unsigned flags)
+{
+remap_backends_t	*rb;
+service_port_t		*port;
+endpoints_t		*eps;
+size_t			 i, j;
+remap_target_t		*rt;
+time_t			 now = time(NULL);
+
+	if ((rb = remap_backends_new()) == NULL)
+		return NULL;
+
+	/*
+	 * Find the service port from the name given in the Ingress, and the
+	 * endpoints for the service.  If either is missing, there are no
+	 * backends.
+	 */
+	if ((port = service_find_port(svc, port_name, SV_P_TCP)) == NULL ||
+	    (eps = namespace_get_endpoints(ns, svc->sv_name)) == NULL) {
+		remap_backends_build_lb(rb, flags);
+		return rb;
+	}
+
 	/*
 	 * Each endpoint has a list of subsets, each of which has a list of
 	 * addresses.  Add each address from each subset.
@@ -248,7 +797,124 @@ size_t		 i, j;
 		endpoints_address_t *addr = &es->es_addrs[j];
 			TSDebug("kubernetes", "        add host %s:%d",
 				addr->ea_ip, epp->et_port);
-			remap_path_add_address(rp, addr->ea_ip, epp->et_port);
+			rt = remap_backends_add_address(rb, addr->ea_ip,
+							epp->et_port);
+			if (rt == NULL)
+				continue;
+			build_set_node(cfg, cs, rb, rt, addr->ea_nodename);
+			rt->rt_first_seen = remap_first_seen(addr->ea_ip,
+							     epp->et_port, now);
+		}
+	}
+
+	remap_backends_build_lb(rb, flags);
+	return rb;
+}
+
+/*
+ * Publish new backends for every Service port whose Service or Endpoints
+ * changed.  This runs with the cluster read-locked, like a build.
+ */
+size_t
+remap_backends_update(k8s_config_t *cfg, cluster_t *cs, hash_t changed)
+{
+remap_backend_slot_t	**slots, *bs;
+remap_backends_t	 *rb;
+namespace_t		 *ns;
+service_t		 *svc;
+const char		 *key;
+size_t			  nslots, npublished = 0, ndel = 0, i;
+char			**del = NULL, **ndel_;
+size_t			  delsize = 0;
+
+	if (changed == NULL)
+		return 0;
+
+	slots = remap_backend_slots_changed(cs, changed, &nslots);
+
+	for (i = 0; i < nslots; i++) {
+		bs = slots[i];
+
+		/*
+		 * If the Service is gone, or isn't a ClusterIP any more, the
+		 * hosts using it will be rebuilt, and stop using this slot.
+		 * Until then, it has no backends.
+		 */
+		ns = cluster_find_namespace(cs, bs->bs_namespace);
+		svc = ns ? namespace_get_service(ns, bs->bs_service) : NULL;
+		if (svc && strcmp(svc->sv_type, SV_TYPE_EXTERNALNAME) != 0)
+			rb = build_backends(cfg, cs, ns, svc, bs->bs_port,
+					    bs->bs_flags);
+		else if ((rb = remap_backends_new()) != NULL)
+			remap_backends_build_lb(rb, bs->bs_flags);
+
+		if (rb) {
+			remap_backend_slot_publish(bs, rb);
+			npublished++;
 		}
+		remap_backend_slot_free(bs);
 	}
+
+	free(slots);
+	TSDebug("kubernetes", "remap_backends_update: published %d backends",
+		(int) npublished);
+
+	/*
+	 * Nothing else depends on Endpoints, so remove them from changed.
+	 * The hash can't be modified while iterating, so find them first.
+	 */
+	hash_foreach(changed, &key, NULL, NULL) {
+		if (strncmp(key, CLUSTER_KIND_ENDPOINTS "/",
+			    sizeof(CLUSTER_KIND_ENDPOINTS)) != 0)
+			continue;
+
+		if (ndel == delsize) {
+			delsize = delsize ? delsize * 2 : 8;
+			if ((ndel_ = realloc(del, sizeof(*del) * delsize))
+			    == NULL)
+				break;
+			del = ndel_;
+		}
+
+		if ((del[ndel] = strdup(key)) != NULL)
+			ndel++;
+	}
+
+	for (i = 0; i < ndel; i++) {
+		hash_del(changed, del[i]);
+		free(del[i]);
+	}
+	free(del);
+
+	return npublished;
+}
+
+/*
+ * Record which node (and zone, if we know the node's zone) a target is on,
+ * and how close that is to us.
+ */
+static void
+build_set_node(k8s_config_t *cfg, cluster_t *cs, remap_backends_t *rb,
+	       remap_target_t *rt, const char *nodename)
+{
+const char	*mynode = cfg ? cfg->co_node_name : NULL;
+const char	*zone = NULL;
+node_t		*node;
+unsigned	 locality = REMAP_LOCAL_REMOTE;
+
+	if (nodename == NULL)
+		return;
+
+	if ((node = cluster_get_node(cs, nodename)) != NULL)
+		zone = node->nd_zone;
+
+	if (mynode) {
+		if (strcmp(nodename, mynode) == 0)
+			locality = REMAP_LOCAL_NODE;
+		else if (zone && (node = cluster_get_node(cs, mynode)) &&
+			 node->nd_zone && strcmp(zone, node->nd_zone) == 0)
+			locality = REMAP_LOCAL_ZONE;
+	}
+
+	remap_target_set_node(rb, rt, nodename, zone, locality);
 }
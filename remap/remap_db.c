@@ -24,12 +24,13 @@
 
 #include	<regex.h>
 
+#include	<openssl/evp.h>
+
 #include	<ts/ts.h>
 
 #include	"remap.h"
 #include	"auth.h"
 #include	"base64.h"
-#include	"strmatch.h"
 
 remap_db_t *
 remap_db_new(k8s_config_t *cfg)
@@ -45,6 +46,37 @@ remap_db_t	*ret;
 	}
 
 	ret->rd_config = cfg;
+	remap_epoch_enter(&ret->rd_epoch);
+	return ret;
+}
+
+remap_db_t *
+remap_db_copy(const remap_db_t *old)
+{
+remap_db_t	*ret;
+const char	*host;
+size_t		 hostlen;
+remap_host_t	*rh;
+
+	if ((ret = remap_db_new(old->rd_config)) == NULL)
+		return NULL;
+
+	ret->rd_build = old->rd_build;
+	if (old->rd_healthcheck &&
+	    (ret->rd_healthcheck = strdup(old->rd_healthcheck)) == NULL) {
+		remap_db_free(ret);
+		return NULL;
+	}
+
+	hash_foreach(old->rd_hosts, &host, &hostlen, &rh) {
+		remap_host_ref(rh);
+		if (hash_setn(ret->rd_hosts, host, hostlen, rh) != 0) {
+			remap_host_free(rh);
+			remap_db_free(ret);
+			return NULL;
+		}
+	}
+
 	return ret;
 }
 
@@ -57,6 +89,9 @@ remap_db_free(remap_db_t *db)
 
 	hash_free(db->rd_hosts);
 	free(db->rd_healthcheck);
+
+	/* Backends retired while we were live might be freed now */
+	remap_epoch_exit(&db->rd_epoch);
 	free(db);
 }
 
@@ -106,16 +141,30 @@ rr_check_proto(const remap_db_t *db, const remap_request_t *req,
  * app-root: redirect a request for "/" to the given path.
  */
 int
-rr_check_app_root(const remap_db_t *db, const remap_request_t *req,
+rr_check_app_root(const remap_db_t *db, remap_request_t *req,
 		  remap_result_t *ret)
 {
+remap_header_t	*loc;
+
 	if (!ret->rz_path->rp_app_root)
 		return RR_OK;
 
 	if (req->rr_path)
 		return RR_OK;
 
-	hash_set(ret->rz_headers, "Location", strdup(ret->rz_path->rp_app_root));
+	/*
+	 * CORS headers might already be set, so put the Location header in
+	 * front of them.  Both lists are shared, so link a copy.
+	 */
+	if (ret->rz_headers == NULL ||
+	    (loc = arena_alloc(&req->rr_arena, sizeof(*loc))) == NULL)
+		ret->rz_headers = ret->rz_path->rp_hdr_app_root;
+	else {
+		*loc = *ret->rz_path->rp_hdr_app_root;
+		loc->hd_next = (remap_header_t *) ret->rz_headers;
+		ret->rz_headers = loc;
+	}
+
 	ret->rz_status = 301;
 	ret->rz_status_text = "Moved";
 	ret->rz_body = "This document has moved.\n";
@@ -123,26 +172,27 @@ rr_check_app_root(const remap_db_t *db, const remap_request_t *req,
 }
 
 int
-rr_check_tls(const remap_db_t *db, const remap_request_t *req,
-	     remap_result_t *ret)
+rr_check_tls(const remap_db_t *db, remap_request_t *req, remap_result_t *ret)
 {
 const char	*newp;
 size_t		 blen;
-char		*hdr;
+char		*url;
+remap_header_t	*hdr;
 
 	/* If already TLS, do nothing */
 	if (!strcmp(req->rr_proto, "https") || !strcmp(req->rr_proto, "wss"))
 		return RR_OK;
 
 	/*
-	 * Skip redirect if no_ssl_redirect is set, or if the rh_ctx is null
-	 * and force_ssl_redirect is not set.
+	 * Skip redirect if no_ssl_redirect is set, or if the host doesn't have
+	 * a valid certificate and force_ssl_redirect is not set.
 	 */
 	TSDebug("kubernetes", "rp_no_ssl_redirect=%d",
 		ret->rz_path->rp_no_ssl_redirect);
 	if (ret->rz_path->rp_no_ssl_redirect)
 		return RR_OK;
-	if (!ret->rz_host->rh_ctx && !ret->rz_path->rp_force_ssl_redirect)
+	if ((!ret->rz_host->rh_tls || !remap_tls_valid(ret->rz_host->rh_tls))
+	    && !ret->rz_path->rp_force_ssl_redirect)
 		return RR_OK;
 
 	/* We will redirect */
@@ -160,14 +210,21 @@ char		*hdr;
 	if (req->rr_query)
 		blen += strlen(req->rr_query) + 1;
 
-	hdr = malloc(blen);
-	snprintf(hdr, blen, "%s://%s/%s%s%s",
+	if ((url = arena_alloc(&req->rr_arena, blen)) == NULL ||
+	    (hdr = arena_alloc(&req->rr_arena, sizeof(*hdr))) == NULL)
+		return RR_ERR_INTERNAL;
+
+	snprintf(url, blen, "%s://%s/%s%s%s",
 		 newp, req->rr_host,
 		 req->rr_path ? req->rr_path : "",
 		 req->rr_query ? "?" : "",
 		 req->rr_query ? req->rr_query : "");
 
-	hash_set(ret->rz_headers, "Location", hdr);
+	hdr->hd_name = "Location";
+	hdr->hd_value = url;
+	hdr->hd_next = NULL;
+
+	ret->rz_headers = hdr;
 	ret->rz_status = 301;
 	ret->rz_status_text = "Moved";
 	ret->rz_body = "This document has moved.\n";
@@ -175,11 +232,12 @@ char		*hdr;
 }
 
 int
-rr_check_cors(const remap_db_t *db, const remap_request_t *req,
-	      remap_result_t *res)
+rr_check_cors(const remap_db_t *db, remap_request_t *req, remap_result_t *res)
 {
 const char		*origin;
-remap_hdrfield_t	*hdr;
+const remap_hdrfield_t	*hdr;
+remap_header_t		*cors;
+int			 preflight;
 
 	TSDebug("kubernetes", "rr_check_cors: rp_enable_cors=%d",
 		res->rz_path->rp_enable_cors);
@@ -192,7 +250,7 @@ remap_hdrfield_t	*hdr;
 	/*
 	 * If the request has no Origin header, do nothing.
 	 */
-	if ((hdr = hash_get(req->rr_hdrfields, "origin")) == NULL) {
+	if ((hdr = remap_request_get_header(req, "origin")) == NULL) {
 		TSDebug("kubernetes", "rr_check_cors: no Origin");
 		return RR_OK;
 	}
@@ -206,27 +264,39 @@ remap_hdrfield_t	*hdr;
 	origin = hdr->rh_values[0];
 	TSDebug("kubernetes", "rr_check_cors: origin is %s", origin);
 
+	/*
+	 * Only a preflight request gets the full set of CORS headers.
+	 */
+	preflight = (strcmp(req->rr_method, "OPTIONS") == 0);
+	cors = preflight ? res->rz_path->rp_hdr_cors_preflight
+			 : res->rz_path->rp_hdr_cors;
+
 	/*
 	 * If no Origin list has been specified, the origin is "*".  This is
 	 * treated specially by the CORS specification, so do not use the
 	 * request Origin header.
 	 */
-	if (hash_get(res->rz_path->rp_cors_origins, "*") == HASH_PRESENT) {
+	if (res->rz_path->rp_cors_any_origin) {
 		TSDebug("kubernetes", "rr_check_cors: using wildcard origin");
-		hash_set(res->rz_headers, "Access-Control-Allow-Origin",
-			 strdup("*"));
+		res->rz_headers = cors;
 	/*
 	 * Otherwise, check if the origin is in the list of origins.  In that
-	 * case, we have to Vary by origin as the response changes depending
-	 * on the origin.
+	 * case, we have to echo the origin (the prebuilt list already includes
+	 * Vary: Origin, since the response changes depending on the origin).
 	 */
 	} else if (hash_get(res->rz_path->rp_cors_origins,
 			    origin) == HASH_PRESENT) {
+	remap_header_t	*acao;
+
 		TSDebug("kubernetes", "rr_check_cors: using origin %s",
 			origin);
-		hash_set(res->rz_headers, "Access-Control-Allow-Origin",
-			 strdup(origin));
-		hash_set(res->rz_headers, "Vary", strdup("Origin"));
+		if ((acao = arena_alloc(&req->rr_arena, sizeof(*acao))) == NULL
+		    || (acao->hd_value = arena_strdup(&req->rr_arena,
+						      origin)) == NULL)
+			return RR_ERR_INTERNAL;
+		acao->hd_name = "Access-Control-Allow-Origin";
+		acao->hd_next = cors;
+		res->rz_headers = acao;
 	/*
 	 * Otherwise, we don't recognise this origin, so do nothing.
 	 */
@@ -238,54 +308,26 @@ remap_hdrfield_t	*hdr;
 	/*
 	 * If this is not a preflight request, there's nothing more to do.
 	 */
-	if (strcmp(req->rr_method, "OPTIONS")) {
+	if (!preflight) {
 		TSDebug("kubernetes", "rr_check_cors: not preflight");
 		return RR_OK;
 	}
 
-	/*
-	 * Add response headers based on the configuration.
-	 */
-	if (res->rz_path->rp_cors_methods)
-		hash_set(res->rz_headers, "Access-Control-Allow-Methods",
-			 strdup(res->rz_path->rp_cors_methods));
-
-	if (res->rz_path->rp_cors_headers)
-		hash_set(res->rz_headers, "Access-Control-Allow-Headers",
-			 strdup(res->rz_path->rp_cors_headers));
-
-	if (res->rz_path->rp_cors_max_age) {
-	char	s[32];
-		snprintf(s, sizeof(s), "%d", res->rz_path->rp_cors_max_age);
-		hash_set(res->rz_headers, "Access-Control-Max-Age", strdup(s));
-	}
-
-	if (res->rz_path->rp_cors_creds)
-		hash_set(res->rz_headers, "Access-Control-Allow-Credentials",
-			 strdup("true"));
-
 	res->rz_status = 204;
 	res->rz_status_text = "No content";
 	return RR_SYNTHETIC;
 }
 
 static void
-set_wwwauth_header(remap_result_t *res)
+set_wwwauth_header(remap_request_t *req, remap_result_t *res)
 {
-char	*hdr;
-size_t	 len;
-
-	len = sizeof("Basic realm=\"\"") + strlen(res->rz_path->rp_auth_realm);
-	hdr = malloc(len);
-	snprintf(hdr, len, "Basic realm=\"%s\"", res->rz_path->rp_auth_realm);
-	hash_set(res->rz_headers, "WWW-Authenticate", hdr);
+	res->rz_headers = res->rz_path->rp_hdr_wwwauth;
 }
 
 int
-rr_check_auth(const remap_db_t *db, const remap_request_t *req,
-	      remap_result_t *res)
+rr_check_auth(const remap_db_t *db, remap_request_t *req, remap_result_t *res)
 {
-remap_hdrfield_t	*rr_auth_field;
+const remap_hdrfield_t	*rr_auth_field;
 const char		*rr_auth = NULL;
 
 	/* No authentication? */
@@ -307,7 +349,7 @@ const char		*rr_auth = NULL;
 	 * in practice, it's extremely unlikely we would ever see such a
 	 * header.
 	 */
-	rr_auth_field = hash_get(req->rr_hdrfields, "authorization");
+	rr_auth_field = remap_request_get_header(req, "authorization");
 	if (rr_auth_field && rr_auth_field->rh_nvalues == 1)
 		rr_auth = rr_auth_field->rh_values[0];
 
@@ -316,7 +358,7 @@ const char		*rr_auth = NULL;
 		if (rr_auth && auth_check_basic(rr_auth, res->rz_path) == 1)
 			return RR_OK;
 
-		set_wwwauth_header(res);
+		set_wwwauth_header(req, res);
 		return RR_ERR_UNAUTHORIZED;
 	}
 
@@ -326,7 +368,7 @@ const char		*rr_auth = NULL;
 			return RR_OK;
 
 		if (!rr_auth || auth_check_basic(rr_auth, res->rz_path) != 1) {
-			set_wwwauth_header(res);
+			set_wwwauth_header(req, res);
 			return RR_ERR_UNAUTHORIZED;
 		}
 
@@ -336,7 +378,7 @@ const char		*rr_auth = NULL;
 			return RR_ERR_FORBIDDEN;
 
 		if (!rr_auth || auth_check_basic(rr_auth, res->rz_path) != 1) {
-			set_wwwauth_header(res);
+			set_wwwauth_header(req, res);
 			return RR_ERR_UNAUTHORIZED;
 		}
 
@@ -344,120 +386,124 @@ const char		*rr_auth = NULL;
 	}
 }
 
-int
-qstrcmp(const void *a, const void *b)
+/*
+ * A query parameter, pointing into the request's query string.
+ */
+typedef struct query_param {
+	const char	*qp_str;
+	size_t		 qp_len;
+} query_param_t;
+
+static int
+qparamcmp(const void *a, const void *b)
 {
-	return strcmp(*(char **)a, *(char **)b);
+const query_param_t	*qa = a, *qb = b;
+int			 r;
+
+	r = memcmp(qa->qp_str, qb->qp_str,
+		   qa->qp_len < qb->qp_len ? qa->qp_len : qb->qp_len);
+	if (r)
+		return r;
+	return (qa->qp_len > qb->qp_len) - (qa->qp_len < qb->qp_len);
 }
 
 int
-keep_parameter(const remap_path_t *path, const char *param)
+keep_parameter(const remap_path_t *path, const char *param, size_t len)
 {
 const char	*pend;
 
-	if ((pend = strchr(param, '=')) == NULL)
-		pend = param + strlen(param);
+	if ((pend = memchr(param, '=', len)) == NULL)
+		pend = param + len;
 
 	/* If there's an ignore list, discard anything on it */
-	if (path->rp_ignore_params) {
-	const char	*p = NULL;
-	size_t		 plen;
-
-		TSDebug("kubernetes", "keep_parameter: checking ignore");
-
-		hash_foreach(path->rp_ignore_params, &p, &plen, NULL) {
-			TSDebug("kubernetes", "keep_parameter: check [%.*s]"
-				" against [%.*s]", (int)(pend - param), param,
-				(int) plen, p);
-			if (strmatch(param, pend, p, p + plen))
-				return 0;
-			TSDebug("kubernetes", "keep_parameter: no match");
-		}
-	}
+	if (path->rp_ignore_params &&
+	    patset_match(path->rp_ignore_params, param, pend - param))
+		return 0;
 
 	/* If there's a whitelist, discard anything not on the whitelist */
-	if (path->rp_whitelist_params) {
-	const char	*p = NULL;
-	size_t		 plen;
-
-		hash_foreach(path->rp_whitelist_params, &p, &plen, NULL) {
-			if (strmatch(param, pend, p, p + plen))
-				return 1;
-		}
-
-		/* Not on whitelist */
+	if (path->rp_whitelist_params &&
+	    !patset_match(path->rp_whitelist_params, param, pend - param))
 		return 0;
-	}
 
 	/* Not on ignore list and not rejected by whitelist */
 	return 1;
 }
 
-void
-make_query(const remap_request_t *req, remap_result_t *res)
+/*
+ * Build the cache query string: the request's query parameters, with ignored
+ * parameters removed, sorted.  The parameters are not copied; the query is
+ * scanned once to find them, then the ones we keep are written out into a
+ * buffer the size of the original query.
+ */
+int
+make_query(remap_request_t *req, remap_result_t *res)
 {
-char		**params = NULL;
-size_t		  nparams = 0;
-
-char		*sr = NULL, *p, *q, *ret;
-size_t		 len = 0;
-
-	q = strdup(req->rr_query);
+query_param_t	*params;
+size_t		 nparams = 0, maxparams = 1, i;
+const char	*p, *q, *end;
+char		*ret, *r;
+
+	end = req->rr_query + strlen(req->rr_query);
+
+	/* Upper bound on the number of parameters */
+	for (p = req->rr_query; (p = memchr(p, '&', end - p)) != NULL; ++p)
+		++maxparams;
+	params = arena_alloc(&req->rr_arena, sizeof(*params) * maxparams);
+	if (params == NULL)
+		return RR_ERR_INTERNAL;
+
+	/* Extract the query parameters we actually want. */
+	for (p = req->rr_query; p < end; p = q + 1) {
+		if ((q = memchr(p, '&', end - p)) == NULL)
+			q = end;
+
+		if (q == p)
+			continue;
 
-	/*
-	 * Extract the query parameters we actually want into a hash.
-	 */
-	for (p = strtok_r(q, "&", &sr); p; p = strtok_r(NULL, "&", &sr)) {
-		TSDebug("kubernetes", "make_query: param is [%s]", p);
+		TSDebug("kubernetes", "make_query: param is [%.*s]",
+			(int)(q - p), p);
 
-		if (!keep_parameter(res->rz_path, p))
+		if (!keep_parameter(res->rz_path, p, q - p))
 			continue;
 
-		TSDebug("kubernetes", "keeping this param");
-		params = realloc(params, sizeof(char *) * (nparams + 1));
-		params[nparams] = strdup(p);
-		++nparams;
-
-		len += strlen(p) + 1;
+		params[nparams].qp_str = p;
+		params[nparams].qp_len = q - p;
+		nparams++;
 	}
 
-	free(q);
-
-	if (!len) {
-		free(params);
-		return;
-	}
+	if (!nparams)
+		return RR_OK;
 
-	qsort(params, nparams, sizeof(char *), qstrcmp);
+	qsort(params, nparams, sizeof(*params), qparamcmp);
 
-	/* Join the hash back into a query string. */
-	ret = malloc(len + 1);
-	ret[0] = '\0';
+	/* Join the parameters back into a query string. */
+	if ((ret = r = arena_alloc(&req->rr_arena,
+				   end - req->rr_query + 1)) == NULL)
+		return RR_ERR_INTERNAL;
 
-	for (size_t i = 0; i < nparams; ++i) {
-		strcat(ret, params[i]);
-		strcat(ret, "&");
-		free(params[i]);
+	for (i = 0; i < nparams; ++i) {
+		if (i)
+			*r++ = '&';
+		memcpy(r, params[i].qp_str, params[i].qp_len);
+		r += params[i].qp_len;
 	}
 
-	if (len)
-		ret[len - 1] = '\0';
-
+	*r = '\0';
 	res->rz_query = ret;
-	free(params);
+	return RR_OK;
 }
 
 /*
  * Remap a request.
  */
 int
-remap_run(const remap_db_t *db, const remap_request_t *req, remap_result_t *ret)
+remap_run(const remap_db_t *db, remap_request_t *req, remap_result_t *ret)
 {
-int	 r;
-size_t	 pfxsz;
+int			 r;
+const remap_backends_t	*rb = NULL;
+size_t			 pfxsz;
 
 	memset(ret, 0, sizeof(*ret));
-	ret->rz_headers = hash_new(127, free);
 
 	if (req->rr_path && db->rd_healthcheck &&
 	    !strcmp(req->rr_path, db->rd_healthcheck + 1)) {
@@ -512,116 +558,302 @@ size_t	 pfxsz;
 		size_t	blen =	strlen(req->rr_path) - pfxsz
 				+ strlen(ret->rz_path->rp_rewrite_target) + 1;
 
-			ret->rz_urlpath = malloc(blen);
+			if ((ret->rz_urlpath = arena_alloc(&req->rr_arena,
+							   blen)) == NULL)
+				return RR_ERR_INTERNAL;
 			snprintf(ret->rz_urlpath, blen, "%s%s",
 				 ret->rz_path->rp_rewrite_target,
 				 req->rr_path + pfxsz);
 		} else {
-			ret->rz_urlpath = strdup(ret->rz_path->rp_rewrite_target);
+			ret->rz_urlpath = arena_strdup(&req->rr_arena,
+					ret->rz_path->rp_rewrite_target);
+			if (ret->rz_urlpath == NULL)
+				return RR_ERR_INTERNAL;
 		}
 	} else {
 		if (req->rr_path)
-			ret->rz_urlpath = strdup(req->rr_path);
+			ret->rz_urlpath = req->rr_path;
 	}
 
 	/* Set query string */
-	if (req->rr_query)
-		make_query(req, ret);
+	if (req->rr_query && (r = make_query(req, ret)) != RR_OK)
+		return r;
 
 	/* Set backend protocol */
 	if ((r = rr_check_proto(db, req, ret)) != RR_OK)
 		return r;
 
-	/* Does this path have any backends? */
-	if (ret->rz_path->rp_naddrs == 0) {
+	/*
+	 * Does this path have any backends?  If new backends are published
+	 * during the request, this set stays valid while the caller holds db.
+	 */
+	if (ret->rz_path->rp_backends)
+		rb = remap_backend_slot_current(ret->rz_path->rp_backends);
+
+	if (rb == NULL || rb->rb_naddrs == 0) {
 		TSDebug("kubernetes", "[%s] no backends", req->rr_host);
 		return RR_ERR_NO_BACKEND;
 	}
 
-	/* Pick and return a random backend */
-	ret->rz_target = remap_path_pick_target(ret->rz_path);
+	/* Pick and return a backend */
+	ret->rz_backends = rb;
+	ret->rz_target = remap_path_pick_target(ret->rz_path, rb, req);
 	TSDebug("kubernetes", "[%s] rewrite -> %s:%d", req->rr_host,
 		ret->rz_target->rt_host, ret->rz_target->rt_port);
 	return RR_OK;
 }
 
+static remap_hdrfield_t *
+request_find_header(const remap_request_t *req, const char *name)
+{
+remap_hdrfield_t	*field;
+
+	for (field = req->rr_hdrfields; field; field = field->rh_next)
+		if (strcmp(field->rh_name, name) == 0)
+			return field;
+	return NULL;
+}
+
+/*
+ * Return the request header field called name (which must be lowercase), or
+ * NULL if the request doesn't have it.  The field is owned by the request.
+ */
+const remap_hdrfield_t *
+remap_request_get_header(remap_request_t *req, const char *name)
+{
+remap_hdrfield_t	*field;
+char			*fname;
+
+	if ((field = request_find_header(req, name)) != NULL)
+		return field->rh_nvalues ? field : NULL;
+
+	if (!req->rr_hdrfield_get)
+		return NULL;
+
+	if ((fname = arena_strdup(&req->rr_arena, name)) == NULL)
+		return NULL;
+
+	/*
+	 * Remember fields the request doesn't have as well, so we only ask
+	 * once.  If that fails, we'll just ask again next time.
+	 */
+	field = req->rr_hdrfield_get(req->rr_hdrfield_data, &req->rr_arena,
+				     name);
+	if (field == NULL)
+		field = arena_calloc(&req->rr_arena, 1, sizeof(*field));
+	if (field == NULL)
+		return NULL;
+
+	field->rh_name = fname;
+	field->rh_next = req->rr_hdrfields;
+	req->rr_hdrfields = field;
+	return field->rh_nvalues ? field : NULL;
+}
+
+/*
+ * Add a value to the request header field called name (which must be
+ * lowercase), creating the field if the request doesn't have it yet.
+ * Returns 0 on success, or -1 if memory couldn't be allocated.
+ */
+int
+remap_request_add_header(remap_request_t *req, const char *name,
+			 const char *value)
+{
+remap_hdrfield_t	*field;
+char			**values;
+
+	if ((field = request_find_header(req, name)) == NULL) {
+		if ((field = arena_calloc(&req->rr_arena, 1,
+					  sizeof(*field))) == NULL ||
+		    (field->rh_name = arena_strdup(&req->rr_arena,
+						   name)) == NULL)
+			return -1;
+		field->rh_next = req->rr_hdrfields;
+		req->rr_hdrfields = field;
+	}
+
+	/* Fields rarely have more than one value, so just copy the array */
+	values = arena_alloc(&req->rr_arena,
+			     sizeof(char *) * (field->rh_nvalues + 1));
+	if (values == NULL)
+		return -1;
+	if (field->rh_nvalues)
+		memcpy(values, field->rh_values,
+		       sizeof(char *) * field->rh_nvalues);
+	if ((values[field->rh_nvalues] = arena_strdup(&req->rr_arena,
+						      value)) == NULL)
+		return -1;
+
+	field->rh_values = values;
+	field->rh_nvalues++;
+	return 0;
+}
+
+/*
+ * Free a request, and the data of any result created from it.
+ */
 void
 remap_request_free(remap_request_t *req)
 {
-	free(req->rr_method);
-	free(req->rr_proto);
-	free(req->rr_host);
-	free(req->rr_path);
-	free(req->rr_query);
-
-	hash_free(req->rr_hdrfields);
+	req->rr_hdrfields = NULL;
+	arena_reset(&req->rr_arena);
 }
 
+/*
+ * A result holds nothing of its own; everything it refers to belongs to the
+ * request or the remap_db.
+ */
 void
 remap_result_free(remap_result_t *rz)
 {
-	hash_free(rz->rz_headers);
-	free(rz->rz_urlpath);
-	free(rz->rz_query);
+	rz->rz_headers = NULL;
+	rz->rz_backends = NULL;
 }
 
-void
-remap_make_cache_key(remap_request_t *req, remap_result_t *res,
-		     char **key, size_t *keylen)
-{	
-uint8_t		 protolen, hostlen;
-uint16_t	 pathlen = 0, querylen = 0;
-char		*buf, *p;
-size_t		 buflen;
+/*
+ * The cache key is built from a serialisation of the URL: each of the proto,
+ * host, path and query is preceded by its length (one byte for proto and host,
+ * two bytes little-endian for path and query).  A length too large for its
+ * field is written as all-ones followed by the real length as four bytes,
+ * which leaves the key of every URL that fits unchanged.
+ *
+ * The serialisation is base64-encoded CACHE_KEY_CHUNK bytes at a time from a
+ * stack buffer directly into the caller's buffer; since the chunk size is a
+ * multiple of three, the encoded chunks join up without padding.
+ */
+#define	CACHE_KEY_CHUNK		(3 * 256)
 
-	buflen = 0;
+typedef struct cache_key_writer {
+	unsigned char	 kw_buf[CACHE_KEY_CHUNK];
+	size_t		 kw_len;
+	char		*kw_out;
+	EVP_MD_CTX	*kw_md;		/* If hashing, the digest context */
+} cache_key_writer_t;
 
-	protolen = (uint8_t) strlen(req->rr_proto);
-	hostlen = (uint8_t) strlen(req->rr_host);
+static void
+ckw_flush(cache_key_writer_t *kw)
+{
+	if (kw->kw_md)
+		EVP_DigestUpdate(kw->kw_md, kw->kw_buf, kw->kw_len);
+	else {
+		base64_encode(kw->kw_buf, kw->kw_len, kw->kw_out);
+		kw->kw_out += base64_encode_len(kw->kw_len);
+	}
 
-	buflen += 1 + protolen + 1 + hostlen;
+	kw->kw_len = 0;
+}
 
-	if (req->rr_path)
-		pathlen = (uint16_t) strlen(req->rr_path);
-	if (res->rz_query)
-		querylen = (uint16_t) strlen(res->rz_query);
+static void
+ckw_write(cache_key_writer_t *kw, const void *data, size_t len)
+{
+const unsigned char	*p = data;
 
-	buflen += 2 + pathlen + 2 + querylen;
+	while (len) {
+	size_t	n = sizeof(kw->kw_buf) - kw->kw_len;
 
-	buf = p = malloc(buflen);
+		if (n > len)
+			n = len;
 
-	*p++ = protolen;
-	memcpy(p, req->rr_proto, protolen);
-	p += protolen;
+		memcpy(kw->kw_buf + kw->kw_len, p, n);
+		kw->kw_len += n;
+		p += n;
+		len -= n;
 
-	*p++ = hostlen;
-	memcpy(p, req->rr_host, hostlen);
-	p += hostlen;
+		if (kw->kw_len == sizeof(kw->kw_buf))
+			ckw_flush(kw);
+	}
+}
 
-	*p++ = pathlen & 0xFF;
-	*p++ = (pathlen >> 8) & 0xFF;
-	if (req->rr_path)
-		memcpy(p, req->rr_path, pathlen);
-	p += pathlen;
+/*
+ * Write a length field of the given width (1 or 2 bytes).
+ */
+static void
+ckw_write_len(cache_key_writer_t *kw, size_t len, int width)
+{
+size_t		max = width == 1 ? 0xFF : 0xFFFF;
+unsigned char	b[6];
+int		i, n = 0;
 
-	*p++ = querylen & 0xFF;
-	*p++ = (querylen >> 8) & 0xFF;
-	if (res->rz_query)
-		memcpy(p, res->rz_query, querylen);
-	p += querylen;
-
-	*keylen = base64_encode_len(buflen) + 1;
-	*key = malloc(*keylen);
-	**key = '/';
-	base64_encode((unsigned char*)buf, buflen, *key + 1);
-	free(buf);
+	if (len < max) {
+		for (i = 0; i < width; i++)
+			b[n++] = (len >> (8 * i)) & 0xFF;
+	} else {
+		for (i = 0; i < width; i++)
+			b[n++] = 0xFF;
+		for (i = 0; i < 4; i++)
+			b[n++] = (len >> (8 * i)) & 0xFF;
+	}
+
+	ckw_write(kw, b, n);
 }
 
-void
-remap_hdrfield_free(remap_hdrfield_t *field)
+static size_t
+len_field_size(size_t len, int width)
+{
+	return len < (width == 1 ? 0xFFu : 0xFFFFu) ? width : width + 4;
+}
+
+size_t
+remap_make_cache_key(const remap_request_t *req, const remap_result_t *res,
+		     char *buf, size_t bufsz, size_t hashmin)
 {
-	for (size_t i = 0; i < field->rh_nvalues; ++i)
-		free(field->rh_values[i]);
-	free(field->rh_values);
-	free(field);
+size_t			protolen, hostlen, pathlen = 0, querylen = 0;
+size_t			rawlen, keylen;
+cache_key_writer_t	kw;
+
+	protolen = strlen(req->rr_proto);
+	hostlen = strlen(req->rr_host);
+	if (req->rr_path)
+		pathlen = strlen(req->rr_path);
+	if (res->rz_query)
+		querylen = strlen(res->rz_query);
+
+	rawlen = len_field_size(protolen, 1) + protolen
+	       + len_field_size(hostlen, 1) + hostlen
+	       + len_field_size(pathlen, 2) + pathlen
+	       + len_field_size(querylen, 2) + querylen;
+
+	if (hashmin && rawlen > hashmin)
+		keylen = CACHE_KEY_HASHED_LEN;
+	else {
+		hashmin = 0;
+		keylen = 1 + base64_encode_len(rawlen);
+	}
+
+	if (keylen > bufsz)
+		return keylen;
+
+	kw.kw_len = 0;
+	kw.kw_md = NULL;
+	kw.kw_out = buf;
+
+	if (hashmin) {
+		if ((kw.kw_md = EVP_MD_CTX_new()) == NULL)
+			return 0;
+		EVP_DigestInit_ex(kw.kw_md, EVP_sha256(), NULL);
+		*kw.kw_out++ = '/';
+		*kw.kw_out++ = '~';
+	} else
+		*kw.kw_out++ = '/';
+
+	ckw_write_len(&kw, protolen, 1);
+	ckw_write(&kw, req->rr_proto, protolen);
+	ckw_write_len(&kw, hostlen, 1);
+	ckw_write(&kw, req->rr_host, hostlen);
+	ckw_write_len(&kw, pathlen, 2);
+	ckw_write(&kw, req->rr_path, pathlen);
+	ckw_write_len(&kw, querylen, 2);
+	ckw_write(&kw, res->rz_query, querylen);
+	ckw_flush(&kw);
+
+	if (kw.kw_md) {
+	unsigned char	md[EVP_MAX_MD_SIZE];
+	unsigned int	mdlen;
+
+		EVP_DigestFinal_ex(kw.kw_md, md, &mdlen);
+		EVP_MD_CTX_free(kw.kw_md);
+		base64_encode(md, mdlen, kw.kw_out);
+	}
+
+	return keylen;
 }
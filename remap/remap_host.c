@@ -17,6 +17,7 @@
 #include	<ts/ts.h>
 
 #include	"remap.h"
+#include	"rax.h"
 
 static int
 truefalse(const char *str)
@@ -41,32 +42,76 @@ remap_host_t	*ret;
 	/* Add the default path */
 	remap_host_new_path(ret, NULL);
 
+	ret->rh_refs = 1;
 	return ret;
 }
 
+void
+remap_host_ref(remap_host_t *host)
+{
+	__atomic_add_fetch(&host->rh_refs, 1, __ATOMIC_RELAXED);
+}
+
 void
 remap_host_free(remap_host_t *host)
 {
 size_t	i;
 
+	if (__atomic_sub_fetch(&host->rh_refs, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+
 	for (i = 0; i < host->rh_npaths; i++)
 		remap_path_free(host->rh_paths[i]);
 	free(host->rh_paths);
+	free(host->rh_regex_paths);
+	if (host->rh_prefixes)
+		raxFree(host->rh_prefixes);
 
-	if (host->rh_ctx)
-		TSSslContextDestroy((TSSslContext) host->rh_ctx);
+	remap_tls_free(host->rh_tls);
 
+	hash_free(host->rh_deps);
 	free(host);
 }
 
 /*
- * Search the list of paths in a remap_host for one that matches (by regexp) the
- * provided URL path, and return it.  If pfxs is non-NULL, the length of the
- * portion of the request path that was matched by the remap_path will be stored.
+ * Record that this host was built from the given object, so it will be
+ * rebuilt when the object changes.
+ */
+void
+remap_host_depend(remap_host_t *rh, const char *kind, const char *ns,
+		  const char *name)
+{
+char	key[512];
+
+	if (cluster_object_key(key, sizeof(key), kind, ns, name) == -1)
+		return;
+
+	if (rh->rh_deps == NULL && (rh->rh_deps = hash_new(7, NULL)) == NULL)
+		return;
+
+	hash_set(rh->rh_deps, key, HASH_PRESENT);
+}
+
+/*
+ * Find the path in a remap_host which matches the provided URL path, and
+ * return it.  If more than one path matches, the one which matches the longest
+ * prefix of the URL path is used; if there's a tie, a literal path wins over a
+ * regex path, and otherwise the path which was added first wins.  If nothing
+ * matches, the default path is returned.
+ *
+ * Literal paths are found with a single radix tree lookup, so the cost of a
+ * lookup depends on the length of the URL path and the number of regex paths,
+ * not the total number of paths.
+ *
+ * If pfxsz is non-NULL, the length of the portion of the request path that was
+ * matched by the remap_path will be stored.
  */
 remap_path_t *
 remap_host_find_path(const remap_host_t *rh, const char *path, size_t *pfxsz)
 {
+remap_path_t	*best = NULL;
+size_t		 bestlen = 0;
+
 	/* No path in the request, so this can only match the default path */
 	if (!path) {
 		if (pfxsz)
@@ -74,22 +119,42 @@ remap_host_find_path(const remap_host_t *rh, const char *path, size_t *pfxsz)
 		return rh->rh_paths[0];
 	}
 
-	/* skip 0, the default path */
-	for (size_t i = 1; i < rh->rh_npaths; i++) {
-	remap_path_t	*rp = rh->rh_paths[i];
+	if (rh->rh_prefixes) {
+	void	*rp;
+	size_t	 len;
+
+		rp = raxFindLongestPrefix(rh->rh_prefixes,
+					  (unsigned char *) path,
+					  strlen(path), &len);
+		if (rp != raxNotFound) {
+			best = rp;
+			bestlen = len;
+		}
+	}
+
+	for (size_t i = 0; i < rh->rh_nregex_paths; i++) {
+	remap_path_t	*rp = rh->rh_regex_paths[i];
 	regmatch_t	 matches[1];
+	size_t		 len;
 
-		if (regexec(&rp->rp_regex, path, 1, matches, 0) == 0) {
-			if (pfxsz)
-				*pfxsz = matches[0].rm_eo - matches[0].rm_so;
-			return rp;
+		if (regexec(&rp->rp_regex, path, 1, matches, 0) != 0)
+			continue;
+
+		len = matches[0].rm_eo - matches[0].rm_so;
+		if (best == NULL || len > bestlen) {
+			best = rp;
+			bestlen = len;
 		}
 	}
 
-	if (pfxsz)
-		*pfxsz = 0;
+	if (best == NULL) {
+		best = rh->rh_paths[0];
+		bestlen = 0;
+	}
 
-	return rh->rh_paths[0];
+	if (pfxsz)
+		*pfxsz = bestlen;
+	return best;
 }
 
 remap_path_t *
@@ -105,6 +170,27 @@ remap_path_t	*rp;
 	rh->rh_paths[rh->rh_npaths] = rp;
 	++rh->rh_npaths;
 
+	/* The default path is never matched by remap_host_find_path */
+	if (!path)
+		return rp;
+
+	if (rp->rp_prefix) {
+	unsigned char	*key = (unsigned char *) rp->rp_prefix;
+	size_t		 keylen = strlen(rp->rp_prefix);
+
+		if (!rh->rh_prefixes)
+			rh->rh_prefixes = raxNew();
+
+		/* If the same path appears twice, the first one wins */
+		if (raxFind(rh->rh_prefixes, key, keylen) == raxNotFound)
+			raxInsert(rh->rh_prefixes, key, keylen, rp, NULL);
+	} else {
+		rh->rh_regex_paths = realloc(rh->rh_regex_paths,
+				sizeof(remap_path_t *) * (rh->rh_nregex_paths + 1));
+		rh->rh_regex_paths[rh->rh_nregex_paths] = rp;
+		++rh->rh_nregex_paths;
+	}
+
 	return rp;
 }
 
@@ -171,7 +257,7 @@ secret_t	*srt;
 	if ((crt = cluster_get_cert_for_hostname(cs, host)) == NULL)
 		return;
 
-	if ((ns = cluster_get_namespace(cs, crt->cr_namespace)) == NULL) {
+	if ((ns = cluster_find_namespace(cs, crt->cr_namespace)) == NULL) {
 		TSError("kubernetes: warning: default tls certificate %s/%s"
 			" was not found on the cluster", crt->cr_namespace,
 			crt->cr_name);
@@ -185,7 +271,8 @@ secret_t	*srt;
 		return;
 	}
 
-	if ((rh->rh_ctx = secret_make_ssl_ctx(srt)) == NULL) {
+	remap_tls_free(rh->rh_tls);
+	if ((rh->rh_tls = remap_tls_get(srt)) == NULL) {
 		TSError("kubernetes: warning: default tls certificate %s/%s"
 			" is invalid", crt->cr_namespace, crt->cr_name);
 		return;
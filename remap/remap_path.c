@@ -18,15 +18,28 @@
 #include	<netinet/in.h>
 #include	<arpa/inet.h>
 
+#include	<stdlib.h>
 #include	<string.h>
 #include	<errno.h>
+#include	<time.h>
+#include	<ctype.h>
+#include	<pthread.h>
 
 #include	<ts/ts.h>
 
 #include	"remap.h"
-#include	"base64.h"
 
-static void remap_path_add_users(remap_path_t *, secret_t *);
+static void remap_path_set_hash_by(remap_path_t *, const char *);
+
+/*
+ * Return 1 if the path contains no regex metacharacters, i.e. it can be
+ * matched as a literal prefix.
+ */
+static int
+is_literal_path(const char *path)
+{
+	return path[strcspn(path, ".[]()*+?{}|^$\\")] == '\0';
+}
 
 static int
 truefalse(const char *str)
@@ -36,6 +49,48 @@ truefalse(const char *str)
 	return 0;
 }
 
+/*
+ * The default CORS origins and compressible types.  These are the same for
+ * every path without the corresponding annotation, so they're built once and
+ * shared rather than copied into each path.
+ */
+static hash_t		default_cors_origins;
+static hash_t		default_compress_types;
+static pthread_once_t	defaults_once = PTHREAD_ONCE_INIT;
+
+static void
+build_defaults(void)
+{
+	default_cors_origins = hash_new(1, NULL);
+	hash_set(default_cors_origins, "*", HASH_PRESENT);
+
+	/*
+	 * This list of types is from the nginx Ingress controller.  Note that
+	 * text/html is deliberately excluded to avoid the TLS BREACH attack.
+	 */
+	default_compress_types = hash_new(127, NULL);
+	hash_set(default_compress_types, "application/atom+xml", HASH_PRESENT);
+	hash_set(default_compress_types, "application/javascript",
+		 HASH_PRESENT);
+	hash_set(default_compress_types, "aplication/x-javascript",
+		 HASH_PRESENT);
+	hash_set(default_compress_types, "application/json", HASH_PRESENT);
+	hash_set(default_compress_types, "application/rss+xml", HASH_PRESENT);
+	hash_set(default_compress_types, "application/vnd.ms-fontobject",
+		 HASH_PRESENT);
+	hash_set(default_compress_types, "application/x-font-ttf",
+		 HASH_PRESENT);
+	hash_set(default_compress_types, "application/x-web-app-manifest+json",
+		 HASH_PRESENT);
+	hash_set(default_compress_types, "application/xml", HASH_PRESENT);
+	hash_set(default_compress_types, "font/opentype", HASH_PRESENT);
+	hash_set(default_compress_types, "image/svg+xml", HASH_PRESENT);
+	hash_set(default_compress_types, "image/x-icon", HASH_PRESENT);
+	hash_set(default_compress_types, "text/css", HASH_PRESENT);
+	hash_set(default_compress_types, "text/plain", HASH_PRESENT);
+	hash_set(default_compress_types, "text/x-component", HASH_PRESENT);
+}
+
 /*
  * remap_path: an individual path inside a remap_host
  */
@@ -44,49 +99,30 @@ remap_path_t *
 remap_path_new(const char *path)
 {
 remap_path_t	*ret;
+arena_t		 arena;
 char		*pregex;
 int		 rerr;
 
-	if ((ret = calloc(1, sizeof(*ret))) == NULL)
+	arena_init(&arena, NULL, 0);
+	if ((ret = arena_calloc(&arena, 1, sizeof(*ret))) == NULL) {
+		arena_reset(&arena);
 		return NULL;
+	}
+	ret->rp_arena = arena;
+
+	pthread_once(&defaults_once, build_defaults);
 
 	ret->rp_preserve_host = 1;
 	ret->rp_server_push = 1;
-	ret->rp_cors_origins = hash_new(127, NULL);
-	hash_set(ret->rp_cors_origins, "*", HASH_PRESENT);
+	ret->rp_cors_origins = default_cors_origins;
+	ret->rp_cors_any_origin = 1;
 
 	/* Cache by default */
 	ret->rp_cache = 1;
-	ret->rp_ignore_cookies = hash_new(127, NULL);
 
 	/* Enable compresstion by default */
 	ret->rp_compress = 1;
-	ret->rp_compress_types = hash_new(127, NULL);
-
-	/*
-	 * This list of types is from the nginx Ingress controller.  Note that
-	 * text/html is deliberately excluded to avoid the TLS BREACH attack.
-	 */
-	hash_set(ret->rp_compress_types, "application/atom+xml", HASH_PRESENT);
-	hash_set(ret->rp_compress_types, "application/javascript",
-		 HASH_PRESENT);
-	hash_set(ret->rp_compress_types, "aplication/x-javascript",
-		 HASH_PRESENT);
-	hash_set(ret->rp_compress_types, "application/json", HASH_PRESENT);
-	hash_set(ret->rp_compress_types, "application/rss+xml", HASH_PRESENT);
-	hash_set(ret->rp_compress_types, "application/vnd.ms-fontobject",
-		 HASH_PRESENT);
-	hash_set(ret->rp_compress_types, "application/x-font-ttf",
-		 HASH_PRESENT);
-	hash_set(ret->rp_compress_types, "application/x-web-app-manifest+json",
-		 HASH_PRESENT);
-	hash_set(ret->rp_compress_types, "application/xml", HASH_PRESENT);
-	hash_set(ret->rp_compress_types, "font/opentype", HASH_PRESENT);
-	hash_set(ret->rp_compress_types, "image/svg+xml", HASH_PRESENT);
-	hash_set(ret->rp_compress_types, "image/x-icon", HASH_PRESENT);
-	hash_set(ret->rp_compress_types, "text/css", HASH_PRESENT);
-	hash_set(ret->rp_compress_types, "text/plain", HASH_PRESENT);
-	hash_set(ret->rp_compress_types, "text/x-component", HASH_PRESENT);
+	ret->rp_compress_types = default_compress_types;
 
 	if (!path)
 		return ret;
@@ -102,8 +138,20 @@ int		 rerr;
 	* request path later to match against, the leading '/' is stripped.  Strip
 	* it here as well to make matching the request easier, then prepend a ^
 	* to anchor the path.
+	*
+	* Most paths are plain strings, which remap_host matches by prefix
+	* without using a regex at all.
 	*/
 
+	if (is_literal_path(path + 1)) {
+		if ((ret->rp_prefix = arena_strdup(&ret->rp_arena,
+						   path + 1)) == NULL) {
+			remap_path_free(ret);
+			return NULL;
+		}
+		return ret;
+	}
+
 	if ((pregex = strdup(path)) == NULL) {
 		remap_path_free(ret);
 		return NULL;
@@ -125,371 +173,1240 @@ int		 rerr;
 void
 remap_path_free(remap_path_t *rp)
 {
-size_t			 i;
-struct remap_auth_addr	*rip, *nrip;
-
-	for (i = 0; i < rp->rp_naddrs; i++)
-		free(rp->rp_addrs[i].rt_host);
-	free(rp->rp_addrs);
-
-	free(rp->rp_app_root);
-	free(rp->rp_rewrite_target);
-	free(rp->rp_auth_realm);
-	free(rp->rp_cors_headers);
-	free(rp->rp_cors_methods);
-	hash_free(rp->rp_users);
-	hash_free(rp->rp_whitelist_params);
-	hash_free(rp->rp_ignore_params);
-	hash_free(rp->rp_cors_origins);
-	hash_free(rp->rp_compress_types);
-	hash_free(rp->rp_ignore_cookies);
-	hash_free(rp->rp_whitelist_cookies);
-	regfree(&rp->rp_regex);
-
-	for (rip = rp->rp_auth_addr_list; rip; rip = nrip) {
-		nrip = rip->ra_next;
-		free(rip);
-	}
+arena_t	arena;
+size_t	i;
+
+	for (i = 0; i < rp->rp_nannotations; i++)
+		remap_annotations_free(rp->rp_annotations[i]);
+
+	if (rp->rp_backends)
+		remap_backend_slot_free(rp->rp_backends);
+
+	if (!rp->rp_prefix)
+		regfree(&rp->rp_regex);
+
+	/* rp is in its own arena, so copy the arena out before freeing it */
+	arena = rp->rp_arena;
+	arena_reset(&arena);
+}
+
+/*
+ * remap_backends: a set of targets.
+ */
+
+remap_backends_t *
+remap_backends_new(void)
+{
+remap_backends_t	*ret;
+arena_t			 arena;
 
-	free(rp);
+	arena_init(&arena, NULL, 0);
+	if ((ret = arena_calloc(&arena, 1, sizeof(*ret))) == NULL) {
+		arena_reset(&arena);
+		return NULL;
+	}
+	ret->rb_arena = arena;
+	return ret;
 }
 
 void
-remap_path_add_address(remap_path_t *rp, const char *host, int port)
+remap_backends_free(remap_backends_t *rb)
 {
-	rp->rp_addrs = realloc(rp->rp_addrs,
-			       sizeof(remap_target_t) *
-				(rp->rp_naddrs + 1));
-	rp->rp_addrs[rp->rp_naddrs].rt_host = strdup(host);
-	rp->rp_addrs[rp->rp_naddrs].rt_port = port;
-	++rp->rp_naddrs;
+arena_t	arena;
+size_t	i;
+
+	if (rb == NULL)
+		return;
+
+	for (i = 0; i < rb->rb_naddrs; i++)
+		remap_target_stats_free(rb->rb_addrs[i].rt_stats);
+
+	/* rb is in its own arena, so copy the arena out before freeing it */
+	arena = rb->rb_arena;
+	arena_reset(&arena);
 }
 
 /*
- * Convert a string containing whitespace-separated IP addresses into a
- * remap_auth_addr list.
+ * Each target's statistics have a whole cache line, allocated separately from
+ * the set.  They're refcounted so that a target which is in both the old and
+ * new sets when its backends are replaced can share them (see
+ * slot_carry_stats()); then requests in flight to the old set finish on the
+ * same counters that requests to the new set start on.  Only the builder
+ * changes the reference count.
  */
-struct remap_auth_addr *
-remap_path_get_addresses(const char *str)
+static remap_target_stats_t *
+target_stats_new(void)
 {
-struct remap_auth_addr	*list = NULL;
-char			*mstr, *save, *saddr;
+remap_target_stats_t	*rs;
 
-	if ((mstr = strdup(str)) == NULL)
+	if (posix_memalign((void **) &rs, REMAP_TARGET_STATS_ALIGN,
+			   REMAP_TARGET_STATS_ALIGN) != 0)
 		return NULL;
 
-	for (saddr = strtok_r(mstr, ",", &save); saddr != NULL;
-	     saddr = strtok_r(NULL, ",", &save)) {
-	struct remap_auth_addr	*entry;
-	char			*p = NULL;
+	memset(rs, 0, sizeof(*rs));
+	rs->rs_refs = 1;
+	return rs;
+}
 
-		entry = calloc(1, sizeof(*entry));
-		if ((p = strchr(saddr, '/')) != NULL) {
-			*p++ = '\0';
-			entry->ra_prefix_length = atoi(p);
-		}
+void
+remap_target_stats_ref(remap_target_stats_t *rs)
+{
+	__atomic_add_fetch(&rs->rs_refs, 1, __ATOMIC_RELAXED);
+}
 
-		if (inet_pton(AF_INET6, saddr,
-			      entry->ra_addr_v6.s6_addr) == 1) {
-			entry->ra_family = AF_INET6;
-			if (p == NULL)
-				entry->ra_prefix_length = 128;
-		} else if (inet_pton(AF_INET, saddr, &entry->ra_addr_v4) == 1) {
-			entry->ra_family = AF_INET;
-			if (p == NULL)
-				entry->ra_prefix_length = 32;
-		} else {
-			free(entry);
-			continue;
-		}
+void
+remap_target_stats_free(remap_target_stats_t *rs)
+{
+	if (rs && __atomic_sub_fetch(&rs->rs_refs, 1, __ATOMIC_ACQ_REL) == 0)
+		free(rs);
+}
+
+remap_target_t *
+remap_backends_add_address(remap_backends_t *rb, const char *host, int port)
+{
+remap_target_t		*rt, *addrs;
+struct sockaddr_in	*sin;
+struct sockaddr_in6	*sin6;
+size_t			 size;
+
+	/*
+	 * Grow the array by doubling it.  The old array stays in the arena,
+	 * but that's at most as much again as the final array.
+	 */
+	if (rb->rb_naddrs == rb->rb_addrs_size) {
+		size = rb->rb_addrs_size ? rb->rb_addrs_size * 2 : 4;
+		if ((addrs = arena_calloc(&rb->rb_arena, size,
+					  sizeof(*addrs))) == NULL)
+			return NULL;
+		if (rb->rb_naddrs)
+			memcpy(addrs, rb->rb_addrs,
+			       sizeof(*addrs) * rb->rb_naddrs);
+		rb->rb_addrs = addrs;
+		rb->rb_addrs_size = size;
+	}
+
+	rt = &rb->rb_addrs[rb->rb_naddrs];
+	memset(rt, 0, sizeof(*rt));
+	rt->rt_host = arena_strdup(&rb->rb_arena, host);
+	rt->rt_port = port;
+	rt->rt_locality = REMAP_LOCAL_REMOTE;
 
-		entry->ra_next = list;
-		list = entry;
+	rt->rt_stats = target_stats_new();
+
+	/*
+	 * Endpoint addresses are IP addresses, so parse them once here rather
+	 * than on every request.  An ExternalName is left to be resolved when
+	 * it's used.
+	 */
+	sin = (struct sockaddr_in *) &rt->rt_addr;
+	sin6 = (struct sockaddr_in6 *) &rt->rt_addr;
+
+	if (inet_pton(AF_INET, host, &sin->sin_addr) == 1) {
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons(port);
+		rt->rt_addrlen = sizeof(*sin);
+	} else if (inet_pton(AF_INET6, host, &sin6->sin6_addr) == 1) {
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = htons(port);
+		rt->rt_addrlen = sizeof(*sin6);
 	}
 
-	free(mstr);
-	return list;
+	++rb->rb_naddrs;
+	return rt;
 }
 
 /*
- * Configure a remap_path from the given Ingress annotations.
+ * Record where a target, one of rb's, is running.  node and zone may be NULL
+ * if they're not known.
  */
 void
-remap_path_annotate(namespace_t *ns, cluster_t *cs,
-		    remap_path_t *rp, hash_t annotations)
+remap_target_set_node(remap_backends_t *rb, remap_target_t *rt,
+		      const char *node, const char *zone, unsigned locality)
 {
-const char	*key_ = NULL, *value = NULL;
-size_t		 keylen;
+	rt->rt_node = node ? arena_strdup(&rb->rb_arena, node) : NULL;
+	rt->rt_zone = zone ? arena_strdup(&rb->rb_arena, zone) : NULL;
+	rt->rt_locality = locality;
+}
+
+void
+remap_path_add_address(remap_path_t *rp, const char *host, int port)
+{
+	if (rp->rp_backends == NULL &&
+	    (rp->rp_backends = remap_backend_slot_new()) == NULL)
+		return;
 
 	/*
-	 * There are two ways we could do this: use hash_get for each annotation
-	 * we support, or iterate over all annotations and compare them.  We use
-	 * the second method, because assuming we understand all (or most of)
-	 * the annotations on the Ingress, which should be the same, it saves
-	 * running a complete hash lookup for every string.
-	 *
-	 * This is probably not true any more (many more annotations have been
-	 * added), and this code should be refactored.
+	 * A private slot is never shared with requests while the path is
+	 * being built, so its backends can be changed in place; a shared
+	 * slot's can't.
 	 */
+	if (rp->rp_backends->bs_key != NULL)
+		return;
 
-	hash_foreach(annotations, &key_, &keylen, &value) {
-	char	*key = strndup(key_, keylen);
+	if (rp->rp_backends->bs_backends == NULL &&
+	    (rp->rp_backends->bs_backends = remap_backends_new()) == NULL)
+		return;
 
-		TSDebug("kubernetes", "[%s] = [%s]", key, value);
+	remap_backends_add_address(rp->rp_backends->bs_backends, host, port);
+}
 
+/*
+ * Keep a reference to rn, which configured rp.  The array of references is
+ * allocated from rp's arena and grows by doubling.
+ */
+static void
+remap_path_hold(remap_path_t *rp, remap_annotations_t *rn)
+{
+remap_annotations_t	**refs;
+size_t			  n = rp->rp_nannotations;
+
+	if (n == 0 || (n & (n - 1)) == 0) {
+		if ((refs = arena_alloc(&rp->rp_arena,
+					sizeof(*refs) * (n ? n * 2 : 1)))
+		    == NULL)
+			return;
+		if (n)
+			memcpy(refs, rp->rp_annotations, sizeof(*refs) * n);
+		rp->rp_annotations = refs;
+	}
+
+	remap_annotations_ref(rn);
+	rp->rp_annotations[rp->rp_nannotations++] = rn;
+}
+
+/*
+ * Configure a remap_path from an Ingress's parsed annotations.  Strings and
+ * parsed values point into rn, which the path keeps a reference to.
+ */
+void
+remap_path_annotate(remap_path_t *rp, remap_annotations_t *rn)
+{
+size_t	i;
+
+	remap_path_hold(rp, rn);
+
+	for (i = 0; i < rn->rn_nitems; i++) {
+	remap_annotation_t	*an = &rn->rn_items[i];
+	char			*value = an->an_value;
+
+		switch (an->an_id) {
 		/* cache-enable: turn caching on or off */
-		if (strcmp(key, IN_CACHE_ENABLE) == 0)
+		case REMAP_ANN_CACHE_ENABLE:
 			rp->rp_cache = truefalse(value);
+			break;
 
 		/* cache-generation: set the TS cache generation id */
-		else if (strcmp(key, IN_CACHE_GENERATION) == 0)
+		case REMAP_ANN_CACHE_GENERATION:
 			rp->rp_cache_gen = atoi(value);
+			break;
 
 		/* cache-ignore-params: query parameters to ignore for cache */
-		else if (strcmp(key, IN_CACHE_IGNORE_PARAMS) == 0) {
-		char	*v = strdup(value);
-		char	*r = NULL, *sr;
-
-			hash_free(rp->rp_ignore_params);
-			rp->rp_ignore_params = hash_new(127, NULL);
-
-			for (r = strtok_r(v, " \t", &sr); r;
-			     r = strtok_r(NULL, " \t", &sr))
-				hash_set(rp->rp_ignore_params, r, HASH_PRESENT);
-
-			free(v);
-		}
+		case REMAP_ANN_CACHE_IGNORE_PARAMS:
+			rp->rp_ignore_params = an->an_data;
+			break;
 
 		/* cache-whitelist-params: query parameters whitelist for cache */
-		else if (strcmp(key, IN_CACHE_WHITELIST_PARAMS) == 0) {
-		char	*v = strdup(value);
-		char	*r, *sr = NULL;
-
-			hash_free(rp->rp_whitelist_params);
-			rp->rp_whitelist_params = hash_new(127, NULL);
-
-			for (r = strtok_r(v, " \t", &sr); r;
-			     r = strtok_r(NULL, " \t", &sr))
-				hash_set(rp->rp_whitelist_params, r, HASH_PRESENT);
-
-			free(v);
-		}
+		case REMAP_ANN_CACHE_WHITELIST_PARAMS:
+			rp->rp_whitelist_params = an->an_data;
+			break;
 
 		/* cache-ignore-cookies: cookie names to remove from the request */
-		else if (strcmp(key, IN_CACHE_IGNORE_COOKIES) == 0) {
-		char	*v = strdup(value);
-		char	*r, *sr = NULL;
-
-			hash_free(rp->rp_ignore_cookies);
-			rp->rp_ignore_cookies = hash_new(127, NULL);
-
-			for (r = strtok_r(v, " \t", &sr); r;
-			     r = strtok_r(NULL, " \t", &sr))
-				hash_set(rp->rp_ignore_cookies, r, HASH_PRESENT);
-
-			free(v);
-		}
+		case REMAP_ANN_CACHE_IGNORE_COOKIES:
+			rp->rp_ignore_cookies = an->an_data;
+			break;
 
 		/* cache-whitelist-cookies: cookie names to whitelist in request */
-		else if (strcmp(key, IN_CACHE_WHITELIST_COOKIES) == 0) {
-		char	*v = strdup(value);
-		char	*r, *sr = NULL;
-
-			hash_free(rp->rp_whitelist_cookies);
-			rp->rp_whitelist_cookies = hash_new(127, NULL);
-
-			for (r = strtok_r(v, " \t", &sr); r;
-			     r = strtok_r(NULL, " \t", &sr))
-				hash_set(rp->rp_whitelist_cookies, r, HASH_PRESENT);
-
-			free(v);
-		}
+		case REMAP_ANN_CACHE_WHITELIST_COOKIES:
+			rp->rp_whitelist_cookies = an->an_data;
+			break;
 
 		/* compress-types: set types to compress */
-		else if (strcmp(key, IN_COMPRESS_TYPES) == 0) {
-		char	*v = strdup(value);
-		char	*r, *sr = NULL;
-
-			hash_free(rp->rp_compress_types);
-			rp->rp_compress_types = hash_new(127, NULL);
-
-			for (r = strtok_r(v, " \t", &sr); r;
-			     r = strtok_r(NULL, " \t", &sr))
-				hash_set(rp->rp_compress_types, r, HASH_PRESENT);
-
-			free(v);
-		}
+		case REMAP_ANN_COMPRESS_TYPES:
+			if (an->an_data)
+				rp->rp_compress_types = an->an_data;
+			break;
 
-		else if (strcmp(key, IN_COMPRESS_ENABLE) == 0)
+		case REMAP_ANN_COMPRESS_ENABLE:
 			rp->rp_compress = truefalse(value);
+			break;
 
 		/* follow-redirects: if set, TS will resolve 3xx responses itself */
-		else if (strcmp(key, IN_FOLLOW_REDIRECTS) == 0)
+		case REMAP_ANN_FOLLOW_REDIRECTS:
 			rp->rp_follow_redirects = truefalse(value);
+			break;
 
 		/* server-push: enable/disable http/2 server push processing */
-		else if (strcmp(key, IN_SERVER_PUSH) == 0)
+		case REMAP_ANN_SERVER_PUSH:
 			rp->rp_server_push = truefalse(value);
+			break;
 
 		/* secure-backends: use TLS for backend connections */
-		else if (strcmp(key, IN_SECURE_BACKENDS) == 0)
+		case REMAP_ANN_SECURE_BACKENDS:
 			rp->rp_secure_backends = truefalse(value);
+			break;
 
 		/* debug-log: log request/response */
-		else if (strcmp(key, IN_DEBUG_LOG) == 0)
+		case REMAP_ANN_DEBUG_LOG:
 			rp->rp_debug_log = truefalse(value);
+			break;
 
 		/* ssl-redirect: if false, disable http->https redirect */
-		else if (strcmp(key, IN_SSL_REDIRECT) == 0) {
+		case REMAP_ANN_SSL_REDIRECT:
 			rp->rp_no_ssl_redirect = truefalse(value) ? 0 : 1;
 			TSDebug("kubernetes", "rp_no_ssl_redirect=%d",
 				rp->rp_no_ssl_redirect);
-		}
+			break;
 
 		/*
 		 * force-ssl-redirect: redirect http->https even if the
 		 * Ingress doesn't have TLS configured.
 		 */
-		else if (strcmp(key, IN_FORCE_SSL_REDIRECT) == 0)
+		case REMAP_ANN_FORCE_SSL_REDIRECT:
 			rp->rp_force_ssl_redirect = truefalse(value);
+			break;
 
 		/* preserve-host: use origin request host header */
-		else if (strcmp(key, IN_PRESERVE_HOST) == 0)
+		case REMAP_ANN_PRESERVE_HOST:
 			rp->rp_preserve_host = truefalse(value);
+			break;
 
 		/* app-root: enforce url prefix */
-		else if (strcmp(key, IN_APP_ROOT) == 0)
-			rp->rp_app_root = strdup(value);
+		case REMAP_ANN_APP_ROOT:
+			rp->rp_app_root = value;
+			break;
 
 		/* rewrite-target: rewrite URL path */
-		else if (strcmp(key, IN_REWRITE_TARGET) == 0 && *value == '/')
-			rp->rp_rewrite_target = strdup(value + 1);
+		case REMAP_ANN_REWRITE_TARGET:
+			if (*value == '/')
+				rp->rp_rewrite_target = value + 1;
+			break;
 
 		/* read-respone-timeout: first byte timeout */
-		else if (strcmp(key, IN_READ_RESPONSE_TIMEOUT) == 0)
+		case REMAP_ANN_READ_RESPONSE_TIMEOUT:
 			rp->rp_read_timeout = atoi(value);
+			break;
 
 		/*
 		 * CORS; either enable-cors can be specified, or a more
 		 * specific configuration.
 		*/
-		else if (strcmp(key, IN_ENABLE_CORS) == 0)
+		case REMAP_ANN_ENABLE_CORS:
 			rp->rp_enable_cors = truefalse(value);
+			break;
 
-		else if (strcmp(key, IN_CORS_ORIGINS) == 0) {
-		char	*p, *q, *r;
-
-			hash_free(rp->rp_cors_origins);
-			rp->rp_cors_origins = hash_new(1, NULL);
-
-			q = strdup(value);
-			for (p = strtok_r(q, " \t\r\n", &r);
-			     p; p = strtok_r(NULL, " \t\r\n", &r))
-				hash_set(rp->rp_cors_origins, p, HASH_PRESENT);
-			free(q);
+		case REMAP_ANN_CORS_ORIGINS:
+			if (an->an_data)
+				rp->rp_cors_origins = an->an_data;
 			rp->rp_enable_cors = 1;
-		}
+			break;
 
-		else if (strcmp(key, IN_CORS_MAX_AGE) == 0)
+		case REMAP_ANN_CORS_MAX_AGE:
 			rp->rp_cors_max_age = atoi(value);
-		else if (strcmp(key, IN_CORS_HEADERS) == 0)
-			rp->rp_cors_headers = strdup(value);
-		else if (strcmp(key, IN_CORS_METHODS) == 0)
-			rp->rp_cors_methods = strdup(value);
-		else if (strcmp(key, IN_CORS_CREDENTIALS) == 0)
+			break;
+
+		case REMAP_ANN_CORS_HEADERS:
+			rp->rp_cors_headers = value;
+			break;
+
+		case REMAP_ANN_CORS_METHODS:
+			rp->rp_cors_methods = value;
+			break;
+
+		case REMAP_ANN_CORS_CREDENTIALS:
 			rp->rp_cors_creds = truefalse(value);
+			break;
 
 		/*
 		 * Authentication.
 		 */
 
 		/* authentication type (basic/digest) */
-		else if (strcmp(key, IN_AUTH_TYPE) == 0) {
+		case REMAP_ANN_AUTH_TYPE:
 			if (strcmp(value, IN_AUTH_TYPE_BASIC) == 0)
 				rp->rp_auth_type = REMAP_AUTH_BASIC;
 			else if (strcmp(value, IN_AUTH_TYPE_DIGEST) == 0)
 				rp->rp_auth_type = REMAP_AUTH_DIGEST;
-		}
+			break;
 
 		/* authentication realm */
-		else if (strcmp(key, IN_AUTH_REALM) == 0)
-			rp->rp_auth_realm = strdup(value);
+		case REMAP_ANN_AUTH_REALM:
+			rp->rp_auth_realm = value;
+			break;
 
 		/* authentication user database */
-		else if (strcmp(key, IN_AUTH_SECRET) == 0) {
-		secret_t	*se;
-			if ((se = namespace_get_secret(ns, value)) != NULL) {
-				rp->rp_users = hash_new(127, free);
-				remap_path_add_users(rp, se);
-			}
-		}
+		case REMAP_ANN_AUTH_SECRET:
+			if (an->an_data)
+				rp->rp_users = an->an_data;
+			break;
 
 		/* authentication satisfy requirement (any, all) */
-		else if (strcmp(key, IN_AUTH_SATISFY) == 0) {
+		case REMAP_ANN_AUTH_SATISFY:
 			if (strcmp(value, IN_AUTH_SATISFY_ANY) == 0)
 				rp->rp_auth_satisfy = REMAP_SATISFY_ANY;
 			else
 				rp->rp_auth_satisfy = REMAP_SATISFY_ALL;
+			break;
+
+		case REMAP_ANN_WHITELIST_SOURCE_RANGE:
+			rp->rp_auth_addr_list = an->an_data;
+			break;
+
+		/* load-balance: how to pick a backend for each request */
+		case REMAP_ANN_LOAD_BALANCE:
+			if (strcmp(value, IN_LOAD_BALANCE_LEAST_REQUEST) == 0)
+				rp->rp_lb = REMAP_LB_LEAST_REQUEST;
+			else if (strcmp(value, IN_LOAD_BALANCE_EWMA) == 0)
+				rp->rp_lb = REMAP_LB_EWMA;
+			else if (strcmp(value, IN_LOAD_BALANCE_HASH) == 0)
+				rp->rp_lb = REMAP_LB_HASH;
+			else
+				rp->rp_lb = REMAP_LB_RANDOM;
+			break;
+
+		/* hash-by: consistent hash key for load-balance: hash */
+		case REMAP_ANN_HASH_BY:
+			remap_path_set_hash_by(rp, value);
+			break;
+
+		/* topology-aware-routing: prefer targets on our node or zone */
+		case REMAP_ANN_TOPOLOGY_AWARE_ROUTING:
+			rp->rp_topology = truefalse(value);
+			break;
+
+		/* slow-start-window: ramp up traffic to new targets */
+		case REMAP_ANN_SLOW_START_WINDOW:
+			rp->rp_slow_start = atoi(value);
+			if (rp->rp_slow_start < 0)
+				rp->rp_slow_start = 0;
+			break;
+
+		/* slow-start-curve: linear or exponential */
+		case REMAP_ANN_SLOW_START_CURVE:
+			rp->rp_slow_start_exp =
+				(strcmp(value, IN_SLOW_START_CURVE_EXPONENTIAL)
+				 == 0);
+			break;
+
+		/* service-upstream: send requests to the Service's ClusterIP */
+		case REMAP_ANN_SERVICE_UPSTREAM:
+			rp->rp_service_upstream = truefalse(value);
+			break;
 		}
+	}
+
+	remap_path_build_headers(rp);
+}
+
+/*
+ * Build the response header lists for a path from its configuration.  This is
+ * done once when the path is annotated, so remap_run() can return these lists
+ * without allocating or formatting anything per request.
+ */
+void
+remap_path_build_headers(remap_path_t *rp)
+{
+arena_t		*ar = &rp->rp_arena;
+remap_header_t	*preflight = NULL;
+char		*s;
+size_t		 len;
+
+	rp->rp_hdr_app_root = rp->rp_hdr_wwwauth = NULL;
+	rp->rp_hdr_cors = rp->rp_hdr_cors_preflight = NULL;
+
+	/* app-root redirect */
+	if (rp->rp_app_root)
+		rp->rp_hdr_app_root = remap_header_new(ar, "Location",
+						       rp->rp_app_root, NULL);
+
+	/* authentication */
+	if (rp->rp_auth_type != REMAP_AUTH_NONE) {
+	const char	*realm = rp->rp_auth_realm ? rp->rp_auth_realm : "";
+
+		len = sizeof("Basic realm=\"\"") + strlen(realm);
+		if ((s = arena_alloc(ar, len)) != NULL) {
+			snprintf(s, len, "Basic realm=\"%s\"", realm);
+			rp->rp_hdr_wwwauth = remap_header_new(ar,
+					"WWW-Authenticate", s, NULL);
+		}
+	}
+
+	/* CORS */
+	rp->rp_cors_any_origin =
+		(hash_get(rp->rp_cors_origins, "*") == HASH_PRESENT);
+
+	if (!rp->rp_enable_cors)
+		return;
+
+	/*
+	 * Headers sent only in response to a preflight request.  The list is
+	 * built backwards, so the fields end up in the usual order.
+	 */
+	if (rp->rp_cors_creds)
+		preflight = remap_header_new(ar,
+				"Access-Control-Allow-Credentials", "true",
+				preflight);
+
+	if (rp->rp_cors_max_age) {
+	char	age[32];
+		snprintf(age, sizeof(age), "%d", rp->rp_cors_max_age);
+		preflight = remap_header_new(ar, "Access-Control-Max-Age", age,
+					     preflight);
+	}
+
+	if (rp->rp_cors_headers)
+		preflight = remap_header_new(ar,
+				"Access-Control-Allow-Headers",
+				rp->rp_cors_headers, preflight);
+
+	if (rp->rp_cors_methods)
+		preflight = remap_header_new(ar,
+				"Access-Control-Allow-Methods",
+				rp->rp_cors_methods, preflight);
+
+	/*
+	 * If any origin is permitted, the response is the same for every
+	 * origin.  Otherwise, the request's Origin is echoed back (this is
+	 * added per request) and the response must Vary by origin.
+	 */
+	if (rp->rp_cors_any_origin) {
+		rp->rp_hdr_cors = remap_header_new(ar,
+				"Access-Control-Allow-Origin", "*", NULL);
+		rp->rp_hdr_cors_preflight = remap_header_new(ar,
+				"Access-Control-Allow-Origin", "*", preflight);
+	} else {
+		rp->rp_hdr_cors = remap_header_new(ar, "Vary", "Origin", NULL);
+		rp->rp_hdr_cors_preflight = remap_header_new(ar, "Vary",
+							     "Origin",
+							     preflight);
+	}
+}
+
+/*
+ * Return 1 if the cookie (a "name=value" pair) should be removed.  Cookies
+ * without a value are always kept.
+ */
+static int
+ignore_cookie(const remap_path_t *rp, const char *cookie, size_t len)
+{
+const char	*eq;
+
+	if ((eq = memchr(cookie, '=', len)) == NULL)
+		return 0;
+
+	/* First, check whether it's explicitly ignored */
+	if (rp->rp_ignore_cookies &&
+	    patset_match(rp->rp_ignore_cookies, cookie, eq - cookie))
+		return 1;
+
+	/* If not, see whether there's a whitelist */
+	if (rp->rp_whitelist_cookies &&
+	    !patset_match(rp->rp_whitelist_cookies, cookie, eq - cookie))
+		return 1;
+
+	return 0;
+}
+
+size_t
+remap_path_filter_cookies(const remap_path_t *rp, char *s, size_t len)
+{
+size_t	r = 0, w = 0, start;
+
+	/*
+	 * Kept cookies are moved down over the removed ones.  The write
+	 * position can never pass the read position: each kept cookie is
+	 * preceded by at least one separator in the input, and we only write
+	 * a two-character separator if there's room for it.
+	 */
+	while (r < len) {
+		/* Skip separators */
+		while (r < len && (s[r] == ' ' || s[r] == ';'))
+			r++;
+		if (r == len)
+			break;
+
+		start = r;
+		while (r < len && s[r] != ' ' && s[r] != ';')
+			r++;
+
+		if (ignore_cookie(rp, s + start, r - start))
+			continue;
+
+		if (w) {
+			s[w++] = ';';
+			if (w < start)
+				s[w++] = ' ';
+		}
+
+		memmove(s + w, s + start, r - start);
+		w += r - start;
+	}
+
+	return w;
+}
+
+/*
+ * Create a new header, allocated from ar.  The name and value are copied into
+ * the same allocation as the header itself.
+ */
+remap_header_t *
+remap_header_new(arena_t *ar, const char *name, const char *value,
+		 remap_header_t *next)
+{
+remap_header_t	*ret;
+size_t		 nlen = strlen(name) + 1, vlen = strlen(value) + 1;
+char		*p;
+
+	if ((ret = arena_alloc(ar, sizeof(*ret) + nlen + vlen)) == NULL)
+		return next;
+
+	p = (char *) (ret + 1);
+	memcpy(p, name, nlen);
+	memcpy(p + nlen, value, vlen);
+
+	ret->hd_name = p;
+	ret->hd_value = p + nlen;
+	ret->hd_next = next;
+	return ret;
+}
 
-		else if (strcmp(key, IN_WHITELIST_SOURCE_RANGE) == 0)
-			rp->rp_auth_addr_list = remap_path_get_addresses(value);
+/*
+ * Per-thread random number generator (xorshift64*).  rand() takes a global
+ * lock in glibc, which every request would contend on; this doesn't need to
+ * be good randomness, just cheap and reasonably uniform.
+ */
+static __thread uint64_t rng_state;
 
-		free(key);
+static uint32_t
+rng_next(void)
+{
+uint64_t	x = rng_state;
+
+	if (x == 0) {
+		/* Seed each thread differently */
+		x = (uint64_t) time(NULL) ^ (uint64_t) (uintptr_t) &rng_state;
+		x ^= x >> 31;
+		x *= 0x9E3779B97F4A7C15ULL;
+		if (x == 0)
+			x = 1;
 	}
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	rng_state = x;
+	return (uint32_t) ((x * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+/*
+ * Return a random number in [0, n).
+ */
+static size_t
+rng_uniform(size_t n)
+{
+	return (size_t) (((uint64_t) rng_next() * n) >> 32);
+}
+
+/*
+ * The load on a target, used to compare two targets; lower is better.  This
+ * counts the request we're about to send, so an idle target's load isn't 0
+ * and can still be scaled by its slow start weight.  For EWMA, the in-flight
+ * count is weighted by the target's average response time, so a slow target
+ * with few requests doesn't keep winning.  A new target starts at the set's
+ * average (see slot_carry_stats()); until any target has a sample, they all
+ * count the same.
+ */
+static uint64_t
+target_load(const remap_path_t *rp, const remap_target_t *rt)
+{
+uint64_t	inflight, ewma;
+
+	if (rt->rt_stats == NULL)
+		return 1;
+
+	inflight = __atomic_load_n(&rt->rt_stats->rs_inflight,
+				   __ATOMIC_RELAXED);
+	if (rp->rp_lb != REMAP_LB_EWMA)
+		return inflight + 1;
+
+	ewma = __atomic_load_n(&rt->rt_stats->rs_ewma_us, __ATOMIC_RELAXED);
+	return (inflight + 1) * (ewma ? ewma : 1);
 }
 
 /*
- * Add users from a secret to a remap_path.
+ * Consistent hashing.  This uses Maglev hashing (Eisenbud et al., "Maglev: A
+ * Fast and Reliable Software Network Load Balancer", NSDI 2016): each target
+ * fills the slots of a lookup table in the order given by its own
+ * permutation of the table, taking turns, until the table is full.  Every
+ * target gets the same number of slots (give or take one), and when a target
+ * is added or removed, only about 1/N of the slots change owner.
+ *
+ * The permutations depend only on the targets' addresses, never on their
+ * order or on anything local to this process, so every TS instance builds the
+ * same table from the same Endpoints.
+ *
+ * The table size must be prime, and much larger than the number of targets
+ * for the distribution to be even.  It's the same for any number of targets:
+ * a target's permutation depends on the table size, so if the size changed
+ * with the number of targets, adding one target would move almost every key.
+ * 65537 is what the paper uses, and allows for any number of targets that a
+ * uint16_t slot can index.
+ */
+#define	LB_TABLE_SIZE	65537
+#define	LB_TABLE_EMPTY	((uint16_t) -1)
+
+/*
+ * 64-bit FNV-1a, with the seed mixed into the initial value and a final
+ * avalanche step (from MurmurHash3) so nearby inputs give unrelated hashes.
  */
+static uint64_t
+lb_hash(const void *data, size_t len, uint64_t seed)
+{
+const unsigned char	*p = data;
+uint64_t		 h = 0xcbf29ce484222325ULL ^ seed;
+
+	while (len--) {
+		h ^= *p++;
+		h *= 0x100000001b3ULL;
+	}
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static uint64_t
+lb_target_hash(const remap_target_t *rt, uint64_t seed)
+{
+uint64_t	h = lb_hash(rt->rt_host, strlen(rt->rt_host), seed);
+uint32_t	port = (uint32_t) rt->rt_port;
+
+	return lb_hash(&port, sizeof(port), h);
+}
+
+static int
+lb_target_cmp(const void *a, const void *b)
+{
+const remap_target_t	*ta = *(const remap_target_t *const *) a;
+const remap_target_t	*tb = *(const remap_target_t *const *) b;
+int			 r;
+
+	if ((r = strcmp(ta->rt_host, tb->rt_host)) != 0)
+		return r;
+	return ta->rt_port - tb->rt_port;
+}
+
 static void
-remap_path_add_users(remap_path_t *rp, secret_t *secret)
+lb_build_table(remap_backends_t *rb)
 {
-char	*authdata = NULL;
-char	*buf, *entry, *s;
-size_t	 dlen;
-ssize_t	 n;
+size_t		  m = LB_TABLE_SIZE, n = rb->rb_naddrs, filled = 0, i;
+remap_target_t	**order = NULL;
+uint16_t	 *table = NULL;
+uint64_t	 *offset = NULL, *skip = NULL, *next = NULL;
 
-	if ((authdata = hash_get(secret->se_data, "auth")) == NULL)
-		return;
+	rb->rb_lb_table = NULL;
+	rb->rb_lb_table_size = 0;
 
-	dlen = strlen(authdata);
-	s = buf = malloc(base64_decode_len(dlen) + 1);
-	n = base64_decode(authdata, dlen, (unsigned char *)buf);
+	if (n < 2)
+		return;
 
-	if (n == -1) {
-		free(buf);
+	if (n >= LB_TABLE_EMPTY) {
+		TSError("kubernetes: too many backends (%d) for consistent"
+			" hashing; using random load balancing", (int) n);
 		return;
 	}
 
-	buf[n] = '\0';
+	order = malloc(sizeof(*order) * n);
+	offset = malloc(sizeof(*offset) * n);
+	skip = malloc(sizeof(*skip) * n);
+	next = calloc(n, sizeof(*next));
+	table = arena_alloc(&rb->rb_arena, sizeof(*table) * m);
+
+	if (!order || !offset || !skip || !next || !table)
+		goto done;
+
+	/*
+	 * Fill the table in address order, not the order Kubernetes gave us
+	 * the targets, so the table doesn't depend on it.
+	 */
+	for (i = 0; i < n; i++) {
+		order[i] = &rb->rb_addrs[i];
+		offset[i] = lb_target_hash(&rb->rb_addrs[i], 0) % m;
+		skip[i] = lb_target_hash(&rb->rb_addrs[i], 1) % (m - 1) + 1;
+	}
+	qsort(order, n, sizeof(*order), lb_target_cmp);
+
+	memset(table, 0xff, sizeof(*table) * m);
+
+	for (;;) {
+		for (i = 0; i < n; i++) {
+		size_t		t = order[i] - rb->rb_addrs;
+		uint64_t	c;
+
+			do {
+				c = (offset[t] + next[t] * skip[t]) % m;
+				next[t]++;
+			} while (table[c] != LB_TABLE_EMPTY);
+
+			table[c] = (uint16_t) t;
+			if (++filled == m)
+				goto full;
+		}
+	}
+
+full:
+	rb->rb_lb_table = table;
+	rb->rb_lb_table_size = m;
+
+done:
+	free(order);
+	free(offset);
+	free(skip);
+	free(next);
+}
+
+/*
+ * Build the lists of targets on our own node (rb_local[0]) and in our own zone
+ * (rb_local[1]).  These are cheap, so they're always built; a set is shared by
+ * paths with and without topology-aware routing.
+ */
+static void
+lb_build_local(remap_backends_t *rb)
+{
+size_t	i, t, n, near, far;
+
+	for (t = 0; t < 2; t++) {
+		rb->rb_local[t] = NULL;
+		rb->rb_nlocal[t] = 0;
+	}
+
+	if (rb->rb_naddrs < 2 || rb->rb_naddrs > (uint16_t) -1)
+		return;
+
+	for (t = 0; t < 2; t++) {
+		for (i = 0, n = 0; i < rb->rb_naddrs; i++)
+			if (rb->rb_addrs[i].rt_locality <= t)
+				n++;
 
-	while ((entry = strsep(&s, "\r\n")) != NULL) {
-	char	*password, *rest;
-		if ((password = strchr(entry, ':')) == NULL)
+		/* Nothing to prefer if none or all of the targets are near */
+		if (n == 0 || n == rb->rb_naddrs)
 			continue;
-		*password++ = '\0';
 
-		if ((rest = strchr(password, ':')) != NULL)
-			*rest = '\0';
+		if ((rb->rb_local[t] = arena_alloc(&rb->rb_arena,
+				sizeof(uint16_t) * rb->rb_naddrs)) == NULL)
+			continue;
+
+		rb->rb_nlocal[t] = n;
+		for (i = 0, near = 0, far = n; i < rb->rb_naddrs; i++) {
+			if (rb->rb_addrs[i].rt_locality <= t)
+				rb->rb_local[t][near++] = (uint16_t) i;
+			else
+				rb->rb_local[t][far++] = (uint16_t) i;
+		}
+	}
+}
+
+void
+remap_backends_build_lb(remap_backends_t *rb, unsigned flags)
+{
+size_t	i;
 
-		while (strchr("\r\n", password[strlen(password) - 1]))
-			password[strlen(password) - 1] = '\0';
+	if (flags & REMAP_BACKENDS_HASH)
+		lb_build_table(rb);
+	lb_build_local(rb);
 
-		TSDebug("kubernetes", "added user %s/%s", entry, password);
-		hash_set(rp->rp_users, entry, strdup(password));
+	rb->rb_newest = 0;
+	for (i = 0; i < rb->rb_naddrs; i++)
+		if (rb->rb_addrs[i].rt_first_seen > rb->rb_newest)
+			rb->rb_newest = rb->rb_addrs[i].rt_first_seen;
+}
+
+void
+remap_path_build_lb(remap_path_t *rp)
+{
+remap_backend_slot_t	*bs = rp->rp_backends;
+
+	if (bs == NULL || bs->bs_key != NULL || bs->bs_backends == NULL)
+		return;
+
+	remap_backends_build_lb(bs->bs_backends,
+				rp->rp_lb == REMAP_LB_HASH ?
+				REMAP_BACKENDS_HASH : 0);
+}
+
+/*
+ * Parse the hash-by annotation: "client-ip", "cookie:<name>" or
+ * "header:<name>".
+ */
+static void
+remap_path_set_hash_by(remap_path_t *rp, const char *value)
+{
+size_t	clen = sizeof(IN_HASH_BY_COOKIE) - 1;
+size_t	hlen = sizeof(IN_HASH_BY_HEADER) - 1;
+char	*p;
+
+	rp->rp_hash_key = NULL;
+	rp->rp_hash_by = REMAP_HASH_CLIENT_IP;
+
+	if (strncmp(value, IN_HASH_BY_COOKIE, clen) == 0 && value[clen]) {
+		rp->rp_hash_by = REMAP_HASH_COOKIE;
+		rp->rp_hash_key = arena_strdup(&rp->rp_arena, value + clen);
+	} else if (strncmp(value, IN_HASH_BY_HEADER, hlen) == 0 &&
+		   value[hlen]) {
+		/* Request header fields are looked up in lower case */
+		rp->rp_hash_by = REMAP_HASH_HEADER;
+		rp->rp_hash_key = arena_strdup(&rp->rp_arena, value + hlen);
+		for (p = rp->rp_hash_key; *p; p++)
+			*p = tolower((unsigned char) *p);
+	} else if (strcmp(value, IN_HASH_BY_CLIENT_IP) != 0)
+		TSError("kubernetes: unknown hash-by value \"%s\"; using"
+			" client-ip", value);
+}
+
+/*
+ * Find the value of cookie name in a Cookie header value.
+ */
+static const char *
+find_cookie(const char *s, const char *name, size_t *len)
+{
+size_t	nlen = strlen(name);
+
+	while (*s) {
+		s += strspn(s, "; ");
+		if (strncmp(s, name, nlen) == 0 && s[nlen] == '=') {
+			s += nlen + 1;
+			*len = strcspn(s, "; ");
+			return s;
+		}
+		s += strcspn(s, ";");
+	}
+
+	return NULL;
+}
+
+/*
+ * Compute the consistent hash key for a request.  Returns 0 if the request
+ * doesn't have one, e.g. the cookie isn't set.
+ */
+static int
+lb_request_key(const remap_path_t *rp, remap_request_t *req, uint64_t *key)
+{
+const remap_hdrfield_t	*hdr;
+const char		*v;
+size_t			 i, len;
+
+	switch (rp->rp_hash_by) {
+	case REMAP_HASH_CLIENT_IP:
+		if (req->rr_addr == NULL)
+			return 0;
+
+		if (req->rr_addr->sa_family == AF_INET) {
+		const struct sockaddr_in *sin =
+			(const struct sockaddr_in *) req->rr_addr;
+			*key = lb_hash(&sin->sin_addr, sizeof(sin->sin_addr), 0);
+			return 1;
+		}
+
+		if (req->rr_addr->sa_family == AF_INET6) {
+		const struct sockaddr_in6 *sin6 =
+			(const struct sockaddr_in6 *) req->rr_addr;
+			*key = lb_hash(&sin6->sin6_addr,
+				       sizeof(sin6->sin6_addr), 0);
+			return 1;
+		}
+
+		return 0;
+
+	case REMAP_HASH_COOKIE:
+		if ((hdr = remap_request_get_header(req, "cookie")) == NULL)
+			return 0;
+
+		for (i = 0; i < hdr->rh_nvalues; i++) {
+			v = find_cookie(hdr->rh_values[i], rp->rp_hash_key,
+					&len);
+			if (v) {
+				*key = lb_hash(v, len, 0);
+				return 1;
+			}
+		}
+
+		return 0;
+
+	case REMAP_HASH_HEADER:
+		hdr = remap_request_get_header(req, rp->rp_hash_key);
+		if (hdr == NULL || hdr->rh_nvalues == 0)
+			return 0;
+
+		v = hdr->rh_values[0];
+		*key = lb_hash(v, strlen(v), 0);
+		return 1;
 	}
 
-	free(buf);
+	return 0;
 }
 
 /*
- * Pick a random backend for this path.
+ * Slow start.  A new target's weight ramps up from SLOW_START_WEIGHT_MIN to
+ * SLOW_START_WEIGHT_MAX over the path's slow start window, either linearly,
+ * or exponentially (doubling every 1/8 of the window).
+ */
+#define	SLOW_START_WEIGHT_MAX	1024
+#define	SLOW_START_WEIGHT_MIN	(SLOW_START_WEIGHT_MAX / 64)
+#define	SLOW_START_TRIES	4
+
+static unsigned
+target_weight(const remap_path_t *rp, const remap_target_t *rt, time_t now)
+{
+time_t		age = now - rt->rt_first_seen;
+unsigned	w;
+
+	if (rt->rt_first_seen == 0 || age >= rp->rp_slow_start)
+		return SLOW_START_WEIGHT_MAX;
+	if (age < 0)
+		age = 0;
+
+	if (rp->rp_slow_start_exp)
+		w = SLOW_START_WEIGHT_MAX >>
+			((rp->rp_slow_start - age) * 8 / rp->rp_slow_start);
+	else
+		w = SLOW_START_WEIGHT_MAX * age / rp->rp_slow_start;
+
+	return w < SLOW_START_WEIGHT_MIN ? SLOW_START_WEIGHT_MIN : w;
+}
+
+/*
+ * Return a random position in [0, n), not equal to not (if not < n).  If now
+ * is non-zero, some targets may be in slow start; then a target is accepted
+ * with a probability given by its weight, otherwise we try again.  After
+ * SLOW_START_TRIES attempts, we take whatever we got, so this never loops
+ * for long.  This is only for the random policy, which has nothing else to
+ * apply the weight to.
+ */
+static size_t
+pick_position(const remap_path_t *rp, const remap_backends_t *rb,
+	      const uint16_t *idx, size_t n, size_t not, time_t now)
+{
+size_t		i, tries;
+unsigned	w;
+
+	for (tries = 0;; tries++) {
+		if (not < n) {
+			i = rng_uniform(n - 1);
+			if (i >= not)
+				i++;
+		} else
+			i = rng_uniform(n);
+
+		if (now == 0 || tries == SLOW_START_TRIES)
+			return i;
+
+		w = target_weight(rp, &rb->rb_addrs[idx ? idx[i] : i], now);
+		if (w >= SLOW_START_WEIGHT_MAX ||
+		    (rng_next() % SLOW_START_WEIGHT_MAX) < w)
+			return i;
+	}
+}
+
+/*
+ * Pick a backend from n targets, which are idx[0..n-1] if idx is not NULL,
+ * or all of rb's targets otherwise.  With the random policy, this is a
+ * uniform random choice.  Otherwise, use "power of two choices": pick two
+ * different targets at random and use whichever is less loaded.  This avoids
+ * the herd behaviour of always picking the least loaded target, since the
+ * stats are shared between threads and always slightly out of date.
+ *
+ * With the random policy, a target in slow start is less likely to be picked,
+ * in proportion to its weight.  Otherwise, the candidates are picked
+ * uniformly and each one's load is divided by its weight, so a new target
+ * looks busier than it is: a target at 1/64 weight loses to any target with
+ * less than 64 times its load.  Rejecting candidates instead wouldn't
+ * be enough, since a new target which did get picked as a candidate would
+ * still win on load.
+ */
+static const remap_target_t *
+pick_from(const remap_path_t *rp, const remap_backends_t *rb,
+	  const uint16_t *idx, size_t n, time_t now)
+{
+const remap_target_t	*a, *b;
+uint64_t		 la, lb;
+size_t			 i, j;
+
+	if (n == 1 || rp->rp_lb == REMAP_LB_RANDOM ||
+	    rp->rp_lb == REMAP_LB_HASH) {
+		i = pick_position(rp, rb, idx, n, n, now);
+		return &rb->rb_addrs[idx ? idx[i] : i];
+	}
+
+	i = pick_position(rp, rb, idx, n, n, 0);
+	j = pick_position(rp, rb, idx, n, i, 0);
+	a = &rb->rb_addrs[idx ? idx[i] : i];
+	b = &rb->rb_addrs[idx ? idx[j] : j];
+
+	/* Compare la / weight(a) with lb / weight(b), without dividing */
+	la = target_load(rp, a);
+	lb = target_load(rp, b);
+	if (now) {
+		la *= target_weight(rp, b, now);
+		lb *= target_weight(rp, a, now);
+	}
+
+	return lb < la ? b : a;
+}
+
+/*
+ * For topology-aware routing, a nearby target is too busy to use if it has
+ * many more requests in flight than the target we'd use otherwise.  This
+ * means traffic spills over gradually as the nearby targets get busier than
+ * the rest, rather than at some fixed limit.
+ */
+#define	TOPOLOGY_SPILL_FACTOR	2
+#define	TOPOLOGY_SPILL_MIN	8
+
+static unsigned
+target_inflight(const remap_target_t *rt)
+{
+	if (rt->rt_stats == NULL)
+		return 0;
+	return __atomic_load_n(&rt->rt_stats->rs_inflight, __ATOMIC_RELAXED);
+}
+
+/*
+ * Pick one of rb's targets for this path.  With the hash policy, the
+ * request's hash key is looked up in rb's Maglev table, so the same key always
+ * goes to the same target while the targets don't change.
+ *
+ * With topology-aware routing, targets on our own node are preferred, then
+ * targets in our zone, then targets anywhere else.  This works from the
+ * outside in: pick a target from the furthest level, then replace it with a
+ * target from each nearer level unless that one is overloaded.  Endpoints
+ * only lists ready pods, so if none of the nearby pods are ready, the others
+ * are used.
  */
 const remap_target_t *
-remap_path_pick_target(const remap_path_t *rp)
+remap_path_pick_target(const remap_path_t *rp, const remap_backends_t *rb,
+		       remap_request_t *req)
 {
-int	n = rand() / (RAND_MAX / rp->rp_naddrs + 1);
-	return &rp->rp_addrs[n];
+const remap_target_t	*rt = NULL, *near;
+uint64_t		 key;
+int			 t;
+size_t			 n;
+time_t			 now = 0;
+
+	if (rb->rb_naddrs == 1)
+		return &rb->rb_addrs[0];
+
+	if (rp->rp_lb == REMAP_LB_HASH && rb->rb_lb_table && req &&
+	    lb_request_key(rp, req, &key))
+		return &rb->rb_addrs[
+			rb->rb_lb_table[key % rb->rb_lb_table_size]];
+
+	/* Only look at the time if a target might be in slow start */
+	if (rp->rp_slow_start && rb->rb_newest &&
+	    (now = time(NULL)) >= rb->rb_newest + rp->rp_slow_start)
+		now = 0;
+
+	for (t = 1; rp->rp_topology && t >= 0; t--) {
+		if ((n = rb->rb_nlocal[t]) == 0)
+			continue;
+
+		/* The targets outside the furthest level */
+		if (rt == NULL)
+			rt = pick_from(rp, rb, rb->rb_local[t] + n,
+				       rb->rb_naddrs - n, now);
+
+		near = pick_from(rp, rb, rb->rb_local[t], n, now);
+		if (target_inflight(near) <= TOPOLOGY_SPILL_FACTOR *
+		    target_inflight(rt) + TOPOLOGY_SPILL_MIN)
+			rt = near;
+	}
+
+	if (rt)
+		return rt;
+	return pick_from(rp, rb, NULL, rb->rb_naddrs, now);
 }
 
+void
+remap_target_start(const remap_target_t *rt)
+{
+	if (rt->rt_stats)
+		__atomic_add_fetch(&rt->rt_stats->rs_inflight, 1,
+				   __ATOMIC_RELAXED);
+}
+
+/*
+ * The response time average is updated with weight 1/8 for each new sample.
+ * This is done without a lock; if two threads race, one sample is lost, which
+ * doesn't matter for an average.
+ *
+ * A failure counts as a response FAIL_FACTOR times slower than the other
+ * targets' average (or this target's own, if no other target has one yet),
+ * or FAIL_DEFAULT_US if there are no samples at all.  Since the penalty is
+ * relative to the others, a target which keeps failing settles at FAIL_FACTOR
+ * times their average rather than growing without bound, so it still gets
+ * the occasional request and can recover.  FAIL_MAX_US only matters when
+ * every target is failing.
+ */
+#define	EWMA_SHIFT		3
+#define	FAIL_FACTOR		4
+#define	FAIL_DEFAULT_US		1000000
+#define	FAIL_MAX_US		60000000
+
+uint64_t
+remap_backends_mean_us(const remap_backends_t *rb,
+		       const remap_target_t *except)
+{
+uint64_t	sum = 0, ewma;
+size_t		i, n = 0;
+
+	for (i = 0; i < rb->rb_naddrs; i++) {
+		if (rb->rb_addrs[i].rt_stats == NULL ||
+		    &rb->rb_addrs[i] == except)
+			continue;
+		ewma = __atomic_load_n(&rb->rb_addrs[i].rt_stats->rs_ewma_us,
+				       __ATOMIC_RELAXED);
+		if (ewma) {
+			sum += ewma;
+			n++;
+		}
+	}
+
+	return n ? sum / n : 0;
+}
+
+void
+remap_target_finish(const remap_backends_t *rb, const remap_target_t *rt,
+		    uint64_t latency_us)
+{
+remap_target_stats_t	*rs = rt->rt_stats;
+uint64_t		 old;
+
+	if (rs == NULL)
+		return;
+
+	__atomic_sub_fetch(&rs->rs_inflight, 1, __ATOMIC_RELAXED);
+
+	if (latency_us == REMAP_TARGET_FAILED) {
+		if (rb == NULL ||
+		    (latency_us = remap_backends_mean_us(rb, rt)) == 0)
+			latency_us = __atomic_load_n(&rs->rs_ewma_us,
+						     __ATOMIC_RELAXED);
+		if (latency_us == 0)
+			latency_us = FAIL_DEFAULT_US;
+		else if (latency_us < FAIL_MAX_US / FAIL_FACTOR)
+			latency_us *= FAIL_FACTOR;
+		else
+			latency_us = FAIL_MAX_US;
+	}
+
+	if (latency_us == 0)
+		return;
+
+	old = __atomic_load_n(&rs->rs_ewma_us, __ATOMIC_RELAXED);
+	if (old == 0)
+		old = latency_us;
+	else
+		old += ((int64_t) latency_us - (int64_t) old) / (1 << EWMA_SHIFT);
+	__atomic_store_n(&rs->rs_ewma_us, old ? old : 1, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,257 @@
+/* vim:set sw=8 ts=8 noet: */
+/*
+ * Copyright (c) 2016-2017 Torchbox Ltd.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely. This software is provided 'as-is', without any express or implied
+ * warranty.
+ */
+/*
+ * remap_tls: cache the TLS contexts made from Secrets.
+ */
+
+#include	<stdio.h>
+#include	<stdlib.h>
+#include	<string.h>
+#include	<pthread.h>
+
+#include	<openssl/evp.h>
+
+#include	<ts/ts.h>
+
+#include	"remap.h"
+
+/*
+ * The cache, keyed by "namespace/name".  It holds a reference to each
+ * context, which it releases itself (the hash doesn't own its entries), and
+ * is only used while building a remap_db.
+ */
+static hash_t		tls_cache;
+static pthread_mutex_t	tls_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+tls_digest(const char *cert, const char *key, unsigned char *md)
+{
+EVP_MD_CTX	*ctx;
+
+	if ((ctx = EVP_MD_CTX_new()) == NULL) {
+		memset(md, 0, 32);
+		return;
+	}
+
+	EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+	EVP_DigestUpdate(ctx, cert, strlen(cert) + 1);
+	EVP_DigestUpdate(ctx, key, strlen(key) + 1);
+	EVP_DigestFinal_ex(ctx, md, NULL);
+	EVP_MD_CTX_free(ctx);
+}
+
+static remap_tls_t *
+tls_new(secret_t *secret, const char *cert, const char *key,
+	const unsigned char *digest)
+{
+remap_tls_t	*tc;
+
+	if ((tc = calloc(1, sizeof(*tc))) == NULL)
+		return NULL;
+
+	tc->tc_refs = 1;
+	tc->tc_namespace = strdup(secret->se_namespace);
+	tc->tc_name = strdup(secret->se_name);
+	tc->tc_cert = strdup(cert);
+	tc->tc_key = strdup(key);
+	memcpy(tc->tc_digest, digest, sizeof(tc->tc_digest));
+
+	if (!tc->tc_namespace || !tc->tc_name || !tc->tc_cert || !tc->tc_key) {
+		remap_tls_free(tc);
+		return NULL;
+	}
+
+	/*
+	 * This is only done when the Secret changes, since the result is
+	 * cached with the context.
+	 */
+	if (secret_check_tls_data(tc->tc_namespace, tc->tc_name,
+				  tc->tc_cert, tc->tc_key) == -1) {
+		TSError("kubernetes: TLS certificate in secret %s/%s is"
+			" invalid", tc->tc_namespace, tc->tc_name);
+		tc->tc_failed = 1;
+	}
+
+	return tc;
+}
+
+remap_tls_t *
+remap_tls_get(secret_t *secret)
+{
+const char	*cert, *key;
+unsigned char	 digest[32];
+char		 name[512];
+remap_tls_t	*tc, *built;
+int		 n;
+
+	if ((cert = hash_get(secret->se_data, "tls.crt")) == NULL ||
+	    (key = hash_get(secret->se_data, "tls.key")) == NULL) {
+		TSDebug("kubernetes", "remap_tls_get: %s/%s: no cert or key",
+			secret->se_namespace, secret->se_name);
+		return NULL;
+	}
+
+	tls_digest(cert, key, digest);
+
+	n = snprintf(name, sizeof(name), "%s/%s", secret->se_namespace,
+		     secret->se_name);
+	if (n < 0 || (size_t) n >= sizeof(name))
+		return tls_new(secret, cert, key, digest);
+
+	pthread_mutex_lock(&tls_cache_lock);
+	if (tls_cache == NULL)
+		tls_cache = hash_new(127, NULL);
+	if ((tc = hash_get(tls_cache, name)) != NULL &&
+	    memcmp(tc->tc_digest, digest, sizeof(digest)) == 0)
+		remap_tls_ref(tc);
+	else
+		tc = NULL;
+	pthread_mutex_unlock(&tls_cache_lock);
+
+	if (tc != NULL)
+		return tc;
+
+	/*
+	 * Checking the certificate is slow, so do it without holding the lock;
+	 * otherwise parallel builds would wait for each other.  If another
+	 * thread cached the same Secret meanwhile, use that one instead.
+	 */
+	if ((built = tls_new(secret, cert, key, digest)) == NULL)
+		return NULL;
+
+	pthread_mutex_lock(&tls_cache_lock);
+
+	/*
+	 * If the Secret changed, replace the cached context; hosts still using
+	 * the old one keep their reference to it.
+	 */
+	tc = hash_get(tls_cache, name);
+	if (tc && memcmp(tc->tc_digest, digest, sizeof(digest))) {
+		hash_del(tls_cache, name);
+		remap_tls_free(tc);
+		tc = NULL;
+	}
+
+	if (tc != NULL)
+		remap_tls_ref(tc);
+	else if (hash_set(tls_cache, name, built) == 0) {
+		tc = built;
+		remap_tls_ref(tc);
+	}
+
+	pthread_mutex_unlock(&tls_cache_lock);
+
+	/* If it couldn't be cached, the caller gets the only reference */
+	if (tc == NULL)
+		return built;
+	if (tc != built)
+		remap_tls_free(built);
+	return tc;
+}
+
+void
+remap_tls_ref(remap_tls_t *tc)
+{
+	__atomic_add_fetch(&tc->tc_refs, 1, __ATOMIC_RELAXED);
+}
+
+void
+remap_tls_free(remap_tls_t *tc)
+{
+	if (tc == NULL)
+		return;
+
+	if (__atomic_sub_fetch(&tc->tc_refs, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+
+	if (tc->tc_ctx)
+		TSSslContextDestroy((TSSslContext) tc->tc_ctx);
+	free(tc->tc_namespace);
+	free(tc->tc_name);
+	free(tc->tc_cert);
+	free(tc->tc_key);
+	free(tc);
+}
+
+SSL_CTX *
+remap_tls_get_ctx(remap_tls_t *tc)
+{
+SSL_CTX	*ctx, *expected = NULL;
+
+	if ((ctx = __atomic_load_n(&tc->tc_ctx, __ATOMIC_ACQUIRE)) != NULL)
+		return ctx;
+
+	if (__atomic_load_n(&tc->tc_failed, __ATOMIC_RELAXED))
+		return NULL;
+
+	/*
+	 * Two threads might build the context at the same time; whichever
+	 * finishes second throws its copy away.
+	 */
+	ctx = secret_make_ssl_ctx_data(tc->tc_namespace, tc->tc_name,
+				       tc->tc_cert, tc->tc_key);
+	if (ctx == NULL) {
+		TSError("kubernetes: TLS certificate in secret %s/%s is"
+			" invalid", tc->tc_namespace, tc->tc_name);
+		__atomic_store_n(&tc->tc_failed, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	TSDebug("kubernetes", "remap_tls_get_ctx: %s/%s: built CTX[%p]",
+		tc->tc_namespace, tc->tc_name, ctx);
+
+	if (!__atomic_compare_exchange_n(&tc->tc_ctx, &expected, ctx, 0,
+					 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		TSSslContextDestroy((TSSslContext) ctx);
+		ctx = expected;
+	}
+
+	return ctx;
+}
+
+int
+remap_tls_valid(const remap_tls_t *tc)
+{
+	return !__atomic_load_n(&tc->tc_failed, __ATOMIC_RELAXED);
+}
+
+void
+remap_tls_expire(void)
+{
+const char	*name;
+size_t		 namelen;
+remap_tls_t	*tc;
+hash_t		 keep;
+
+	pthread_mutex_lock(&tls_cache_lock);
+
+	if (tls_cache == NULL) {
+		pthread_mutex_unlock(&tls_cache_lock);
+		return;
+	}
+
+	/*
+	 * Contexts only the cache refers to aren't used by any remap_db.  The
+	 * hash can't be modified while iterating, so move the ones we keep to
+	 * a new hash.
+	 */
+	keep = hash_new(127, NULL);
+	hash_foreach(tls_cache, &name, &namelen, &tc) {
+		if (__atomic_load_n(&tc->tc_refs, __ATOMIC_ACQUIRE) == 1)
+			remap_tls_free(tc);
+		else
+			hash_setn(keep, name, namelen, tc);
+	}
+
+	hash_free(tls_cache);
+	tls_cache = keep;
+
+	pthread_mutex_unlock(&tls_cache_lock);
+}
@@ -29,11 +29,13 @@ k8s_config_free(k8s_config_t *cfg)
 		return;
 
 	free(cfg->co_server);
+	free(cfg->co_token);
 	free(cfg->co_tls_certfile);
 	free(cfg->co_tls_keyfile);
 	free(cfg->co_tls_cafile);
 	free(cfg->co_configmap_namespace);
 	free(cfg->co_configmap_name);
+	free(cfg->co_node_name);
 	hash_free(cfg->co_classes);
 	free(cfg);
 }
@@ -71,11 +73,51 @@ k8s_config_t	*ret;
 	ret->co_remap = 1;
 	ret->co_xfp = 1;
 	ret->co_tls_verify = 1;
+	ret->co_rebuild_delay = 100;
+	ret->co_rebuild_interval = 1000;
+	ret->co_rebuild_max_delay = 5000;
 
 	cfg_set_ingress_classes(ret, "trafficserver");
 	return ret;
 }
 
+/*
+ * Parse a non-negative size.  Returns 0 on success, -1 if s is not a number.
+ */
+static int
+cfg_parse_size(const char *s, size_t *ret)
+{
+char		*end;
+unsigned long	 v;
+
+	if (!isdigit((unsigned char) *s))
+		return -1;
+
+	errno = 0;
+	v = strtoul(s, &end, 10);
+	if (errno || *end)
+		return -1;
+
+	*ret = v;
+	return 0;
+}
+
+/*
+ * Parse a time in milliseconds.  Returns 0 on success, -1 if s is not a
+ * number or is too large.
+ */
+static int
+cfg_parse_msec(const char *s, unsigned *ret)
+{
+size_t	v;
+
+	if (cfg_parse_size(s, &v) || v > UINT_MAX)
+		return -1;
+
+	*ret = v;
+	return 0;
+}
+
 int
 cfg_load_file(k8s_config_t *cfg, const char *file)
 {
@@ -173,6 +215,49 @@ int	 lineno = 0;
 			}
 		} else if (strcmp(opt, "ingress_classes") == 0) {
 			cfg_set_ingress_classes(cfg, value);
+		} else if (strcmp(opt, "cache_key_hash_min") == 0) {
+			if (cfg_parse_size(value, &cfg->co_cache_key_hash_min)) {
+				TSError("%s:%d: expected a number of bytes",
+					file, lineno);
+				goto error;
+			}
+		} else if (strcmp(opt, "node_name") == 0) {
+			free(cfg->co_node_name);
+			cfg->co_node_name = strdup(value);
+		} else if (strcmp(opt, "rebuild_delay") == 0) {
+			if (cfg_parse_msec(value, &cfg->co_rebuild_delay)) {
+				TSError("%s:%d: expected a number of "
+					"milliseconds", file, lineno);
+				goto error;
+			}
+		} else if (strcmp(opt, "rebuild_interval") == 0) {
+			if (cfg_parse_msec(value, &cfg->co_rebuild_interval)) {
+				TSError("%s:%d: expected a number of "
+					"milliseconds", file, lineno);
+				goto error;
+			}
+		} else if (strcmp(opt, "rebuild_max_delay") == 0) {
+			if (cfg_parse_msec(value, &cfg->co_rebuild_max_delay)) {
+				TSError("%s:%d: expected a number of "
+					"milliseconds", file, lineno);
+				goto error;
+			}
+		} else if (strcmp(opt, "build_threads") == 0) {
+			if (cfg_parse_size(value, &cfg->co_build_threads)) {
+				TSError("%s:%d: expected a number of threads",
+					file, lineno);
+				goto error;
+			}
+		} else if (strcmp(opt, "service_upstream") == 0) {
+			if (strcmp(value, "true") == 0)
+				cfg->co_service_upstream = 1;
+			else if (strcmp(value, "false") == 0)
+				cfg->co_service_upstream = 0;
+			else {
+				TSError("%s:%d: expected \"true\" or \"false\"",
+					file, lineno);
+				goto error;
+			}
 		} else if (strcmp(opt, "configmap") == 0) {
 			char	*p;
 			if ((p = strchr(value, '/')) == NULL) {
@@ -328,6 +413,63 @@ FILE		*f = NULL;
 	if ((s = getenv("TS_INGRESS_CLASSES")) != NULL)
 		cfg_set_ingress_classes(ret, s);
 
+	if ((s = getenv("TS_CACHE_KEY_HASH_MIN")) != NULL) {
+		if (cfg_parse_size(s, &ret->co_cache_key_hash_min)) {
+			TSError("$TS_CACHE_KEY_HASH_MIN: expected a number of"
+				" bytes, not \"%s\"", s);
+			goto error;
+		}
+	}
+
+	if ((s = getenv("TS_NODE_NAME")) != NULL && *s) {
+		free(ret->co_node_name);
+		ret->co_node_name = strdup(s);
+	}
+
+	if ((s = getenv("TS_REBUILD_DELAY")) != NULL) {
+		if (cfg_parse_msec(s, &ret->co_rebuild_delay)) {
+			TSError("$TS_REBUILD_DELAY: expected a number of"
+				" milliseconds, not \"%s\"", s);
+			goto error;
+		}
+	}
+
+	if ((s = getenv("TS_REBUILD_INTERVAL")) != NULL) {
+		if (cfg_parse_msec(s, &ret->co_rebuild_interval)) {
+			TSError("$TS_REBUILD_INTERVAL: expected a number of"
+				" milliseconds, not \"%s\"", s);
+			goto error;
+		}
+	}
+
+	if ((s = getenv("TS_REBUILD_MAX_DELAY")) != NULL) {
+		if (cfg_parse_msec(s, &ret->co_rebuild_max_delay)) {
+			TSError("$TS_REBUILD_MAX_DELAY: expected a number of"
+				" milliseconds, not \"%s\"", s);
+			goto error;
+		}
+	}
+
+	if ((s = getenv("TS_BUILD_THREADS")) != NULL) {
+		if (cfg_parse_size(s, &ret->co_build_threads)) {
+			TSError("$TS_BUILD_THREADS: expected a number of"
+				" threads, not \"%s\"", s);
+			goto error;
+		}
+	}
+
+	if ((s = getenv("TS_SERVICE_UPSTREAM")) != NULL) {
+		if (strcmp(s, "true") == 0)
+			ret->co_service_upstream = 1;
+		else if (strcmp(s, "false") == 0)
+			ret->co_service_upstream = 0;
+		else {
+			TSError("$TS_SERVICE_UPSTREAM: expected \"true\" or"
+				" \"false\", not \"%s\"", s);
+			goto error;
+		}
+	}
+
 	if (ret->co_tls_keyfile) {
 		free(ret->co_token);
 		ret->co_token = NULL;
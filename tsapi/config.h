@@ -36,6 +36,13 @@ typedef struct k8s_config {
 	int	 co_xfp;
 	char	*co_configmap_namespace;
 	char	*co_configmap_name;
+	size_t	 co_cache_key_hash_min;
+	char	*co_node_name;
+	unsigned co_rebuild_delay;	/* Wait for changes to stop, msec    */
+	unsigned co_rebuild_interval;	/* Minimum time between rebuilds     */
+	unsigned co_rebuild_max_delay;	/* Longest a change can wait	     */
+	size_t	 co_build_threads;	/* Threads to build the remap_db     */
+	int	 co_service_upstream;	/* Route to ClusterIPs by default    */
 } k8s_config_t;
 
 k8s_config_t	*k8s_config_new(void);
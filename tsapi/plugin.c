@@ -113,7 +113,11 @@ size_t				 i;
 		return;
 	}
 
-	pthread_rwlock_init(&state->lock, NULL);
+	/*
+	 * Allocate the config slot our remap_db lives in.  It stays empty
+	 * until the watcher has fetched the cluster state for the first time.
+	 */
+	state->cfg_slot = TSConfigSet(0, NULL, destroy_db);
 	state->cluster = cluster_make();
 
 	/*
@@ -124,6 +128,7 @@ size_t				 i;
 		TSError("[kubernetes] cannot create watcher: %s", strerror(errno));
 		return;
 	}
+	rebuild_start(state->config);
 	watcher_set_callback(state->watcher, cluster_cb, state);
 	watcher_run(state->watcher);
 
@@ -164,8 +169,12 @@ size_t				 i;
 	}
 }
 
+/*
+ * Called on the watcher thread when the cluster changes.  The rebuild is done
+ * later, on the builder thread.
+ */
 static void
 cluster_cb(cluster_t *cluster, void *data)
 {
-	rebuild_maps();
+	rebuild_schedule();
 }
@@ -41,13 +41,11 @@ extern char myhostname[HOST_NAME_MAX + 1];
  * well as the TLS map and remap maps.
  */
 struct state {
-	pthread_rwlock_t	 lock;
 	k8s_config_t		*config;
 
 	/* current cluster state */
 	cluster_t		*cluster;
 	watcher_t		*watcher;
-	remap_db_t		*db;
 
 	TSCont			 tls_cont;
 	TSCont			 remap_cont;
@@ -58,15 +56,31 @@ struct state {
 	/*
 	 * TS config slot that our configuration is stored in.  This can be
 	 * passed to TSConfigGet() to fetch the current configuration (as a
-	 * struct remap_db *) in a thread-safe way.
+	 * struct remap_db *) in a thread-safe way.  The db stays valid until
+	 * the caller releases it with TSConfigRelease(), even if a rebuild
+	 * replaces it in the meantime; the old db is freed on the builder
+	 * thread once the last reference is gone.
 	 */
-	int		 cfg_slot;
+	unsigned int	 cfg_slot;
 };
 
 int	tsi_setup_acceptors(TSCont, TSEvent, void *);
 int	handle_remap(TSCont, TSEvent, void *);
 int	handle_tls(TSCont, TSEvent, void *);
 void	rebuild_maps(void);
+void	destroy_db(void *);
+
+/*
+ * Rebuild scheduling (rebuild.c).  rebuild_schedule() asks for the remap_db to
+ * be rebuilt soon, on the builder thread started by rebuild_start().
+ */
+void	rebuild_start(const k8s_config_t *);
+void	rebuild_schedule(void);
+
+/*
+ * Free a remap_db on the builder thread.  This may be called from any thread.
+ */
+void	rebuild_free_db(remap_db_t *);
 
 extern struct state *state;
 
@@ -128,6 +142,18 @@ int	comp_set_compress_headers(TSCont contn, TSEvent event, void *edata);
 int	comp_set_content_encoding(TSCont contn, TSEvent event, void *edata);
 void	comp_state_free(comp_state_t *cs);
 
+/*
+ * Size of the buffer embedded in request_ctx for the request arena.  This
+ * is enough that most requests never need to allocate from the heap.
+ */
+#define	REQUEST_ARENA_SIZE	1024
+
+/*
+ * Size of the stack buffer the cache key is built in.  Longer keys are
+ * allocated from the request arena.
+ */
+#define	CACHE_KEY_BUFSZ		512
+
 /*
  * Request state; this persists though the entire connection.
  */
@@ -141,7 +167,40 @@ typedef struct request_ctx {
 	unsigned	 rq_can_cache:1;
 	unsigned	 rq_debug_log:1;
 
-	hash_t		 rq_response_headers;
+	/*
+	 * Headers to add to the response.  These point either into the
+	 * request arena or into the remap_db pinned by rq_dbcfg, so both
+	 * must outlive the list.
+	 */
+	const remap_header_t	*rq_response_headers;
+
+	/*
+	 * The remap request.  Its arena holds all the request and result
+	 * data and is freed when the transaction closes.
+	 */
+	remap_request_t	 rq_req;
+	char		 rq_arenabuf[REQUEST_ARENA_SIZE];
+
+	/*
+	 * Our reference to the remap_db this request was mapped with; the
+	 * db (and therefore the remap_path) is kept alive until the
+	 * transaction closes.
+	 */
+	TSConfig	 rq_dbcfg;
+
+	/*
+	 * The backend this request was sent to, if any.  Its in-flight count
+	 * was incremented in handle_remap, and is decremented when the
+	 * transaction closes.
+	 */
+	const remap_target_t	*rq_target;
+
+	/*
+	 * The backend set rq_target belongs to.  New backends can be
+	 * published for the path at any time, but this set stays valid
+	 * while we hold rq_dbcfg.
+	 */
+	const remap_backends_t	*rq_backends;
 } request_ctx_t;
 
 void	debug_log_read_request_hdr(TSHttpTxn txn);
@@ -0,0 +1,251 @@
+/* vim:set sw=8 ts=8 noet: */
+/*
+ * Copyright (c) 2016-2017 Torchbox Ltd.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely. This software is provided 'as-is', without any express or implied
+ * warranty.
+ */
+
+/*
+ * rebuild.c: decide when to rebuild the remap_db.
+ *
+ * The watcher calls rebuild_schedule() every time the cluster changes.  That
+ * only marks the remap_db dirty and wakes the builder thread, so the watcher
+ * can go straight back to reading events.  The builder waits until changes
+ * have stopped arriving for co_rebuild_delay, but no longer than
+ * co_rebuild_max_delay after the first change it hasn't built yet, and never
+ * starts rebuilds closer together than co_rebuild_interval.  A burst of
+ * hundreds of Endpoints updates during a rollout therefore produces one or
+ * two rebuilds.
+ *
+ * The builder also frees old remap_dbs.  TS calls destroy_db() on whichever
+ * thread releases the last reference to a db, which is usually a network
+ * thread closing a transaction, so destroy_db() only queues the db and wakes
+ * the builder.
+ */
+
+#include	<stdint.h>
+#include	<stdlib.h>
+#include	<time.h>
+#include	<pthread.h>
+
+#include	<ts/ts.h>
+
+#include	"plugin.h"
+
+static pthread_mutex_t	rb_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	rb_cond;
+
+struct rebuild_garbage {
+	struct rebuild_garbage	*rg_next;
+	remap_db_t		*rg_db;
+};
+static struct rebuild_garbage	*rb_garbage;	/* dbs waiting to be freed   */
+
+static int		rb_dirty;	/* A change hasn't been built yet    */
+static uint64_t		rb_first;	/* When the first unbuilt change was */
+static uint64_t		rb_last;	/* When the latest change was	     */
+static uint64_t		rb_last_build;	/* When the last rebuild started     */
+static unsigned		rb_events;	/* Changes since the last rebuild    */
+
+/* Statistics */
+static int	st_rebuilds;		/* Number of rebuilds		     */
+static int	st_events;		/* Number of changes scheduled	     */
+static int	st_time_last;		/* Duration of last rebuild, msec    */
+static int	st_time_total;		/* Total time spent rebuilding	     */
+static int	st_stale_last;		/* Change to publish time, msec	     */
+static int	st_stale_max;		/* Worst change to publish time	     */
+
+/*
+ * The current time in milliseconds, on a clock which doesn't jump.
+ */
+static uint64_t
+now_msec(void)
+{
+struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void
+rebuild_schedule(void)
+{
+uint64_t	now = now_msec();
+
+	pthread_mutex_lock(&rb_lock);
+
+	if (!rb_dirty) {
+		rb_dirty = 1;
+		rb_first = now;
+	}
+
+	rb_last = now;
+	rb_events++;
+
+	pthread_cond_signal(&rb_cond);
+	pthread_mutex_unlock(&rb_lock);
+
+	TSStatIntIncrement(st_events, 1);
+}
+
+void
+rebuild_free_db(remap_db_t *db)
+{
+struct rebuild_garbage	*rg;
+
+	if (db == NULL)
+		return;
+
+	/* If we can't queue it, freeing it here is better than leaking it */
+	if ((rg = malloc(sizeof(*rg))) == NULL) {
+		remap_db_free(db);
+		return;
+	}
+
+	rg->rg_db = db;
+
+	pthread_mutex_lock(&rb_lock);
+	rg->rg_next = rb_garbage;
+	rb_garbage = rg;
+	pthread_cond_signal(&rb_cond);
+	pthread_mutex_unlock(&rb_lock);
+}
+
+/*
+ * Free the queued dbs.  Called with rb_lock held, which is dropped while
+ * freeing.
+ */
+static void
+rebuild_collect(void)
+{
+struct rebuild_garbage	*rg, *next;
+
+	rg = rb_garbage;
+	rb_garbage = NULL;
+	pthread_mutex_unlock(&rb_lock);
+
+	for (; rg; rg = next) {
+		next = rg->rg_next;
+		remap_db_free(rg->rg_db);
+		free(rg);
+	}
+
+	pthread_mutex_lock(&rb_lock);
+}
+
+/*
+ * Work out when the pending changes should be built.
+ */
+static uint64_t
+rebuild_due(const k8s_config_t *cfg)
+{
+uint64_t	due;
+
+	due = rb_last + cfg->co_rebuild_delay;
+	if (due > rb_first + cfg->co_rebuild_max_delay)
+		due = rb_first + cfg->co_rebuild_max_delay;
+	if (rb_last_build && due < rb_last_build + cfg->co_rebuild_interval)
+		due = rb_last_build + cfg->co_rebuild_interval;
+	return due;
+}
+
+static void *
+rebuild_thread(void *data)
+{
+const k8s_config_t	*cfg = data;
+uint64_t		 now, due, first, end, stale;
+unsigned		 events;
+struct timespec		 ts;
+
+	pthread_mutex_lock(&rb_lock);
+
+	for (;;) {
+		while (!rb_dirty && rb_garbage == NULL)
+			pthread_cond_wait(&rb_cond, &rb_lock);
+
+		if (rb_garbage) {
+			rebuild_collect();
+			continue;
+		}
+
+		/*
+		 * Wait until the build is due.  More changes can arrive while
+		 * we wait, so check again each time we wake up.
+		 */
+		now = now_msec();
+		if ((due = rebuild_due(cfg)) > now) {
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			ts.tv_sec += (due - now) / 1000;
+			ts.tv_nsec += ((due - now) % 1000) * 1000000;
+			if (ts.tv_nsec >= 1000000000) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&rb_cond, &rb_lock, &ts);
+			continue;
+		}
+
+		first = rb_first;
+		events = rb_events;
+		rb_dirty = 0;
+		rb_events = 0;
+		rb_last_build = now;
+
+		pthread_mutex_unlock(&rb_lock);
+
+		rebuild_maps();
+
+		end = now_msec();
+		stale = end - first;
+		TSDebug("kubernetes", "rebuild_thread: built %u changes in"
+			" %d ms, %d ms after the first change", events,
+			(int) (end - now), (int) stale);
+
+		TSStatIntIncrement(st_rebuilds, 1);
+		TSStatIntSet(st_time_last, end - now);
+		TSStatIntIncrement(st_time_total, end - now);
+		TSStatIntSet(st_stale_last, stale);
+		if ((TSMgmtInt) stale > TSStatIntGet(st_stale_max))
+			TSStatIntSet(st_stale_max, stale);
+
+		pthread_mutex_lock(&rb_lock);
+	}
+
+	/* NOTREACHED */
+	return NULL;
+}
+
+static int
+rebuild_stat(const char *name)
+{
+	return TSStatCreate(name, TS_RECORDDATATYPE_INT,
+			    TS_STAT_NON_PERSISTENT, TS_STAT_SYNC_SUM);
+}
+
+/*
+ * Start the builder thread.  This must be called before the watcher starts.
+ */
+void
+rebuild_start(const k8s_config_t *cfg)
+{
+pthread_condattr_t	attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&rb_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	st_rebuilds = rebuild_stat("plugin.kubernetes.rebuild.count");
+	st_events = rebuild_stat("plugin.kubernetes.rebuild.changes");
+	st_time_last = rebuild_stat("plugin.kubernetes.rebuild.last_ms");
+	st_time_total = rebuild_stat("plugin.kubernetes.rebuild.total_ms");
+	st_stale_last = rebuild_stat(
+		"plugin.kubernetes.rebuild.last_staleness_ms");
+	st_stale_max = rebuild_stat(
+		"plugin.kubernetes.rebuild.max_staleness_ms");
+
+	TSThreadCreate(rebuild_thread, (void *) cfg);
+}
@@ -14,7 +14,6 @@
 #include	<errno.h>
 #include	<getopt.h>
 #include	<regex.h>
-#include	<ctype.h>
 #include	<assert.h>
 
 #include	<ts/ts.h>
@@ -31,52 +30,91 @@
 #include	"base64.h"
 #include	"ts_crypt.h"
 #include	"auth.h"
-#include	"strmatch.h"
 
 void
 rebuild_maps(void)
 {
 remap_db_t	*newdb;
+TSConfig	 dbcfg;
+hash_t		 changed;
+int		 pending = 1;
+size_t		 npublished = 0;
 
 	TSDebug("kubernetes", "rebuild_maps: running");
 
 	/*
-	 * Build the new remap_db.  We must have a read lock on both the state
-	 * and the cluster before doing this.  We don't do the rebuild and
-	 * replace at once with a write lock, because want to avoid blocking
-	 * all requests while we rebuild.
+	 * Find out what changed since the last build.  Anything which changes
+	 * after this will be picked up by the next build.
 	 */
-	pthread_rwlock_rdlock(&state->lock);
-	pthread_rwlock_rdlock(&state->cluster->cs_lock);
+	pthread_rwlock_wrlock(&state->cluster->cs_lock);
+	changed = cluster_take_changes(state->cluster);
+	pthread_rwlock_unlock(&state->cluster->cs_lock);
 
-	newdb = remap_db_from_cluster(state->config, state->cluster);
+	/*
+	 * Build the new remap_db from the current one, rebuilding only the
+	 * hosts affected by the changes.  We must have a read lock on the
+	 * cluster before doing this.  Requests are not blocked while we
+	 * rebuild; they continue to use the current db until the new one is
+	 * set.
+	 *
+	 * Endpoints changes don't need a new build at all: their backends are
+	 * published directly to the paths using them, and removed from
+	 * changed.  If that was everything, the new db is just a copy of the
+	 * current one.  We still replace it, since the backends they replaced
+	 * can't be freed until every db that was live when they were replaced
+	 * has been.
+	 */
+	dbcfg = TSConfigGet(state->cfg_slot);
 
+	pthread_rwlock_rdlock(&state->cluster->cs_lock);
+	if (dbcfg && changed) {
+		npublished = remap_backends_update(state->config,
+						   state->cluster, changed);
+		pending = 0;
+		hash_foreach(changed, NULL, NULL, NULL) {
+			pending = 1;
+			break;
+		}
+	}
+
+	newdb = NULL;
+	if (pending)
+		newdb = remap_db_update(state->config, state->cluster,
+					dbcfg ? TSConfigDataGet(dbcfg) : NULL,
+					changed);
+	else if (npublished)
+		newdb = remap_db_copy(TSConfigDataGet(dbcfg));
 	pthread_rwlock_unlock(&state->cluster->cs_lock);
-	pthread_rwlock_unlock(&state->lock);
+
+	if (dbcfg)
+		TSConfigRelease(state->cfg_slot, dbcfg);
+	hash_free(changed);
+
+	if (newdb == NULL) {
+		TSDebug("kubernetes", "rebuild_maps: %s",
+			pending ? "build failed" : "nothing to do");
+		return;
+	}
 
 	/*
-	 * Now set our new db into the state; we need a write lock on the
-	 * state for this.
+	 * Now publish the new db.  Any request or TLS handshake which still
+	 * holds a reference to the old db keeps using it, so a long-lived
+	 * transaction keeps its db (and everything the db shares with newer
+	 * ones) until it closes.  TS calls destroy_db() when the last
+	 * reference is released.
 	 */
-	pthread_rwlock_wrlock(&state->lock);
-	remap_db_free(state->db);
-	state->db = newdb;
-	pthread_rwlock_unlock(&state->lock);
+	TSConfigSet(state->cfg_slot, newdb, destroy_db);
 }
 
 /*
- * Copy the string s, which is exactly n bytes long.  Any nul characters in
- * s will be ignored.
+ * Called by TS on the thread which released the last reference to a
+ * remap_db, typically a network thread at TXN_CLOSE.  Freeing a large db
+ * takes a while, so hand it to the builder thread instead.
  */
-static char *
-xstrndup(const char *s, size_t n)
+void
+destroy_db(void *data)
 {
-char	*ret;
-	if ((ret = malloc(n + 1)) == NULL)
-		return NULL;
-	bcopy(s, ret, n);
-	ret[n] = '\0';
-	return ret;
+	rebuild_free_db(data);
 }
 
 /*
@@ -97,6 +135,70 @@ TSHttpTxn	txnp = TSContDataGet(contn);
 	return TS_SUCCESS;
 }
 
+/*
+ * Fetch a single header field from the client request.  This is called by
+ * remap_run() (via rr_hdrfield_get) only for fields it actually needs, so we
+ * don't pay to copy every header field on every request.
+ */
+static remap_hdrfield_t *
+hdrfield_from_txn(void *data, arena_t *ar, const char *name)
+{
+TSHttpTxn		 txnp = data;
+TSMBuffer		 reqp;
+TSMLoc			 hdrs, ts_field, next;
+remap_hdrfield_t	*remap_field = NULL;
+char			**values;
+const char		*cs;
+int			 len, failed = 0;
+
+	if (TSHttpTxnClientReqGet(txnp, &reqp, &hdrs) != TS_SUCCESS)
+		return NULL;
+
+	/*
+	 * TSMimeHdrFieldFind() is case-insensitive; store the values of every
+	 * field with this name, in order.  Everything is allocated from the
+	 * request's arena, so there's nothing to free if we fail part way.
+	 */
+	ts_field = TSMimeHdrFieldFind(reqp, hdrs, name, -1);
+	while (ts_field != TS_NULL_MLOC) {
+	size_t	nvalues;
+
+		if (!remap_field && !failed &&
+		    (remap_field = arena_calloc(ar, 1,
+						sizeof(*remap_field))) == NULL)
+			failed = 1;
+
+		nvalues = TSMimeHdrFieldValuesCount(reqp, hdrs, ts_field);
+		if (!failed && (values = arena_alloc(ar, sizeof(*values) *
+				(remap_field->rh_nvalues + nvalues))) == NULL)
+			failed = 1;
+
+		/* store each value */
+		if (!failed && remap_field->rh_nvalues)
+			memcpy(values, remap_field->rh_values,
+			       sizeof(*values) * remap_field->rh_nvalues);
+		if (!failed)
+			remap_field->rh_values = values;
+
+		for (size_t j = 0; !failed && j < nvalues; ++j) {
+			cs = TSMimeHdrFieldValueStringGet(reqp, hdrs, ts_field,
+							  j, &len);
+			if ((values[remap_field->rh_nvalues] =
+			     arena_strndup(ar, cs, len)) == NULL)
+				failed = 1;
+			else
+				remap_field->rh_nvalues++;
+		}
+
+		next = TSMimeHdrFieldNextDup(reqp, hdrs, ts_field);
+		TSHandleMLocRelease(reqp, hdrs, ts_field);
+		ts_field = next;
+	}
+
+	TSHandleMLocRelease(reqp, TS_NULL_MLOC, hdrs);
+	return failed ? NULL : remap_field;
+}
+
 /*
  * Build a remap_request to pass to remap_db from the TS request data.
  */
@@ -115,18 +217,18 @@ int		 len;
 
 	/* method */
 	cs = TSHttpHdrMethodGet(reqp, hdrs, &len);
-	req->rr_method = xstrndup(cs, len);
+	req->rr_method = arena_strndup(&req->rr_arena, cs, len);
 
 	/* scheme */
 	if ((cs = TSUrlSchemeGet(reqp, url, &len)) != NULL) {
-		req->rr_proto = xstrndup(cs, len);
+		req->rr_proto = arena_strndup(&req->rr_arena, cs, len);
 		TSDebug("kubernetes", "request_from_txn: scheme is [%.*s]",
 			len, cs);
 	}
 
 	/* host - if missing, ignore this request */
 	if ((cs = TSHttpHdrHostGet(reqp, hdrs, &len)) != NULL) {
-		req->rr_host = xstrndup(cs, len);
+		req->rr_host = arena_strndup(&req->rr_arena, cs, len);
 
 		/* remove port from host if present */
 		if ((s = strchr(req->rr_host, ':')) != NULL)
@@ -135,42 +237,18 @@ int		 len;
 
 	/* path */
 	if ((cs = TSUrlPathGet(reqp, url, &len)) != NULL)
-		req->rr_path = xstrndup(cs, len);
+		req->rr_path = arena_strndup(&req->rr_arena, cs, len);
 
 	/* query string */
 	if ((cs = TSUrlHttpQueryGet(reqp, url, &len)) != NULL)
-		req->rr_query = xstrndup(cs, len);
+		req->rr_query = arena_strndup(&req->rr_arena, cs, len);
 
 	/* client network address */
 	req->rr_addr = TSHttpTxnClientAddrGet(txnp);
 
-	/* request header fields */
-	req->rr_hdrfields = hash_new(127, (hash_free_fn)remap_hdrfield_free);
-	for (int i = 0, end = TSMimeHdrFieldsCount(reqp, hdrs); i < end; ++i) {
-	TSMLoc			 ts_field;
-	remap_hdrfield_t	*remap_field;
-
-		remap_field = calloc(1, sizeof(*remap_field));
-		ts_field = TSMimeHdrFieldGet(reqp, hdrs, i);
-		remap_field->rh_nvalues = TSMimeHdrFieldValuesCount(reqp, hdrs,
-								    ts_field);
-		remap_field->rh_values = calloc(sizeof(char *),
-						remap_field->rh_nvalues);
-		/* store each value */
-		for (size_t j = 0; j < remap_field->rh_nvalues; ++j) {
-			cs = TSMimeHdrFieldValueStringGet(reqp, hdrs, ts_field,
-							  j, &len);
-			remap_field->rh_values[j] = xstrndup(cs, len);
-		}
-
-		cs = TSMimeHdrFieldNameGet(reqp, hdrs, ts_field, &len);
-		s = xstrndup(cs, len);
-		for (int j = 0; j < len; ++j)
-			s[j] = tolower(s[j]);
-		hash_set(req->rr_hdrfields, s, remap_field);
-		free(s);
-		TSHandleMLocRelease(reqp, hdrs, ts_field);
-	}
+	/* request header fields are fetched on demand */
+	req->rr_hdrfield_get = hdrfield_from_txn;
+	req->rr_hdrfield_data = txnp;
 
 	TSHandleMLocRelease(reqp, hdrs, url);
 	TSHandleMLocRelease(reqp, TS_NULL_MLOC, hdrs);
@@ -309,7 +387,8 @@ static const char *const status_names[] = {
 
 /*
  * A continuation to set additional fields in the HTTP reponse header.  It
- * expects its continuation data to be a hash_t of string pairs.  This must be
+ * expects its continuation data to be a request_ctx_t, and adds the fields in
+ * rq_response_headers.  This must be
  * hooked to both TS_HTTP_SEND_RESPONSE_HDR and TS_HTTP_TXN_CLOSE_HOOK to
  * ensure the data is freed.
  *
@@ -323,8 +402,7 @@ TSHttpTxn	txn = edata;
 TSMBuffer	resp;
 TSMLoc		hdrs;
 TSMLoc		hdr;
-const char	*h, *v;
-size_t		 hlen;
+const remap_header_t	*rh;
 request_ctx_t	*rctx = TSContDataGet(contp);
 
 	assert(event == TS_EVENT_HTTP_SEND_RESPONSE_HDR);
@@ -336,21 +414,20 @@ request_ctx_t	*rctx = TSContDataGet(contp);
 	 * Set any header fields in the txn's hdrset; typically these come from
 	 * the remap response.
 	 */
-	if (rctx->rq_response_headers)
-		hash_foreach(rctx->rq_response_headers, &h, &hlen, &v) {
-		TSReturnCode	ret;
-
-			TSDebug("kubernetes", "set_headers: [%.*s] = [%s]",
-				(int) hlen, h, v);
-			ret = TSMimeHdrFieldCreateNamed(resp, hdrs, h, hlen,
-							&hdr);
-			if (ret == TS_SUCCESS) {
-				TSMimeHdrFieldValueStringInsert(resp, hdrs, hdr,
-						0, v, strlen(v));
-				TSMimeHdrFieldAppend(resp, hdrs, hdr);
-				TSHandleMLocRelease(resp, hdrs, hdr);
-			}
+	for (rh = rctx->rq_response_headers; rh; rh = rh->hd_next) {
+	TSReturnCode	ret;
+
+		TSDebug("kubernetes", "set_headers: [%s] = [%s]",
+			rh->hd_name, rh->hd_value);
+		ret = TSMimeHdrFieldCreateNamed(resp, hdrs, rh->hd_name,
+						strlen(rh->hd_name), &hdr);
+		if (ret == TS_SUCCESS) {
+			TSMimeHdrFieldValueStringInsert(resp, hdrs, hdr, 0,
+					rh->hd_value, strlen(rh->hd_value));
+			TSMimeHdrFieldAppend(resp, hdrs, hdr);
+			TSHandleMLocRelease(resp, hdrs, hdr);
 		}
+	}
 
 	/*
 	 * Set Via and Server fields.
@@ -562,31 +639,6 @@ TSMLoc		hdr, field;
 	return TS_SUCCESS;
 }
 
-int
-should_ignore_cookie(remap_path_t *path, const char *cookie)
-{
-const char	*k, *p = strchr(cookie, '=');
-size_t		 klen;
-
-	if (!p)
-		return 0;
-
-	/* First, check whether it's explicitly ignored */
-	hash_foreach(path->rp_ignore_cookies, &k, &klen, NULL)
-		if (strmatch(cookie, p, k, k + klen))
-			return 1;
-
-	/* If not, see whether there's a whitelist */
-	if (path->rp_whitelist_cookies) {
-		hash_foreach(path->rp_whitelist_cookies, &k, &klen, NULL)
-			if (strmatch(cookie, p, k, k + klen))
-				return 0;
-		return 1;
-	}
-
-	return 0;
-}
-
 static void
 check_cookies(TSHttpTxn txn, remap_request_t *req, remap_result_t *res,
 	      int *can_cache)
@@ -594,10 +646,10 @@ check_cookies(TSHttpTxn txn, remap_request_t *req, remap_result_t *res,
 TSMBuffer	 reqp;
 TSMLoc		 hdr;
 TSMLoc		 field;
-char		*s, *r, *t;
 const char	*cs;
+char		*s;
 int		 len;
-char		*newhdr;
+size_t		 newlen;
 
 	TSHttpTxnClientReqGet(txn, &reqp, &hdr);
 	field = TSMimeHdrFieldFind(reqp, hdr, "Cookie", 6);
@@ -610,39 +662,35 @@ char		*newhdr;
 	/* For now, we cannot cache; this may change later */
 	*can_cache = 0;
 
-	cs = TSMimeHdrFieldValueStringGet(reqp, hdr, field, 0, &len);
-	s = malloc(len + 1);
-	bcopy(cs, s, len);
-	s[len] = 0;
-
-	newhdr = malloc(1);
-	newhdr[0] = '\0';
+	/* If no cookies are ignored, there's nothing to remove. */
+	if (!res->rz_path->rp_ignore_cookies &&
+	    !res->rz_path->rp_whitelist_cookies)
+		goto cleanup;
 
-	for (r = strtok_r(s, " ;", &t); r; r = strtok_r(NULL, " ;", &t)) {
-		if (should_ignore_cookie(res->rz_path, r))
-			continue;
-		TSDebug("kubernetes", "check_cookies: preserving this cookie [%s]",
-			r);
-		newhdr = realloc(newhdr, strlen(newhdr) + strlen(r) + 3);
-		if (*newhdr)
-			strcat(newhdr, "; ");
-		strcat(newhdr, r);
-	}
+	/*
+	 * The header value belongs to TS, so copy it once into the request
+	 * arena and filter the copy in place.
+	 */
+	cs = TSMimeHdrFieldValueStringGet(reqp, hdr, field, 0, &len);
+	if ((s = arena_alloc(&req->rr_arena, len + 1)) == NULL)
+		goto cleanup;
+	memcpy(s, cs, len);
+	s[len] = '\0';
 
-	free(s);
+	newlen = remap_path_filter_cookies(res->rz_path, s, len);
+	TSDebug("kubernetes", "check_cookies: preserving cookies [%.*s]",
+		(int) newlen, s);
 
-	if (*newhdr) {
+	if (newlen) {
 		/* Set the new cookie header */
 		TSMimeHdrFieldValuesClear(reqp, hdr, field);
-		TSMimeHdrFieldValueStringSet(reqp, hdr, field, -1, newhdr, -1);
+		TSMimeHdrFieldValueStringSet(reqp, hdr, field, -1, s, newlen);
 	} else {
 		/* No cookies left; remove the header */
 		TSMimeHdrFieldRemove(reqp, hdr, field);
 		*can_cache = 1;
 	}
 
-	free(newhdr);
-
 cleanup:
 	if (field != TS_NULL_MLOC)
 		TSHandleMLocRelease(reqp, hdr, field);
@@ -676,6 +724,33 @@ TSMLoc		hdr, field;
 	return TS_SUCCESS;
 }
 
+/*
+ * Update the load balancing stats for the request's backend.  The response
+ * time is measured from when we started sending the request to the backend
+ * until we had its response header.  If we tried to connect to the backend
+ * but never got a response header, the request failed; if we never tried
+ * (the request was served from cache), there's no sample.
+ */
+static void
+finish_target(TSHttpTxn txn, request_ctx_t *rctx)
+{
+TSHRTime	connect = 0, start = 0, end = 0;
+uint64_t	latency = 0;
+
+	if (TSHttpTxnMilestoneGet(txn, TS_MILESTONE_SERVER_BEGIN_WRITE,
+				  &start) == TS_SUCCESS &&
+	    TSHttpTxnMilestoneGet(txn, TS_MILESTONE_SERVER_READ_HEADER_DONE,
+				  &end) == TS_SUCCESS &&
+	    start > 0 && end > start)
+		latency = (end - start) / 1000;
+	else if (TSHttpTxnMilestoneGet(txn, TS_MILESTONE_SERVER_FIRST_CONNECT,
+				       &connect) == TS_SUCCESS && connect > 0)
+		latency = REMAP_TARGET_FAILED;
+
+	remap_target_finish(rctx->rq_backends, rctx->rq_target, latency);
+	rctx->rq_target = NULL;
+}
+
 TSReturnCode
 tsi_event(TSCont contn, TSEvent event, void *edata)
 {
@@ -725,6 +800,8 @@ request_ctx_t	*req = TSContDataGet(contn);
 	case TS_EVENT_HTTP_TXN_CLOSE:
 		if (req->rq_compress_transform)
 			TSContDestroy(req->rq_compress_transform);
+		if (req->rq_target)
+			finish_target(txn, req);
 		request_ctx_free(req);
 		TSContDestroy(contn);
 		break;
@@ -742,7 +819,9 @@ request_ctx_free(request_ctx_t *rctx)
 {
 	if (rctx->rq_comp_state)
 		comp_state_free(rctx->rq_comp_state);
-	hash_free(rctx->rq_response_headers);
+	remap_request_free(&rctx->rq_req);
+	if (rctx->rq_dbcfg)
+		TSConfigRelease(state->cfg_slot, rctx->rq_dbcfg);
 	free(rctx);
 }
 
@@ -757,30 +836,37 @@ handle_remap(TSCont contn, TSEvent event, void *edata)
 {
 TSMLoc			 newurl;
 TSHttpTxn		 txnp = (TSHttpTxn) edata;
-remap_request_t		 req;
+remap_request_t		*req;
 remap_result_t		 res;
 synth_t			*sy;
-struct sockaddr_in	 addr;
 int			 reenable = 1, ret;
 TSCont			 c;
 request_ctx_t		*rctx;
+TSConfig		 dbcfg;
+const remap_db_t	*db;
 
 	/*
-	 * Take a read lock on the cluster state so it doesn't change while
-	 * we're using it.
+	 * Take a reference to the current remap_db so it isn't freed while
+	 * we're using it.  The reference is owned by the request context and
+	 * released when the transaction closes.
 	 */
-	pthread_rwlock_rdlock(&state->lock);
+	dbcfg = TSConfigGet(state->cfg_slot);
 
 	/* Not initialised yet? */
-	if (!state->db) {
-		pthread_rwlock_unlock(&state->lock);
+	if (!dbcfg || (db = TSConfigDataGet(dbcfg)) == NULL) {
+		if (dbcfg)
+			TSConfigRelease(state->cfg_slot, dbcfg);
 		TSDebug("kubernetes", "handle_remap: no database");
+		TSHttpTxnReenable(txnp, TS_EVENT_HTTP_CONTINUE);
 		return TS_SUCCESS;
 	}
 
 	rctx = calloc(1, sizeof(*rctx));
+	rctx->rq_dbcfg = dbcfg;
 
-	bzero(&req, sizeof(req));
+	req = &rctx->rq_req;
+	arena_init(&req->rr_arena, rctx->rq_arenabuf,
+		   sizeof(rctx->rq_arenabuf));
 	bzero(&res, sizeof(res));
 
 	c = TSContCreate(tsi_event, TSMutexCreate());
@@ -797,11 +883,11 @@ request_ctx_t		*rctx;
 	TSHttpTxnConfigIntSet(txnp, TS_CONFIG_HTTP_RESPONSE_SERVER_ENABLED, 0);
 
 	/* Create a remap_request from the TS request */
-	if (request_from_txn(txnp, &req) != 0)
+	if (request_from_txn(txnp, req) != 0)
 		goto cleanup;
 
 	/* Do the remap */
-	ret = remap_run(state->db, &req, &res);
+	ret = remap_run(db, req, &res);
 	rctx->rq_response_headers = res.rz_headers;
 	res.rz_headers = NULL;
 
@@ -859,6 +945,13 @@ request_ctx_t		*rctx;
 		synth_intercept(sy, txnp);
 		goto cleanup;
 
+	case RR_ERR_INTERNAL:
+		sy = synth_new(500, "Internal server error");
+		synth_add_header(sy, "Content-Type", "text/plain;charset=UTF-8");
+		synth_set_body(sy, "An internal error occurred.\r\n");
+		synth_intercept(sy, txnp);
+		goto cleanup;
+
 	case RR_OK:
 		break;
 
@@ -880,7 +973,7 @@ request_ctx_t		*rctx;
 
 		TSHttpTxnClientReqGet(txnp, &reqp, &hdr);
 
-		newurl = url_from_remap_result(txnp, reqp, hdr, &req, &res);
+		newurl = url_from_remap_result(txnp, reqp, hdr, req, &res);
 		if (newurl) {
 			TSHttpHdrUrlSet(reqp, hdr, newurl);
 			TSHandleMLocRelease(reqp, hdr, newurl);
@@ -891,6 +984,11 @@ request_ctx_t		*rctx;
 			goto cleanup;
 	}
 
+	/* This request is now in flight to the target */
+	rctx->rq_target = res.rz_target;
+	rctx->rq_backends = res.rz_backends;
+	remap_target_start(rctx->rq_target);
+
 	/* Do HTTP/2 server push */
 	if (res.rz_path->rp_server_push)
 		rctx->rq_server_push = 1;
@@ -929,7 +1027,7 @@ request_ctx_t		*rctx;
 	 * host.
 	 */
 	if (res.rz_path->rp_preserve_host)
-		set_host_field(txnp, req.rr_host);
+		set_host_field(txnp, req->rr_host);
 	else
 		set_host_field(txnp, res.rz_target->rt_host);
 
@@ -945,8 +1043,8 @@ request_ctx_t		*rctx;
 	 * this request.
 	 */
 	if (res.rz_path->rp_cache) {
-	char	*cacheurl;
-	size_t	 urllen;
+	char	 keybuf[CACHE_KEY_BUFSZ], *cacheurl = keybuf, *heapurl = NULL;
+	size_t	 urllen, hashmin = state->config->co_cache_key_hash_min;
 	int	 can_cache;
 
 		rctx->rq_cache_enabled = 1;
@@ -957,7 +1055,7 @@ request_ctx_t		*rctx;
 		 * empty; if so, it sets can_cache to 1.  If can_cache is
 		 * 0, we should not cache this request.
 		 */
-		check_cookies(txnp, &req, &res, &can_cache);
+		check_cookies(txnp, req, &res, &can_cache);
 
 		if (can_cache) {
 			rctx->rq_can_cache = 1;
@@ -972,9 +1070,29 @@ request_ctx_t		*rctx;
 			TSHttpTxnConfigIntSet(txnp, TS_CONFIG_HTTP_CACHE_HTTP, 1);
 
 			/* Set the cache URL */
-			remap_make_cache_key(&req, &res, &cacheurl, &urllen);
-			TSCacheUrlSet(txnp, cacheurl, urllen);
-			free(cacheurl);
+			urllen = remap_make_cache_key(req, &res, keybuf,
+						      sizeof(keybuf), hashmin);
+			if (urllen > sizeof(keybuf)) {
+				cacheurl = arena_alloc(&req->rr_arena, urllen);
+				if (cacheurl == NULL)
+					cacheurl = heapurl = malloc(urllen);
+				if (cacheurl)
+					urllen = remap_make_cache_key(req,
+						&res, cacheurl, urllen,
+						hashmin);
+			}
+
+			/*
+			 * Without our cache key, TS would use the whole URL,
+			 * so don't cache at all.
+			 */
+			if (cacheurl == NULL) {
+				rctx->rq_can_cache = 0;
+				TSHttpTxnConfigIntSet(txnp,
+					TS_CONFIG_HTTP_CACHE_HTTP, 0);
+			} else if (urllen)
+				TSCacheUrlSet(txnp, cacheurl, urllen);
+			free(heapurl);
 		}
 	}
 
@@ -997,13 +1115,11 @@ request_ctx_t		*rctx;
 
 	/*
 	 * If the target is an IP address (the usual case) we can pass it
-	 * to TS directly.
+	 * to TS directly; it was parsed when the remap_db was built.
 	 */
-	bzero(&addr, sizeof(addr));
-	if (inet_pton(AF_INET, res.rz_target->rt_host, &addr.sin_addr) == 1) {
-		addr.sin_family = AF_INET;
-		addr.sin_port = htons(res.rz_target->rt_port);
-		TSHttpTxnServerAddrSet(txnp, (struct sockaddr *) &addr);
+	if (res.rz_target->rt_addrlen) {
+		TSHttpTxnServerAddrSet(txnp,
+			(const struct sockaddr *) &res.rz_target->rt_addr);
 	} else {
 		/*
 		 * We have a DNS name, so we need to do a host lookup to get the
@@ -1025,9 +1141,10 @@ request_ctx_t		*rctx;
 	}
 
 cleanup:
-	pthread_rwlock_unlock(&state->lock);
-
-	remap_request_free(&req);
+	/*
+	 * The request itself is freed with rctx when the transaction closes,
+	 * since the response headers are allocated from its arena.
+	 */
 	remap_result_free(&res);
 
 	if (reenable)
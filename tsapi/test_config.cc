@@ -136,3 +136,84 @@ TEST(Config, EnvironmentOnly)
 	unsetenv("TS_TLS_VERIFY");
 	unsetenv("TS_REMAP");
 }
+
+TEST(Config, RebuildTimes)
+{
+	k8s_config_t	*cfg;
+
+	cfg = k8s_config_load("tests/kubernetes.config");
+	ASSERT_NE(static_cast<k8s_config_t *>(nullptr), cfg);
+	EXPECT_EQ(100u, cfg->co_rebuild_delay);
+	EXPECT_EQ(1000u, cfg->co_rebuild_interval);
+	EXPECT_EQ(5000u, cfg->co_rebuild_max_delay);
+	k8s_config_free(cfg);
+
+	setenv("TS_REBUILD_DELAY", "250", 1);
+	setenv("TS_REBUILD_INTERVAL", "0", 1);
+	setenv("TS_REBUILD_MAX_DELAY", "30000", 1);
+
+	cfg = k8s_config_load("tests/kubernetes.config");
+	ASSERT_NE(static_cast<k8s_config_t *>(nullptr), cfg);
+	EXPECT_EQ(250u, cfg->co_rebuild_delay);
+	EXPECT_EQ(0u, cfg->co_rebuild_interval);
+	EXPECT_EQ(30000u, cfg->co_rebuild_max_delay);
+	k8s_config_free(cfg);
+
+	ts_api_errors = 0;
+	setenv("TS_REBUILD_DELAY", "soon", 1);
+	cfg = k8s_config_load("tests/kubernetes.config");
+	EXPECT_EQ(static_cast<k8s_config_t *>(nullptr), cfg);
+	EXPECT_EQ(1, ts_api_errors);
+
+	unsetenv("TS_REBUILD_DELAY");
+	unsetenv("TS_REBUILD_INTERVAL");
+	unsetenv("TS_REBUILD_MAX_DELAY");
+}
+
+TEST(Config, BuildThreads)
+{
+	k8s_config_t	*cfg;
+
+	cfg = k8s_config_load("tests/kubernetes.config");
+	ASSERT_NE(static_cast<k8s_config_t *>(nullptr), cfg);
+	EXPECT_EQ(0u, cfg->co_build_threads);
+	k8s_config_free(cfg);
+
+	setenv("TS_BUILD_THREADS", "4", 1);
+	cfg = k8s_config_load("tests/kubernetes.config");
+	ASSERT_NE(static_cast<k8s_config_t *>(nullptr), cfg);
+	EXPECT_EQ(4u, cfg->co_build_threads);
+	k8s_config_free(cfg);
+
+	ts_api_errors = 0;
+	setenv("TS_BUILD_THREADS", "many", 1);
+	cfg = k8s_config_load("tests/kubernetes.config");
+	EXPECT_EQ(static_cast<k8s_config_t *>(nullptr), cfg);
+	EXPECT_EQ(1, ts_api_errors);
+
+	unsetenv("TS_BUILD_THREADS");
+}
+
+TEST(Config, ServiceUpstream)
+{
+	k8s_config_t	*cfg;
+
+	cfg = k8s_config_load("tests/kubernetes.config");
+	ASSERT_NE(static_cast<k8s_config_t *>(nullptr), cfg);
+	EXPECT_EQ(0, cfg->co_service_upstream);
+	k8s_config_free(cfg);
+
+	setenv("TS_SERVICE_UPSTREAM", "true", 1);
+	cfg = k8s_config_load("tests/kubernetes.config");
+	ASSERT_NE(static_cast<k8s_config_t *>(nullptr), cfg);
+	EXPECT_EQ(1, cfg->co_service_upstream);
+	k8s_config_free(cfg);
+
+	ts_api_errors = 0;
+	setenv("TS_SERVICE_UPSTREAM", "yes", 1);
+	cfg = k8s_config_load("tests/kubernetes.config");
+	EXPECT_EQ(static_cast<k8s_config_t *>(nullptr), cfg);
+	EXPECT_EQ(1, ts_api_errors);
+
+	unsetenv("TS_SERVICE_UPSTREAM");
+}
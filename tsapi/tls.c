@@ -34,7 +34,10 @@ TSVConn			 ssl_vc;
 SSL			*ssl = NULL;
 const char		*host = NULL, *version;
 const remap_host_t	*rh;
+SSL_CTX			*ctx;
 int			 ret = 1;
+TSConfig		 dbcfg;
+const remap_db_t	*db;
 
 	TSDebug("kubernetes", "handle_tls: starting");
 
@@ -51,24 +54,31 @@ int			 ret = 1;
 	TSDebug("kubernetes_tls", "handle_tls: doing SNI map for [%s]", host);
 
 	/*
-	 * Take a read lock on the cluster state so it doesn't change while
-	 * we're using it.
+	 * Take a reference to the current remap_db so it isn't freed while
+	 * we're using it.  SSL_set_SSL_CTX() takes its own reference on the
+	 * SSL_CTX, so we can release the db as soon as we're done here.
 	 */
-	pthread_rwlock_rdlock(&state->lock);
+	dbcfg = TSConfigGet(state->cfg_slot);
 
 	/* Not initialised yet? */
-	if (!state->db) {
-		pthread_rwlock_unlock(&state->lock);
-		TSDebug("kubernetes", "handle_remap: no database");
+	if (!dbcfg || (db = TSConfigDataGet(dbcfg)) == NULL) {
+		if (dbcfg)
+			TSConfigRelease(state->cfg_slot, dbcfg);
+		TSDebug("kubernetes", "handle_tls: no database");
+		TSVConnReenable(ssl_vc);
 		return TS_SUCCESS;
 	}
 
-	if ((rh = remap_db_get_host(state->db, host)) == NULL) {
+	if ((rh = remap_db_get_host(db, host)) == NULL) {
 		TSDebug("kubernetes", "[%s] handle_tls: host not found", host);
 		goto cleanup;
 	}
 
-	if (!rh->rh_ctx) {
+	/*
+	 * The SSL_CTX is built the first time it's needed, so this might
+	 * take a while, but only once per certificate.
+	 */
+	if (!rh->rh_tls || (ctx = remap_tls_get_ctx(rh->rh_tls)) == NULL) {
 		TSDebug("kubernetes", "[%s] handle_tls: host found, but not ctx",
 			host);
 		goto cleanup;
@@ -102,48 +112,24 @@ int			 ret = 1;
 		break;
 	}
 
-#ifdef NOTYET
-	/* TLS passthrough? */
-	if (rh->rh_tls_passthrough) {
-	remap_path_t		*rp = rh->rh_paths[0];
-	remap_target_t		*target = remap_path_pick_target(rp);
-	struct sockaddr_in	 addr;
-
-		bzero(&addr, sizeof(addr));
-		if (inet_pton(AF_INET, res.rz_target->rt_host, &addr.sin_addr) != 1) {
-			TSError("kubernetes: %s: could not find target host",
-				host);
-			goto cleanup;
-		}
-
-		addr.sin_family = AF_INET;
-		addr.sin_port = htons(target->rt_port);
-		TSHttpTxnServerAddrSet(txnp, (struct sockaddr *) &addr);
-			TSVConnTunnel(ssl_vc);
-			TSDebug("kubernetes", "[%s] handle_tls: will blind tunnel",
-				host);
-	} else
-#endif
-	{
-		SSL_set_SSL_CTX(ssl, rh->rh_ctx);
-		TSDebug("kubernetes", "[%s] handle_tls: attached SSL context [%p]",
-			host, rh->rh_ctx);
-
-		/*
-		 * Is HTTP/2 disabled on this Ingress?
-		 */
-		if (!rh->rh_http2) {
-		TSAcceptor	acpt = TSAcceptorGet(ssl_vc);
-		int		acptid = TSAcceptorIDGet(acpt);
-
-			/* If yes, set the protocolset we saved earlier */
-			TSRegisterProtocolSet(ssl_vc, state->protosets[acptid]);
-		}
+	SSL_set_SSL_CTX(ssl, ctx);
+	TSDebug("kubernetes", "[%s] handle_tls: attached SSL context [%p]",
+		host, ctx);
+
+	/*
+	 * Is HTTP/2 disabled on this Ingress?
+	 */
+	if (!rh->rh_http2) {
+	TSAcceptor	acpt = TSAcceptorGet(ssl_vc);
+	int		acptid = TSAcceptorIDGet(acpt);
+
+		/* If yes, set the protocolset we saved earlier */
+		TSRegisterProtocolSet(ssl_vc, state->protosets[acptid]);
 	}
 
 cleanup:
 	TSDebug("kubernetes", "[%s] handle_tls: return %d", host, ret);
 	TSVConnReenable(ssl_vc);
-	pthread_rwlock_unlock(&state->lock);
+	TSConfigRelease(state->cfg_slot, dbcfg);
 	return 1;
 }
@@ -0,0 +1,172 @@
+/* vim:set sw=8 ts=8 noet: */
+/*
+ * Copyright (c) 2016-2017 Torchbox Ltd.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely. This software is provided 'as-is', without any express or implied
+ * warranty.
+ */
+
+#include	<sys/types.h>
+
+#include	<stdlib.h>
+#include	<string.h>
+#include	<stdint.h>
+
+#include	"arena.h"
+
+/*
+ * All allocations are aligned to this boundary, which is enough for any type
+ * we store in an arena.
+ */
+#define	ARENA_ALIGN	16
+
+struct arena_block {
+	struct arena_block	*ab_next;
+	/* Pad the header so the data after it is aligned */
+	char			 ab_pad[ARENA_ALIGN - sizeof(void *)];
+};
+
+#define	ALIGN_UP(n)	(((n) + (ARENA_ALIGN - 1)) & ~(size_t)(ARENA_ALIGN - 1))
+
+void
+arena_init(arena_t *ar, void *buf, size_t bufsz)
+{
+uintptr_t	start, end;
+
+	memset(ar, 0, sizeof(*ar));
+
+	if (!buf)
+		return;
+
+	/* Align the start of the buffer; the end doesn't matter */
+	start = ALIGN_UP((uintptr_t) buf);
+	end = (uintptr_t) buf + bufsz;
+	if (start >= end)
+		return;
+
+	ar->ar_buf = ar->ar_ptr = (char *) start;
+	ar->ar_bufsz = end - start;
+	ar->ar_end = ar->ar_buf + ar->ar_bufsz;
+}
+
+/*
+ * Allocate a new block from the heap with at least sz bytes of space.
+ */
+static void *
+arena_new_block(arena_t *ar, size_t sz)
+{
+struct arena_block	*blk;
+
+	if ((blk = malloc(sizeof(*blk) + sz)) == NULL)
+		return NULL;
+
+	blk->ab_next = ar->ar_blocks;
+	ar->ar_blocks = blk;
+	return blk + 1;
+}
+
+void *
+arena_alloc(arena_t *ar, size_t sz)
+{
+char	*ret;
+
+	sz = ALIGN_UP(sz ? sz : 1);
+
+	/* Common case: there's enough space in the current block */
+	if (ar->ar_ptr && (size_t) (ar->ar_end - ar->ar_ptr) >= sz) {
+		ret = ar->ar_ptr;
+		ar->ar_ptr += sz;
+		return ret;
+	}
+
+	/*
+	 * Large allocations get a block of their own, so we don't waste the
+	 * space left in the current block.
+	 */
+	if (sz > ARENA_BLOCK_SIZE / 4)
+		return arena_new_block(ar, sz);
+
+	if ((ret = arena_new_block(ar, ARENA_BLOCK_SIZE)) == NULL)
+		return NULL;
+
+	ar->ar_ptr = ret + sz;
+	ar->ar_end = ret + ARENA_BLOCK_SIZE;
+	return ret;
+}
+
+void *
+arena_alloc_aligned(arena_t *ar, size_t sz, size_t align)
+{
+uintptr_t	p;
+size_t		asz = ALIGN_UP(sz ? sz : 1);
+
+	if (align <= ARENA_ALIGN)
+		return arena_alloc(ar, sz);
+
+	/* If it fits in the current block after padding, put it there */
+	if (ar->ar_ptr) {
+		p = ((uintptr_t) ar->ar_ptr + (align - 1)) & ~(uintptr_t)
+			(align - 1);
+		if (p <= (uintptr_t) ar->ar_end &&
+		    (uintptr_t) ar->ar_end - p >= asz) {
+			ar->ar_ptr = (char *) p + asz;
+			return (void *) p;
+		}
+	}
+
+	/* Otherwise allocate enough to align it ourselves */
+	if (asz > SIZE_MAX - align)
+		return NULL;
+	if ((p = (uintptr_t) arena_alloc(ar, asz + align - ARENA_ALIGN)) == 0)
+		return NULL;
+	return (void *) ((p + (align - 1)) & ~(uintptr_t) (align - 1));
+}
+
+void *
+arena_calloc(arena_t *ar, size_t nmemb, size_t sz)
+{
+void	*ret;
+
+	if (sz && nmemb > SIZE_MAX / sz)
+		return NULL;
+
+	if ((ret = arena_alloc(ar, nmemb * sz)) != NULL)
+		memset(ret, 0, nmemb * sz);
+	return ret;
+}
+
+char *
+arena_strndup(arena_t *ar, const char *s, size_t n)
+{
+char	*ret;
+
+	if ((ret = arena_alloc(ar, n + 1)) == NULL)
+		return NULL;
+
+	memcpy(ret, s, n);
+	ret[n] = '\0';
+	return ret;
+}
+
+char *
+arena_strdup(arena_t *ar, const char *s)
+{
+	return arena_strndup(ar, s, strlen(s));
+}
+
+void
+arena_reset(arena_t *ar)
+{
+struct arena_block	*blk, *next;
+
+	for (blk = ar->ar_blocks; blk; blk = next) {
+		next = blk->ab_next;
+		free(blk);
+	}
+
+	ar->ar_blocks = NULL;
+	ar->ar_ptr = ar->ar_buf;
+	ar->ar_end = ar->ar_buf ? ar->ar_buf + ar->ar_bufsz : NULL;
+}
@@ -0,0 +1,85 @@
+/* vim:set sw=8 ts=8 noet: */
+/*
+ * Copyright (c) 2016-2017 Torchbox Ltd.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely. This software is provided 'as-is', without any express or implied
+ * warranty.
+ */
+/*
+ * arena.h: a simple bump allocator.  Memory is allocated from the arena by
+ * advancing a pointer, and is never freed individually; instead, the entire
+ * arena is freed at once with arena_reset().  This is intended for data
+ * which has the same lifetime as a single request.
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include	<stdlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Size of the blocks the arena allocates from the heap once its initial
+ * buffer (if any) is exhausted.
+ */
+#define	ARENA_BLOCK_SIZE	4096
+
+struct arena_block;
+
+/*
+ * An arena.  A zero-initialised arena_t is a valid, empty arena with no
+ * initial buffer.
+ */
+typedef struct arena {
+	char			*ar_ptr;	/* Next free byte		*/
+	char			*ar_end;	/* End of the current block	*/
+	char			*ar_buf;	/* Caller's initial buffer	*/
+	size_t			 ar_bufsz;
+	struct arena_block	*ar_blocks;	/* Blocks allocated from heap	*/
+} arena_t;
+
+/*
+ * Initialise an arena.  If buf is not NULL, allocations are made from buf
+ * until it is full, and only then from the heap; buf must remain valid for
+ * the life of the arena.
+ */
+void	 arena_init(arena_t *, void *buf, size_t bufsz);
+
+/*
+ * Allocate memory from the arena.  The returned memory is suitably aligned
+ * for any type and is not initialised.  Returns NULL if memory could not be
+ * allocated.
+ */
+void	*arena_alloc(arena_t *, size_t);
+void	*arena_calloc(arena_t *, size_t nmemb, size_t size);
+
+/*
+ * Allocate memory aligned to align bytes, which must be a power of two.  This
+ * is for memory which needs more alignment than usual, like data which should
+ * have a cache line to itself.
+ */
+void	*arena_alloc_aligned(arena_t *, size_t, size_t align);
+
+/*
+ * Copy a string into the arena.  arena_strndup() copies exactly n bytes and
+ * nul-terminates the result.
+ */
+char	*arena_strdup(arena_t *, const char *);
+char	*arena_strndup(arena_t *, const char *, size_t n);
+
+/*
+ * Free all memory allocated from the arena.  The arena can be used again
+ * afterwards.
+ */
+void	 arena_reset(arena_t *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* !ARENA_H */
@@ -23,6 +23,15 @@ extern "C" {
 void	base64_encode(const unsigned char *inbuf, size_t inlen, char *outbuf);
 ssize_t	base64_decode(char const *inbuf, size_t inlen, unsigned char *outbuf);
 
+/*
+ * The individual encoder implementations, for testing.  base64_encoder()
+ * returns the named implementation ("scalar", "ssse3" or "avx2"), or NULL if
+ * it isn't available on this platform or CPU.
+ */
+typedef void (*base64_encode_fn) (const unsigned char *, size_t, char *);
+void		 base64_encode_scalar(const unsigned char *, size_t, char *);
+base64_encode_fn base64_encoder(const char *name);
+
 #ifdef __cplusplus
 }
 #endif
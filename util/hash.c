@@ -132,7 +132,7 @@ void	*oldvalue = NULL;
 
 	raxInsert(hs->hs_rax, (unsigned char *) key, keylen, value, &oldvalue);
 
-	if (oldvalue && hs->hs_free_fn)
+	if (oldvalue && oldvalue != value && hs->hs_free_fn)
 		hs->hs_free_fn(oldvalue);
 
 	return 0;
@@ -180,20 +180,6 @@ void	*data = NULL;
 
 #else	/* HASH_USE_RAX */
 
-struct hashbucket {
-	char		*hb_key;
-	size_t		 hb_keylen;
-	void		*hb_value;
-	struct hashbucket
-			*hb_next;
-};
-
-struct hash {
-	size_t			  hs_size;
-	hash_free_fn		  hs_free_fn;
-	struct hashbucket	**hs_buckets;
-};
-
 /*
  * 32-bit FNV-1a hash function by Phong Vo, Glenn Fowler and Landon Curt Noll.
  * Implementation by Landon Curt Noll.  This implementation is in the public
@@ -217,6 +203,27 @@ unsigned const char	*s = (unsigned const char *)str;
     return hval;
 }
 
+#if HASH_USE_CHAINED
+
+/*
+ * The original chained hash table.  This is kept so the open-addressing table
+ * can be benchmarked against it; see hash_bench.c.
+ */
+
+struct hashbucket {
+	char		*hb_key;
+	size_t		 hb_keylen;
+	void		*hb_value;
+	struct hashbucket
+			*hb_next;
+};
+
+struct hash {
+	size_t			  hs_size;
+	hash_free_fn		  hs_free_fn;
+	struct hashbucket	**hs_buckets;
+};
+
 hash_t
 hash_new(size_t sz, hash_free_fn freefn)
 {
@@ -333,6 +340,18 @@ uint32_t		 bn;
 	bn = fnv32(key, key + keylen) % hs->hs_size;
 	assert(bn < hs->hs_size);
 
+	/* If the key already exists, replace its value. */
+	for (newb = hs->hs_buckets[bn]; newb; newb = newb->hb_next) {
+		if (newb->hb_keylen != keylen ||
+		    memcmp(newb->hb_key, key, keylen) != 0)
+			continue;
+
+		if (newb->hb_value != value && hs->hs_free_fn)
+			hs->hs_free_fn(newb->hb_value);
+		newb->hb_value = value;
+		return 0;
+	}
+
 	if ((newb = calloc(1, sizeof(*newb))) == NULL)
 		return -1;
 
@@ -414,4 +433,438 @@ struct hashbucket	*hb, *prev = NULL;
 	}
 }
 
+#else	/* HASH_USE_CHAINED */
+
+/*
+ * An open-addressing hash table, modelled on Abseil's SwissTable.
+ *
+ * The table is an array of slots, divided into groups of HASH_GROUP_SIZE
+ * slots.  Each slot has a control byte: HASH_CTRL_EMPTY, HASH_CTRL_DELETED, or
+ * (if the slot is in use) the top 7 bits of the key's hash.  A lookup hashes
+ * the key to a group, then compares all the control bytes in the group against
+ * the key's 7-bit tag at once, and only looks at slots whose tag matches.  If
+ * the key isn't in the group and the group has no empty slots, the next group
+ * is probed (quadratically), otherwise the key isn't present.
+ *
+ * Keys shorter than HASH_INLINE_KEY bytes are stored in the slot itself, so
+ * for most keys, a lookup touches only the control bytes and one slot.
+ *
+ * The table starts empty and grows (by doubling) whenever it would become more
+ * than 7/8 full, counting deleted slots; if most of those are deleted, it's
+ * rebuilt at the same size instead.
+ */
+
+#if defined(__SSE2__)
+# include	<emmintrin.h>
+#endif
+
+#define	HASH_GROUP_SIZE		16
+#define	HASH_INLINE_KEY		16
+#define	HASH_MIN_CAPACITY	HASH_GROUP_SIZE
+
+#define	HASH_CTRL_EMPTY		((uint8_t)0x80)
+#define	HASH_CTRL_DELETED	((uint8_t)0xFE)
+
+struct hashslot {
+	void		*sl_value;
+	uint32_t	 sl_hash;
+	uint32_t	 sl_keylen;
+	union {
+		char	*sk_ptr;
+		char	 sk_buf[HASH_INLINE_KEY];
+	}		 sl_key;
+};
+
+struct hash {
+	hash_free_fn	 hs_free_fn;
+	size_t		 hs_capacity;	/* Number of slots; a power of 2 */
+	size_t		 hs_items;	/* Slots in use */
+	size_t		 hs_deleted;	/* Slots marked HASH_CTRL_DELETED */
+	uint8_t		*hs_ctrl;
+	struct hashslot	*hs_slots;
+};
+
+#define	SLOT_KEY(sl)	((sl)->sl_keylen < HASH_INLINE_KEY		\
+			 ? (sl)->sl_key.sk_buf : (sl)->sl_key.sk_ptr)
+#define	HASH_TAG(h)	((uint8_t)((h) >> 25))
+
+/*
+ * Return a bitmask of the slots in the group starting at ctrl whose control
+ * byte equals c.
+ */
+static inline unsigned
+group_match(const uint8_t *ctrl, uint8_t c)
+{
+#if defined(__SSE2__)
+__m128i	g = _mm_loadu_si128((const __m128i *)ctrl);
+
+	return (unsigned)_mm_movemask_epi8(
+			_mm_cmpeq_epi8(g, _mm_set1_epi8((char)c)));
+#else
+unsigned	mask = 0;
+int		i;
+
+	for (i = 0; i < HASH_GROUP_SIZE; i++)
+		if (ctrl[i] == c)
+			mask |= 1u << i;
+	return mask;
+#endif
+}
+
+/*
+ * Return a bitmask of the slots in the group which are empty or deleted, i.e.
+ * whose control byte has the top bit set.
+ */
+static inline unsigned
+group_match_free(const uint8_t *ctrl)
+{
+#if defined(__SSE2__)
+	return (unsigned)_mm_movemask_epi8(
+			_mm_loadu_si128((const __m128i *)ctrl));
+#else
+unsigned	mask = 0;
+int		i;
+
+	for (i = 0; i < HASH_GROUP_SIZE; i++)
+		if (ctrl[i] & 0x80)
+			mask |= 1u << i;
+	return mask;
+#endif
+}
+
+static inline int
+lowest_bit(unsigned mask)
+{
+	return __builtin_ctz(mask);
+}
+
+/*
+ * Find the slot containing key, or return -1.
+ */
+static ssize_t
+hash_lookup(const hash_t hs, const char *key, size_t keylen, uint32_t h)
+{
+size_t		ngroups, g, step;
+uint8_t		tag = HASH_TAG(h);
+
+	if (hs->hs_capacity == 0)
+		return -1;
+
+	ngroups = hs->hs_capacity / HASH_GROUP_SIZE;
+	g = h & (ngroups - 1);
+
+	for (step = 1; step <= ngroups; step++) {
+	const uint8_t	*ctrl = hs->hs_ctrl + g * HASH_GROUP_SIZE;
+	unsigned	 mask = group_match(ctrl, tag);
+
+		while (mask) {
+		size_t			 i = g * HASH_GROUP_SIZE + lowest_bit(mask);
+		const struct hashslot	*sl = &hs->hs_slots[i];
+
+			if (sl->sl_hash == h && sl->sl_keylen == keylen &&
+			    memcmp(SLOT_KEY(sl), key, keylen) == 0)
+				return (ssize_t)i;
+			mask &= mask - 1;
+		}
+
+		if (group_match(ctrl, HASH_CTRL_EMPTY))
+			return -1;
+
+		g = (g + step) & (ngroups - 1);
+	}
+
+	return -1;
+}
+
+/*
+ * Find a free (empty or deleted) slot for a key with the hash h.  The table
+ * must have at least one free slot.
+ */
+static size_t
+hash_find_free(const hash_t hs, uint32_t h)
+{
+size_t		ngroups, g, step;
+
+	ngroups = hs->hs_capacity / HASH_GROUP_SIZE;
+	g = h & (ngroups - 1);
+
+	for (step = 1;; step++) {
+	unsigned	mask;
+
+		mask = group_match_free(hs->hs_ctrl + g * HASH_GROUP_SIZE);
+		if (mask)
+			return g * HASH_GROUP_SIZE + lowest_bit(mask);
+
+		g = (g + step) & (ngroups - 1);
+	}
+}
+
+/*
+ * Resize the table to newcap slots, re-inserting every item and dropping any
+ * deleted slots.  Keys don't need to be rehashed since the hash is stored in
+ * the slot.
+ */
+static int
+hash_resize(hash_t hs, size_t newcap)
+{
+uint8_t		*oldctrl = hs->hs_ctrl;
+struct hashslot	*oldslots = hs->hs_slots;
+size_t		 oldcap = hs->hs_capacity, i;
+
+	if ((hs->hs_ctrl = malloc(newcap)) == NULL) {
+		hs->hs_ctrl = oldctrl;
+		return -1;
+	}
+
+	if ((hs->hs_slots = malloc(newcap * sizeof(struct hashslot))) == NULL) {
+		free(hs->hs_ctrl);
+		hs->hs_ctrl = oldctrl;
+		hs->hs_slots = oldslots;
+		return -1;
+	}
+
+	memset(hs->hs_ctrl, HASH_CTRL_EMPTY, newcap);
+	hs->hs_capacity = newcap;
+	hs->hs_deleted = 0;
+
+	for (i = 0; i < oldcap; i++) {
+	size_t	n;
+
+		if (oldctrl[i] & 0x80)
+			continue;
+
+		n = hash_find_free(hs, oldslots[i].sl_hash);
+		hs->hs_ctrl[n] = oldctrl[i];
+		hs->hs_slots[n] = oldslots[i];
+	}
+
+	free(oldctrl);
+	free(oldslots);
+	return 0;
+}
+
+hash_t
+hash_new(size_t sz, hash_free_fn freefn)
+{
+hash_t	ret;
+
+	/*
+	 * The table grows as needed, so sz is only a hint.  Most hashes hold
+	 * only a few items whatever size they were created with, so don't
+	 * allocate anything until the first item is added.
+	 */
+	(void)sz;
+
+	if ((ret = calloc(1, sizeof(*ret))) == NULL)
+		return NULL;
+
+	ret->hs_free_fn = freefn;
+	return ret;
+}
+
+void
+hash_free(hash_t hs)
+{
+size_t	i;
+
+	if (!hs)
+		return;
+
+	for (i = 0; i < hs->hs_capacity; i++) {
+	struct hashslot	*sl = &hs->hs_slots[i];
+
+		if (hs->hs_ctrl[i] & 0x80)
+			continue;
+
+		if (sl->sl_keylen >= HASH_INLINE_KEY)
+			free(sl->sl_key.sk_ptr);
+		if (hs->hs_free_fn)
+			hs->hs_free_fn(sl->sl_value);
+	}
+
+	free(hs->hs_ctrl);
+	free(hs->hs_slots);
+	free(hs);
+}
+
+int
+hash_iterate(hash_t hs, struct hash_iter_state *state,
+	     const char **key, size_t *keylen, void **value)
+{
+	assert(hs);
+
+	for (; state->i < hs->hs_capacity; state->i++) {
+	struct hashslot	*sl = &hs->hs_slots[state->i];
+
+		if (hs->hs_ctrl[state->i] & 0x80)
+			continue;
+
+		if (key) *key = SLOT_KEY(sl);
+		if (keylen) *keylen = sl->sl_keylen;
+		if (value) *value = sl->sl_value;
+		state->i++;
+		return 1;
+	}
+
+	return 0;
+}
+
+void *
+hash_find(const hash_t hs, hash_find_fn fn, void *data)
+{
+size_t	i;
+
+	assert(hs);
+
+	for (i = 0; i < hs->hs_capacity; i++) {
+	struct hashslot	*sl = &hs->hs_slots[i];
+
+		if (hs->hs_ctrl[i] & 0x80)
+			continue;
+
+		if (fn(hs, SLOT_KEY(sl), sl->sl_value, data))
+			return sl->sl_value;
+	}
+
+	return NULL;
+}
+
+int
+hash_set(hash_t hs, const char *key, void *value)
+{
+	return hash_setn(hs, key, strlen(key), value);
+}
+
+int
+hash_setn(hash_t hs, const char *key, size_t keylen, void *value)
+{
+struct hashslot	*sl;
+uint32_t	 h;
+ssize_t		 n;
+
+	assert(hs);
+	assert(key);
+
+	if (keylen > UINT32_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	h = fnv32(key, key + keylen);
+
+	/*
+	 * If the key already exists, replace its value.
+	 */
+	if ((n = hash_lookup(hs, key, keylen, h)) >= 0) {
+		sl = &hs->hs_slots[n];
+		if (sl->sl_value != value && hs->hs_free_fn)
+			hs->hs_free_fn(sl->sl_value);
+		sl->sl_value = value;
+		return 0;
+	}
+
+	/*
+	 * Grow the table if adding this item would make it more than 7/8
+	 * full.  If half the used slots are deleted, rebuilding the table at
+	 * the same size is enough.
+	 */
+	if ((hs->hs_items + hs->hs_deleted + 1) * 8 > hs->hs_capacity * 7) {
+	size_t	newcap;
+
+		if (hs->hs_capacity == 0)
+			newcap = HASH_MIN_CAPACITY;
+		else if (hs->hs_deleted > hs->hs_items)
+			newcap = hs->hs_capacity;
+		else
+			newcap = hs->hs_capacity * 2;
+
+		if (hash_resize(hs, newcap) == -1)
+			return -1;
+	}
+
+	n = hash_find_free(hs, h);
+	sl = &hs->hs_slots[n];
+
+	if (keylen < HASH_INLINE_KEY) {
+		memcpy(sl->sl_key.sk_buf, key, keylen);
+		sl->sl_key.sk_buf[keylen] = '\0';
+	} else if ((sl->sl_key.sk_ptr = strndup(key, keylen)) == NULL)
+		return -1;
+
+	if (hs->hs_ctrl[n] == HASH_CTRL_DELETED)
+		hs->hs_deleted--;
+
+	hs->hs_ctrl[n] = HASH_TAG(h);
+	sl->sl_hash = h;
+	sl->sl_keylen = (uint32_t)keylen;
+	sl->sl_value = value;
+	hs->hs_items++;
+	return 0;
+}
+
+void *
+hash_get(const hash_t hs, const char *key)
+{
+	return hash_getn(hs, key, strlen(key));
+}
+
+void *
+hash_getn(const hash_t hs, const char *key, size_t keylen)
+{
+ssize_t	n;
+
+	assert(hs);
+	assert(key);
+
+	n = hash_lookup(hs, key, keylen, fnv32(key, key + keylen));
+	if (n < 0) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	return hs->hs_slots[n].sl_value;
+}
+
+void
+hash_del(hash_t hs, const char *key)
+{
+	hash_deln(hs, key, strlen(key));
+}
+
+void
+hash_deln(hash_t hs, const char *key, size_t keylen)
+{
+struct hashslot	*sl;
+uint8_t		*group;
+ssize_t		 n;
+
+	assert(hs);
+	assert(key);
+
+	if ((n = hash_lookup(hs, key, keylen, fnv32(key, key + keylen))) < 0)
+		return;
+
+	sl = &hs->hs_slots[n];
+	if (sl->sl_keylen >= HASH_INLINE_KEY)
+		free(sl->sl_key.sk_ptr);
+
+	/*
+	 * If the slot's group already has an empty slot, no probe can ever
+	 * have continued past this group, so the slot can be marked empty.
+	 * Otherwise, it must be marked deleted so that lookups for keys stored
+	 * in later groups still find them.
+	 */
+	group = hs->hs_ctrl + (n & ~(size_t)(HASH_GROUP_SIZE - 1));
+	if (group_match(group, HASH_CTRL_EMPTY))
+		hs->hs_ctrl[n] = HASH_CTRL_EMPTY;
+	else {
+		hs->hs_ctrl[n] = HASH_CTRL_DELETED;
+		hs->hs_deleted++;
+	}
+
+	hs->hs_items--;
+}
+
+#endif	/* !HASH_USE_CHAINED */
+
 #endif	/* !HASH_USE_RAX */
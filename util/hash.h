@@ -8,13 +8,26 @@
  * warranty.
 */
 /*
- * hash.h: a simple hashed key-value data store.  well, it used to be; now it's
- * just a thin wrapper around the radix trie implementation, Rax.
+ * hash.h: a simple hashed key-value data store.
+ *
+ * There are three implementations, selected at build time:
+ *
+ *  - the default, an open-addressing table which grows as needed;
+ *  - HASH_USE_CHAINED, the original fixed-size chained hash table;
+ *  - HASH_USE_RAX, a thin wrapper around the radix trie implementation, Rax.
+ *
+ * The alternatives are only kept for comparison; see util/hash_bench.c.
  */
 #ifndef HASH_H
 #define HASH_H
 
-#define	HASH_USE_RAX	0
+#ifndef	HASH_USE_RAX
+# define	HASH_USE_RAX		0
+#endif
+
+#ifndef	HASH_USE_CHAINED
+# define	HASH_USE_CHAINED	0
+#endif
 
 #include	<stdlib.h>
 
@@ -37,12 +50,8 @@ typedef struct hash *hash_t;
 #define	HASH_PRESENT	((void *)(uintptr_t)-1)
 
 /*
- * Create a new hash table with the specified number of buckets.  The number of
- * items which can be stored in the hash table is not limited by its size, but
- * performance will reduce as the number of items exceeds the size.
- *
- * For best performance, the size should be a prime number, but this is not a
- * requirement.
+ * Create a new hash table.  The size is the number of buckets for the chained
+ * implementation; the default implementation grows as needed and ignores it.
  */
 typedef void (*hash_free_fn) (void *);
 hash_t	hash_new(size_t size, hash_free_fn);
@@ -53,8 +62,10 @@ hash_t	hash_new(size_t size, hash_free_fn);
 void	hash_free(hash_t);
 
 /*
- * Add an item to the hash.  The specified key should not already exist; if it
- * does, undefined behaviour occurs.
+ * Add an item to the hash.  If the key already exists, its value is replaced,
+ * and the old value is freed with the hash's free function (unless it's the
+ * same pointer as the new value).  Callers may rely on this to update an
+ * entry in place.
  *
  * Returns 0 on success.  On errors, returns -1 and errno is set.
  */
@@ -0,0 +1,153 @@
+/* vim:set sw=8 ts=8 noet: */
+/*
+ * Copyright (c) 2016-2017 Torchbox Ltd.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely. This software is provided 'as-is', without any express or implied
+ * warranty.
+ */
+
+/*
+ * hash_bench: compare the performance of the hash implementations.
+ *
+ * This is built three times by "make hash-bench": once with the default
+ * open-addressing table, once with -DHASH_USE_CHAINED=1 and once with
+ * -DHASH_USE_RAX=1.  Each binary inserts a set of host-like keys, looks up
+ * every key (hits) and the same number of absent keys (misses), iterates the
+ * hash, then deletes every key, and prints the time per operation.
+ *
+ * usage: hash_bench [nkeys [size]]
+ *
+ * The defaults are 40000 keys and a size of 4093, which is what remap_db uses
+ * for rd_hosts.
+ */
+
+#include	<sys/types.h>
+
+#include	<stdio.h>
+#include	<stdlib.h>
+#include	<string.h>
+#include	<time.h>
+
+#include	"hash.h"
+
+#if HASH_USE_RAX
+# define	IMPL	"rax"
+#elif HASH_USE_CHAINED
+# define	IMPL	"chained"
+#else
+# define	IMPL	"open"
+#endif
+
+static double
+now(void)
+{
+struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void
+report(const char *what, double start, size_t nops)
+{
+	printf("%-8s %-8s %10zu ops %8.1f ns/op\n",
+	       IMPL, what, nops, (now() - start) / nops);
+}
+
+static char **
+make_keys(size_t n, const char *fmt)
+{
+char	**ret;
+size_t	  i;
+
+	if ((ret = calloc(n, sizeof(char *))) == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+
+	for (i = 0; i < n; i++) {
+	char	buf[128];
+		snprintf(buf, sizeof(buf), fmt, i);
+		if ((ret[i] = strdup(buf)) == NULL) {
+			perror("strdup");
+			exit(1);
+		}
+	}
+
+	return ret;
+}
+
+int
+main(int argc, char **argv)
+{
+size_t		 nkeys = 40000, size = 4093, i, n;
+char		**keys, **missing;
+hash_t		 hs;
+double		 start;
+const char	*k;
+void		*v;
+volatile size_t	 found = 0;
+
+	if (argc > 1)
+		nkeys = strtoul(argv[1], NULL, 10);
+	if (argc > 2)
+		size = strtoul(argv[2], NULL, 10);
+
+	if (nkeys == 0 || size == 0) {
+		fprintf(stderr, "usage: %s [nkeys [size]]\n", argv[0]);
+		return 1;
+	}
+
+	keys = make_keys(nkeys, "www%zu.example.com");
+	missing = make_keys(nkeys, "missing%zu.example.com");
+
+	if ((hs = hash_new(size, NULL)) == NULL) {
+		perror("hash_new");
+		return 1;
+	}
+
+	start = now();
+	for (i = 0; i < nkeys; i++)
+		hash_set(hs, keys[i], keys[i]);
+	report("insert", start, nkeys);
+
+	start = now();
+	for (i = 0; i < nkeys; i++)
+		if (hash_get(hs, keys[i]))
+			found++;
+	report("hit", start, nkeys);
+
+	start = now();
+	for (i = 0; i < nkeys; i++)
+		if (hash_get(hs, missing[i]))
+			found++;
+	report("miss", start, nkeys);
+
+	n = 0;
+	start = now();
+	hash_foreach(hs, &k, NULL, &v)
+		n++;
+	report("iterate", start, n);
+
+	start = now();
+	for (i = 0; i < nkeys; i++)
+		hash_del(hs, keys[i]);
+	report("delete", start, nkeys);
+
+	if (found != nkeys || n != nkeys) {
+		fprintf(stderr, "%s: expected %zu items, found %zu, iterated %zu\n",
+			argv[0], nkeys, (size_t)found, n);
+		return 1;
+	}
+
+	hash_free(hs);
+	for (i = 0; i < nkeys; i++) {
+		free(keys[i]);
+		free(missing[i]);
+	}
+	free(keys);
+	free(missing);
+	return 0;
+}
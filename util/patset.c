@@ -0,0 +1,231 @@
+/* vim:set sw=8 ts=8 noet: */
+/*
+ * Copyright (c) 2016-2017 Torchbox Ltd.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely. This software is provided 'as-is', without any express or implied
+ * warranty.
+ */
+
+#include	<sys/types.h>
+
+#include	<stdlib.h>
+#include	<string.h>
+#include	<strings.h>
+#include	<stdint.h>
+#include	<ctype.h>
+
+#include	"patset.h"
+#include	"hash.h"
+#include	"strmatch.h"
+
+/*
+ * Strings longer than this are not lowercased on the stack for the literal
+ * lookup; the literals are compared one at a time instead.
+ */
+#define	PATSET_MAX_LITERAL	256
+
+/*
+ * Literal patterns are stored (lowercased) in ps_literals; everything else is
+ * a pattern_t.
+ */
+typedef enum {
+	PS_AFFIX,		/* "foo*", "*foo" or "foo*bar"		*/
+	PS_GLOB,		/* anything else, matched with strmatch	*/
+} pattern_type_t;
+
+typedef struct pattern {
+	pattern_type_t	 pt_type;
+	char		*pt_pat;
+	size_t		 pt_len;
+	size_t		 pt_prefixlen;	/* PS_AFFIX */
+	const char	*pt_suffix;
+	size_t		 pt_suffixlen;
+} pattern_t;
+
+struct patset {
+	hash_t		 ps_literals;
+	size_t		 ps_maxliteral;
+	pattern_t	*ps_patterns;
+	size_t		 ps_npatterns;
+};
+
+patset_t *
+patset_new(void)
+{
+patset_t	*ret;
+
+	if ((ret = calloc(1, sizeof(*ret))) == NULL)
+		return NULL;
+
+	if ((ret->ps_literals = hash_new(127, NULL)) == NULL) {
+		free(ret);
+		return NULL;
+	}
+
+	return ret;
+}
+
+patset_t *
+patset_from_list(const char *list)
+{
+patset_t	*ret;
+const char	*p, *q;
+
+	if ((ret = patset_new()) == NULL)
+		return NULL;
+
+	for (p = list; *p; p = q) {
+		p += strspn(p, " \t");
+		q = p + strcspn(p, " \t");
+		if (q == p)
+			break;
+
+		if (patset_add(ret, p, q - p) == -1) {
+			patset_free(ret);
+			return NULL;
+		}
+	}
+
+	return ret;
+}
+
+void
+patset_free(patset_t *ps)
+{
+size_t	i;
+
+	if (!ps)
+		return;
+
+	for (i = 0; i < ps->ps_npatterns; i++)
+		free(ps->ps_patterns[i].pt_pat);
+	free(ps->ps_patterns);
+	hash_free(ps->ps_literals);
+	free(ps);
+}
+
+/*
+ * Return 1 if the string contains no glob metacharacters.
+ */
+static int
+is_literal(const char *s, size_t len)
+{
+size_t	i;
+
+	for (i = 0; i < len; i++)
+		if (strchr("*?[\\", s[i]))
+			return 0;
+	return 1;
+}
+
+int
+patset_add(patset_t *ps, const char *pat, size_t patlen)
+{
+pattern_t	*pt, *np;
+const char	*star;
+size_t		 i, pfx, sfx;
+
+	if (is_literal(pat, patlen)) {
+	char	*lower;
+	int	 ret;
+
+		if ((lower = malloc(patlen + 1)) == NULL)
+			return -1;
+		for (i = 0; i < patlen; i++)
+			lower[i] = tolower((unsigned char) pat[i]);
+		lower[patlen] = '\0';
+
+		ret = hash_setn(ps->ps_literals, lower, patlen, HASH_PRESENT);
+		free(lower);
+		if (ret == -1)
+			return -1;
+
+		if (patlen > ps->ps_maxliteral)
+			ps->ps_maxliteral = patlen;
+		return 0;
+	}
+
+	np = realloc(ps->ps_patterns,
+		     sizeof(pattern_t) * (ps->ps_npatterns + 1));
+	if (np == NULL)
+		return -1;
+	ps->ps_patterns = np;
+
+	pt = &ps->ps_patterns[ps->ps_npatterns];
+	memset(pt, 0, sizeof(*pt));
+	if ((pt->pt_pat = strndup(pat, patlen)) == NULL)
+		return -1;
+	pt->pt_len = patlen;
+	pt->pt_type = PS_GLOB;
+
+	/*
+	 * If the only metacharacters in the pattern are a single run of '*',
+	 * it can be matched by comparing the prefix and suffix.
+	 */
+	if ((star = memchr(pat, '*', patlen)) != NULL) {
+		pfx = star - pat;
+		for (sfx = pfx; sfx < patlen && pat[sfx] == '*'; sfx++)
+			;
+
+		if (is_literal(pat, pfx) && is_literal(pat + sfx, patlen - sfx)) {
+			pt->pt_type = PS_AFFIX;
+			pt->pt_prefixlen = pfx;
+			pt->pt_suffix = pt->pt_pat + sfx;
+			pt->pt_suffixlen = patlen - sfx;
+		}
+	}
+
+	ps->ps_npatterns++;
+	return 0;
+}
+
+int
+patset_match(const patset_t *ps, const char *str, size_t len)
+{
+size_t	i;
+
+	if (len <= ps->ps_maxliteral) {
+		if (len <= PATSET_MAX_LITERAL) {
+		char	lower[PATSET_MAX_LITERAL + 1];
+
+			for (i = 0; i < len; i++)
+				lower[i] = tolower((unsigned char) str[i]);
+
+			if (hash_getn(ps->ps_literals, lower, len))
+				return 1;
+		} else {
+		const char	*k;
+		size_t		 klen;
+
+			hash_foreach(ps->ps_literals, &k, &klen, NULL)
+				if (klen == len && strncasecmp(k, str, len) == 0)
+					return 1;
+		}
+	}
+
+	for (i = 0; i < ps->ps_npatterns; i++) {
+	const pattern_t	*pt = &ps->ps_patterns[i];
+
+		switch (pt->pt_type) {
+		case PS_AFFIX:
+			if (len < pt->pt_prefixlen + pt->pt_suffixlen)
+				break;
+			if (strncasecmp(str, pt->pt_pat, pt->pt_prefixlen))
+				break;
+			if (strncasecmp(str + len - pt->pt_suffixlen,
+					pt->pt_suffix, pt->pt_suffixlen))
+				break;
+			return 1;
+
+		case PS_GLOB:
+			if (strmatch(str, str + len,
+				     pt->pt_pat, pt->pt_pat + pt->pt_len))
+				return 1;
+			break;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,58 @@
+/* vim:set sw=8 ts=8 noet: */
+/*
+ * Copyright (c) 2016-2017 Torchbox Ltd.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely. This software is provided 'as-is', without any express or implied
+ * warranty.
+ */
+/*
+ * patset.h: a set of shell-style glob patterns (as understood by strmatch())
+ * compiled for matching many strings against the whole set at once.
+ *
+ * Patterns are classified when they're added.  Literal patterns go into a
+ * hash, so matching them costs one lookup however many there are; patterns of
+ * the form "prefix*", "*suffix" and "prefix*suffix" are matched by comparing
+ * the ends of the string.  Only patterns more complicated than that are
+ * passed to strmatch().  Like strmatch(), matching ignores case.
+ */
+
+#ifndef PATSET_H
+#define PATSET_H
+
+#include	<stdlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct patset patset_t;
+
+/*
+ * Create a new, empty pattern set.  Returns NULL on failure.
+ */
+patset_t	*patset_new(void);
+
+/*
+ * Create a pattern set from a list of patterns separated by spaces or tabs.
+ */
+patset_t	*patset_from_list(const char *list);
+
+void		 patset_free(patset_t *);
+
+/*
+ * Add a pattern to the set.  Returns 0 on success, or -1 on failure.
+ */
+int		 patset_add(patset_t *, const char *pat, size_t patlen);
+
+/*
+ * Return 1 if the string matches any pattern in the set, otherwise 0.
+ */
+int		 patset_match(const patset_t *, const char *str, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* !PATSET_H */
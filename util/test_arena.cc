@@ -0,0 +1,132 @@
+/* vim:set sw=8 ts=8 noet: */
+/*
+ * Copyright (c) 2016-2017 Torchbox Ltd.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely. This software is provided 'as-is', without any express or implied
+ * warranty.
+ */
+
+/*
+ * Tests for arena.c: bump allocator.
+ */
+
+#include	<cstring>
+#include	<cstdint>
+#include	<vector>
+
+#include	"arena.h"
+
+#include	"gtest/gtest.h"
+#include	"tests/test.h"
+
+using std::vector;
+
+TEST(Arena, StrDup)
+{
+	arena_t ar;
+	arena_init(&ar, nullptr, 0);
+	scoped_c_ptr<arena_t *> ar_(&ar, arena_reset);
+
+	char *s = arena_strdup(&ar, "foo");
+	char *t = arena_strndup(&ar, "barbaz", 3);
+
+	EXPECT_STREQ("foo", s);
+	EXPECT_STREQ("bar", t);
+}
+
+TEST(Arena, Alignment)
+{
+	char buf[256];
+	arena_t ar;
+
+	/* Deliberately misalign the initial buffer */
+	arena_init(&ar, buf + 1, sizeof(buf) - 1);
+	scoped_c_ptr<arena_t *> ar_(&ar, arena_reset);
+
+	for (size_t sz: { 1, 3, 8, 17, 100, 5000 }) {
+		void *p = arena_alloc(&ar, sz);
+		ASSERT_TRUE(p != nullptr);
+		EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(p) % 16)
+			<< "size " << sz;
+	}
+}
+
+TEST(Arena, AlignedAlloc)
+{
+	arena_t ar;
+	arena_init(&ar, nullptr, 0);
+	scoped_c_ptr<arena_t *> ar_(&ar, arena_reset);
+
+	/* Mix aligned allocations with ones which misalign the next */
+	for (size_t sz: { 1, 64, 17, 100, 2000, 5000 }) {
+		arena_alloc(&ar, 16);
+		void *p = arena_alloc_aligned(&ar, sz, 64);
+		ASSERT_TRUE(p != nullptr);
+		EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(p) % 64)
+			<< "size " << sz;
+		memset(p, 0, sz);
+	}
+
+	/* Consecutive aligned allocations don't overlap */
+	char *a = static_cast<char *>(arena_alloc_aligned(&ar, 64, 64));
+	char *b = static_cast<char *>(arena_alloc_aligned(&ar, 64, 64));
+	ASSERT_TRUE(a != nullptr && b != nullptr);
+	EXPECT_TRUE(b >= a + 64 || a >= b + 64);
+}
+
+TEST(Arena, InitialBuffer)
+{
+	char buf[256];
+	arena_t ar;
+
+	arena_init(&ar, buf, sizeof(buf));
+	scoped_c_ptr<arena_t *> ar_(&ar, arena_reset);
+
+	/* Small allocations come from the buffer */
+	char *p = static_cast<char *>(arena_alloc(&ar, 32));
+	EXPECT_TRUE(p >= buf && p < buf + sizeof(buf));
+
+	/* Once the buffer is full, we fall back to the heap */
+	char *q = static_cast<char *>(arena_alloc(&ar, 512));
+	ASSERT_TRUE(q != nullptr);
+	EXPECT_FALSE(q >= buf && q < buf + sizeof(buf));
+
+	/* After a reset, the buffer is used again */
+	arena_reset(&ar);
+	char *r = static_cast<char *>(arena_alloc(&ar, 32));
+	EXPECT_EQ(p, r);
+}
+
+TEST(Arena, ManyAllocations)
+{
+	arena_t ar;
+	arena_init(&ar, nullptr, 0);
+	scoped_c_ptr<arena_t *> ar_(&ar, arena_reset);
+
+	/*
+	 * Allocate enough to span many blocks, and make sure nothing
+	 * overlaps.
+	 */
+	vector<unsigned char *> ptrs;
+	for (int i = 0; i < 2000; ++i) {
+		size_t sz = 1 + (i * 37) % 1500;
+		unsigned char *p = static_cast<unsigned char *>(
+			arena_alloc(&ar, sz));
+		ASSERT_TRUE(p != nullptr);
+		memset(p, i & 0xFF, sz);
+		ptrs.push_back(p);
+	}
+
+	for (int i = 0; i < 2000; ++i) {
+		size_t sz = 1 + (i * 37) % 1500;
+		for (size_t j = 0; j < sz; ++j)
+			ASSERT_EQ(i & 0xFF, ptrs[i][j]) << "allocation " << i;
+	}
+
+	unsigned char *z = static_cast<unsigned char *>(
+		arena_calloc(&ar, 10, 10));
+	for (int i = 0; i < 100; ++i)
+		EXPECT_EQ(0, z[i]);
+}
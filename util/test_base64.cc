@@ -78,3 +78,41 @@ TEST(Base64, Decode)
 			<< string(decoded.begin(), decoded.end()) << "]";
 	}
 }
+
+/*
+ * Check every available encoder against the scalar encoder, for a range of
+ * lengths around the vector block sizes and all byte values.
+ */
+TEST(Base64, EncodersAgree)
+{
+	vector<unsigned char> input(300);
+	for (size_t i = 0; i < input.size(); i++)
+		input[i] = (unsigned char)((i * 167 + 13) & 0xFF);
+
+	for (auto name: { "scalar", "ssse3", "avx2" }) {
+	base64_encode_fn	fn = base64_encoder(name);
+
+		if (fn == NULL)
+			continue;
+
+		for (size_t len = 0; len <= input.size(); len++) {
+		size_t	n = base64_encode_len(len);
+			vector<char> expected(n + 1, '!'), actual(n + 1, '!');
+
+			base64_encode_scalar(&input[0], len, &expected[0]);
+			fn(&input[0], len, &actual[0]);
+
+			ASSERT_EQ(expected, actual)
+				<< "encoder " << name << " length " << len;
+
+			/* And the result must decode to the input */
+			vector<unsigned char> decoded(base64_decode_len(n) + 1);
+			ssize_t d = base64_decode(&actual[0], n, &decoded[0]);
+			ASSERT_EQ((ssize_t)len, d);
+			ASSERT_TRUE(equal(input.begin(), input.begin() + len,
+					  decoded.begin()));
+		}
+	}
+
+	EXPECT_EQ(nullptr, base64_encoder("nonexistent"));
+}
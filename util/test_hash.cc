@@ -9,7 +9,7 @@
  */
 
 /*
- * Tests for hash.c: simple FNV-1a-based hash table.
+ * Tests for hash.c: FNV-1a-based open-addressing hash table.
  */
 
 #include	<string>
@@ -159,3 +159,117 @@ int			 i = 0;
 	EXPECT_EQ(klen, 0u);
 	EXPECT_EQ(v, HASH_PRESENT);
 }
+
+/*
+ * Insert and delete enough items to make the table grow several times and
+ * leave plenty of deleted slots behind, with both short (inline) and long keys.
+ */
+TEST(Hash, GrowAndDelete)
+{
+hash_t			 hs;
+map<string, int>	 expected;
+const int		 nitems = 20000;
+static int		 values[nitems];
+
+	/* Odd keys are short; even keys are too long to store inline. */
+	auto key_for = [](int i) {
+		return (i % 2) ? std::to_string(i)
+			       : "a-rather-long-host-name-" + std::to_string(i)
+				 + ".example.com";
+	};
+
+	hs = hash_new(7, NULL);
+	scoped_c_ptr<hash_t> hs_(hs, hash_free);
+
+	for (int i = 0; i < nitems; i++) {
+	string	key = key_for(i);
+
+		values[i] = i;
+		ASSERT_EQ(0, hash_set(hs, key.c_str(), &values[i]));
+		expected[key] = i;
+	}
+
+	/* Delete every third item. */
+	for (auto it = expected.begin(); it != expected.end();) {
+		if (it->second % 3 == 0) {
+			hash_del(hs, it->first.c_str());
+			it = expected.erase(it);
+		} else
+			++it;
+	}
+
+	for (int i = 0; i < nitems; i += 3)
+		EXPECT_EQ(nullptr, hash_get(hs, key_for(i).c_str())) << i;
+
+	for (auto const &item: expected) {
+	int	*v = static_cast<int *>(hash_get(hs, item.first.c_str()));
+		ASSERT_NE(nullptr, v);
+		EXPECT_EQ(item.second, *v);
+	}
+
+	map<string, int>	 actual;
+	const char		*key;
+	size_t			 keylen;
+	int			*value;
+
+	hash_foreach(hs, &key, &keylen, &value) {
+		EXPECT_EQ(keylen, strlen(key));
+		actual[string(key, keylen)] = *value;
+	}
+
+	EXPECT_EQ(expected, actual);
+}
+
+TEST(Hash, Replace)
+{
+hash_t	hs;
+int	n = 0;
+
+	hs = hash_new(1, [](void *) {});
+	scoped_c_ptr<hash_t> hs_(hs, hash_free);
+
+	hash_set(hs, "foo", &n);
+	hash_set(hs, "foo", HASH_PRESENT);
+	EXPECT_EQ(HASH_PRESENT, hash_get(hs, "foo"));
+
+	n = 0;
+	hash_foreach(hs, NULL, NULL, NULL)
+		n++;
+	EXPECT_EQ(1, n);
+}
+
+namespace {
+	int nfreed;
+
+	void
+	count_free(void *)
+	{
+		nfreed++;
+	}
+} // anonymous namespace
+
+TEST(Hash, ReplaceFrees)
+{
+hash_t	hs;
+int	a, b;
+
+	nfreed = 0;
+	hs = hash_new(1, count_free);
+	scoped_c_ptr<hash_t> hs_(hs, hash_free);
+
+	/* Replacing a value frees the old one */
+	hash_set(hs, "foo", &a);
+	hash_set(hs, "foo", &b);
+	EXPECT_EQ(1, nfreed);
+	EXPECT_EQ(&b, hash_get(hs, "foo"));
+
+	/* ... unless it's the same value */
+	hash_set(hs, "foo", &b);
+	EXPECT_EQ(1, nfreed);
+	EXPECT_EQ(&b, hash_get(hs, "foo"));
+
+	/* hash_setn() only uses keylen bytes of the key */
+	hash_setn(hs, "foobar", 3, &a);
+	EXPECT_EQ(2, nfreed);
+	EXPECT_EQ(&a, hash_get(hs, "foo"));
+}
@@ -0,0 +1,104 @@
+/* vim:set sw=8 ts=8 noet: */
+/*
+ * Copyright (c) 2016-2017 Torchbox Ltd.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely. This software is provided 'as-is', without any express or implied
+ * warranty.
+ */
+
+/*
+ * Tests for patset.c: compiled glob pattern sets.
+ */
+
+#include	<cstring>
+#include	<string>
+#include	<vector>
+
+#include	"patset.h"
+#include	"strmatch.h"
+
+#include	"gtest/gtest.h"
+#include	"tests/test.h"
+
+using std::string;
+using std::vector;
+
+namespace {
+	bool
+	match(patset_t *ps, string const &s)
+	{
+		return patset_match(ps, s.data(), s.size()) != 0;
+	}
+}
+
+TEST(PatSet, Literal)
+{
+	patset_t *ps = patset_from_list("foo  bar\tQuux");
+	ASSERT_NE(nullptr, ps);
+	scoped_c_ptr<patset_t *> ps_(ps, patset_free);
+
+	EXPECT_TRUE(match(ps, "foo"));
+	EXPECT_TRUE(match(ps, "BAR"));
+	EXPECT_TRUE(match(ps, "quux"));
+	EXPECT_FALSE(match(ps, "fo"));
+	EXPECT_FALSE(match(ps, "fooo"));
+	EXPECT_FALSE(match(ps, ""));
+}
+
+TEST(PatSet, Affix)
+{
+	patset_t *ps = patset_from_list("utm_* *_id a**z");
+	ASSERT_NE(nullptr, ps);
+	scoped_c_ptr<patset_t *> ps_(ps, patset_free);
+
+	EXPECT_TRUE(match(ps, "utm_source"));
+	EXPECT_TRUE(match(ps, "UTM_"));
+	EXPECT_TRUE(match(ps, "session_id"));
+	EXPECT_TRUE(match(ps, "az"));
+	EXPECT_TRUE(match(ps, "abcz"));
+	EXPECT_FALSE(match(ps, "utm"));
+	EXPECT_FALSE(match(ps, "id"));
+	EXPECT_FALSE(match(ps, "zza"));
+}
+
+TEST(PatSet, Empty)
+{
+	patset_t *ps = patset_from_list("");
+	ASSERT_NE(nullptr, ps);
+	scoped_c_ptr<patset_t *> ps_(ps, patset_free);
+
+	EXPECT_FALSE(match(ps, "foo"));
+	EXPECT_FALSE(match(ps, ""));
+}
+
+/*
+ * Every pattern, however it's compiled, should give the same result as
+ * matching it with strmatch().
+ */
+TEST(PatSet, SameAsStrmatch)
+{
+	vector<string> patterns{
+		"foo", "foo*", "*foo", "f*o", "*", "f?o", "f[a-o]o", "*o*",
+		"fo\\*", "[!f]*", "**", "a*b*c",
+	};
+	vector<string> strings{
+		"", "f", "fo", "foo", "FOO", "fooo", "ffoo", "fxo", "fo*",
+		"abc", "aXbYc", "ab", "xfoox",
+	};
+
+	for (auto const &pat: patterns) {
+		patset_t *ps = patset_new();
+		ASSERT_NE(nullptr, ps);
+		scoped_c_ptr<patset_t *> ps_(ps, patset_free);
+		ASSERT_EQ(0, patset_add(ps, pat.data(), pat.size()));
+
+		for (auto const &s: strings) {
+			bool expected = strmatch(s.data(), s.data() + s.size(),
+				pat.data(), pat.data() + pat.size()) != 0;
+			EXPECT_EQ(expected, match(ps, s))
+				<< "pattern [" << pat << "] string [" << s << "]";
+		}
+	}
+}